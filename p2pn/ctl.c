@@ -0,0 +1,330 @@
+/**
+ * @brief local control socket, see ctl.h
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "list.h"
+#include "sock_util.h"
+#include "util.h"
+#include "query.h"
+#include "ctl.h"
+
+struct ctl_client {
+    int                 fd;
+    unsigned int        serial;     /* Unique ID, fd might be reused */
+    char                in[CTL_LINE];
+    unsigned int        in_len;
+    char               *out;        /* Output not written yet */
+    unsigned int        out_len;
+    unsigned int        out_cap;
+    uint32_t            query;      /* Waiting for hits of it, 0 if none */
+    unsigned int        hits;
+    int                 done;       /* Close once output is written */
+    struct list_head    list;
+};
+
+static int              ctl_fd = -1;
+static char             ctl_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+static ctl_cmd_t        ctl_cmd;
+static struct list_head ctl_clients = LIST_HEAD_INIT(ctl_clients);
+
+static int
+set_nonblock(int fd)
+{
+    return fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+}
+
+static void
+client_del(struct ctl_client *c)
+{
+    uint32_t query;
+
+    if ((query = c->query) != 0) {
+        c->query = 0;
+        query_cancel(query);
+    }
+    list_del(&c->list);
+    Close(c->fd);
+    free(c->out);
+    free(c);
+}
+
+static struct ctl_client *
+client_find(int fd)
+{
+    struct ctl_client *c;
+
+    list_for_each_entry(c, &ctl_clients, list) {
+        if (c->fd == fd)
+            return c;
+    }
+
+    return NULL;
+}
+
+/**
+ * Create the control socket, a stale one left by a previous node is
+ * replaced.
+ */
+int
+ctl_open(const char *path, ctl_cmd_t cmd)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        p2plog(ERROR, "Control socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        perror("ctl_open(), socket");
+        return -1;
+    }
+    unlink(path);
+    if (bind(fd, (SA *)&addr, sizeof(addr)) != 0 || listen(fd, 5) != 0 ||
+        set_nonblock(fd) != 0) {
+        perror("ctl_open(), bind");
+        close(fd);
+        return -1;
+    }
+
+    strcpy(ctl_path, path);
+    ctl_fd = fd;
+    ctl_cmd = cmd;
+    return fd;
+}
+
+void
+ctl_close()
+{
+    struct ctl_client *c, *c_tmp;
+
+    if (ctl_fd < 0)
+        return;
+
+    list_for_each_entry_safe(c, c_tmp, &ctl_clients, list) {
+        client_del(c);
+    }
+    Close(ctl_fd);
+    unlink(ctl_path);
+    ctl_fd = -1;
+}
+
+void
+ctl_accept()
+{
+    static unsigned int serial;
+    struct ctl_client *c;
+    int fd;
+
+    if ((fd = accept(ctl_fd, NULL, NULL)) < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            perror("ctl_accept(), accept");
+        return;
+    }
+    if (set_nonblock(fd) != 0) {
+        perror("ctl_accept(), fcntl");
+        close(fd);
+        return;
+    }
+
+    if ((c = calloc(1, sizeof(struct ctl_client))) == NULL) {
+        perror("calloc error");
+        exit(1);
+    }
+    c->fd = fd;
+    c->serial = ++serial;
+    if (c->serial == 0)
+        c->serial = ++serial;
+    list_add_tail(&c->list, &ctl_clients);
+}
+
+/**
+ * Read the command line of a client and run it. Anything after the first
+ * line is ignored.
+ */
+void
+ctl_input(int fd)
+{
+    struct ctl_client *c;
+    ssize_t n;
+    char *eol;
+
+    if ((c = client_find(fd)) == NULL)
+        return;
+
+    n = read(fd, c->in + c->in_len, CTL_LINE - 1 - c->in_len);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return;
+    if (n <= 0) {
+        /* Gone, e.g. p2pctl interrupted while streaming hits */
+        client_del(c);
+        return;
+    }
+    if (c->done || c->query != 0)
+        return;
+
+    c->in_len += n;
+    c->in[c->in_len] = '\0';
+    if ((eol = strchr(c->in, '\n')) == NULL) {
+        if (c->in_len == CTL_LINE - 1) {
+            ctl_printf(c, "error line too long\n");
+            ctl_end(c);
+        }
+        return;
+    }
+    *eol = '\0';
+    if (eol > c->in && eol[-1] == '\r')
+        eol[-1] = '\0';
+
+    ctl_cmd(c, c->in);
+}
+
+/**
+ * Write what the clients take now.
+ */
+void
+ctl_flush()
+{
+    struct ctl_client *c, *c_tmp;
+    ssize_t n;
+
+    list_for_each_entry_safe(c, c_tmp, &ctl_clients, list) {
+        if (c->out_len > 0) {
+            n = write(c->fd, c->out, c->out_len);
+            if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK &&
+                errno != EINTR) {
+                client_del(c);
+                continue;
+            }
+            if (n > 0) {
+                memmove(c->out, c->out + n, c->out_len - n);
+                c->out_len -= n;
+            }
+        }
+
+        if (c->done && c->out_len == 0)
+            client_del(c);
+    }
+}
+
+void
+ctl_handle(int (*readable)(int fd))
+{
+    struct ctl_client *c, *c_tmp;
+
+    if (ctl_fd < 0)
+        return;
+
+    if (readable(ctl_fd))
+        ctl_accept();
+    list_for_each_entry_safe(c, c_tmp, &ctl_clients, list) {
+        if (readable(c->fd))
+            ctl_input(c->fd);
+    }
+}
+
+void
+ctl_watch(void (*watch)(int fd, short events))
+{
+    struct ctl_client *c;
+
+    if (ctl_fd < 0)
+        return;
+
+    watch(ctl_fd, POLLIN);
+    list_for_each_entry(c, &ctl_clients, list)
+        watch(c->fd, c->out_len > 0 ? POLLIN | POLLOUT : POLLIN);
+}
+
+unsigned int
+ctl_serial(int fd)
+{
+    struct ctl_client *c;
+
+    return (c = client_find(fd)) != NULL ? c->serial : 0;
+}
+
+int
+ctl_client_fd(int n)
+{
+    struct ctl_client *c;
+
+    list_for_each_entry(c, &ctl_clients, list) {
+        if (n-- == 0)
+            return c->fd;
+    }
+
+    return -1;
+}
+
+void
+ctl_printf(struct ctl_client *c, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    for ( ; ; ) {
+        va_start(ap, fmt);
+        n = vsnprintf(c->out != NULL ? c->out + c->out_len : NULL, 
+                      c->out_cap - c->out_len, fmt, ap);
+        va_end(ap);
+        if (n < 0)
+            return;
+        if (c->out_len + n < c->out_cap)
+            break;
+
+        /* A client not reading its output loses the rest */
+        if (c->out_len + n >= CTL_OUT_MAX)
+            return;
+        c->out_cap = c->out_cap > 0 ? c->out_cap : 1024;
+        while (c->out_cap <= c->out_len + n)
+            c->out_cap *= 2;
+        if ((c->out = realloc(c->out, c->out_cap)) == NULL) {
+            perror("realloc error");
+            exit(1);
+        }
+    }
+    c->out_len += n;
+}
+
+void
+ctl_end(struct ctl_client *c)
+{
+    c->done = 1;
+}
+
+void
+ctl_wait_hits(struct ctl_client *c, uint32_t msg_id)
+{
+    c->query = msg_id;
+    c->hits = 0;
+}
+
+void
+ctl_hit(struct ctl_client *c, const char *line)
+{
+    ctl_printf(c, "%s", line);
+    c->hits++;
+}
+
+void
+ctl_hits_end(struct ctl_client *c)
+{
+    ctl_printf(c, "end %u hits\n", c->hits);
+    c->query = 0;
+    c->done = 1;
+}
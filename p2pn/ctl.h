@@ -0,0 +1,70 @@
+#ifndef CTL_H
+#define CTL_H
+
+#include <stdint.h>
+#include <poll.h>
+
+/**
+ * Local control socket (unix domain) for p2pctl. A client sends one command
+ * line, the node answers with lines of text and closes the connection,
+ * after the hits have been streamed for a query. Clients never block the
+ * node loop: input is read when available and output is buffered.
+ */
+
+/* Max length of a command line */
+#define CTL_LINE        256
+/* Max bytes of output buffered for a client, the rest is dropped */
+#define CTL_OUT_MAX     (256 * 1024)
+/* Default and max seconds a query waits for hits */
+#define CTL_QUERY_SECONDS       5
+#define CTL_QUERY_SECONDS_MAX   60
+
+struct ctl_client;
+
+/* Called with each command line received */
+typedef void (*ctl_cmd_t)(struct ctl_client *c, char *line);
+
+/* Bind the socket at path, return its fd, or -1 on failure */
+int ctl_open(const char *path, ctl_cmd_t cmd);
+
+/* Close all clients and remove the socket */
+void ctl_close();
+
+/* Accept a pending client */
+void ctl_accept();
+
+/* Read input of a client */
+void ctl_input(int fd);
+
+/* Write buffered output and close finished clients */
+void ctl_flush();
+
+/* Pass the socket and the clients with the poll events they wait for */
+void ctl_watch(void (*watch)(int fd, short events));
+
+/* Accept and read the clients for which readable() says there is input */
+void ctl_handle(int (*readable)(int fd));
+
+/* Get the serial of the client on fd, 0 if there is none */
+unsigned int ctl_serial(int fd);
+
+/* Get the fd of the n-th client, -1 past the last one */
+int ctl_client_fd(int n);
+
+/* Queue formatted output to a client */
+void ctl_printf(struct ctl_client *c, const char *fmt, ...);
+
+/* Close the client once its output has been written */
+void ctl_end(struct ctl_client *c);
+
+/* Keep the client open for the hits of query msg_id, which is cancelled if
+ * the client goes away */
+void ctl_wait_hits(struct ctl_client *c, uint32_t msg_id);
+
+/* Pass a line about a hit to the client */
+void ctl_hit(struct ctl_client *c, const char *line);
+
+/* End the hits with their number, and close the client */
+void ctl_hits_end(struct ctl_client *c);
+
+#endif
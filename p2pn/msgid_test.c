@@ -0,0 +1,103 @@
+/**
+ * @brief msgid_test, check the message IDs of msgid_next(), run by make test
+ *
+ * Each seed generates PER_SEED IDs, none may be 0 or repeat. The IDs of all
+ * seeds together then collide across seeds about as often as random 32-bit
+ * numbers would, the birthday bound. The seeds include neighbouring values
+ * and all start from the same sequence number, as nodes started at once on
+ * one host would.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "proto.h"
+
+#define PER_SEED    (4u << 20)
+/* Off the birthday bound by more than this many standard deviations fails */
+#define MAX_SIGMA   5.0
+
+static const uint32_t seeds[] = { 0, 1, 2, 0x9E3779B9U };
+#define NSEEDS      (sizeof(seeds) / sizeof(seeds[0]))
+
+static int
+cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Sort the IDs and count the pairs of equal ones */
+static double
+count_pairs(uint32_t *ids, size_t n)
+{
+    double pairs = 0;
+    size_t i, run;
+
+    qsort(ids, n, sizeof(uint32_t), cmp_u32);
+    for (i = 0; i < n; i += run) {
+        for (run = 1; i + run < n && ids[i + run] == ids[i]; run++)
+            ;
+        pairs += (double)run * (run - 1) / 2;
+    }
+
+    return pairs;
+}
+
+int
+main()
+{
+    uint32_t *ids, *all, seq;
+    double k, expect, pairs, sigma;
+    size_t i, s;
+    int fail = 0;
+
+    ids = malloc(PER_SEED * sizeof(uint32_t));
+    all = malloc(NSEEDS * PER_SEED * sizeof(uint32_t));
+    if (ids == NULL || all == NULL) {
+        perror("malloc error");
+        exit(1);
+    }
+
+    for (s = 0; s < NSEEDS; s++) {
+        seq = 0;
+        for (i = 0; i < PER_SEED; i++) {
+            ids[i] = msgid_next(seeds[s], &seq);
+            if (ids[i] == 0) {
+                printf("FAIL seed %08X: ID %lu is 0\n", (unsigned)seeds[s],
+                       (unsigned long)i);
+                fail = 1;
+            }
+        }
+        memcpy(all + s * PER_SEED, ids, PER_SEED * sizeof(uint32_t));
+
+        pairs = count_pairs(ids, PER_SEED);
+        printf("%s seed %08X: %u IDs, %.0f repeated\n", pairs ? "FAIL" : "ok",
+               (unsigned)seeds[s], PER_SEED, pairs);
+        if (pairs)
+            fail = 1;
+    }
+
+    /**
+     * The pairs of IDs from different seeds, each equal with p = 2^-32. If
+     * sequence number a of one seed gives the ID of b of another, b of the
+     * one gives that of a of the other, so the collisions come in twos and
+     * their variance is twice the mean.
+     */
+    k = (double)NSEEDS * PER_SEED;
+    expect = (k * k - NSEEDS * (double)PER_SEED * PER_SEED) / 2 / 4294967296.0;
+    pairs = count_pairs(all, NSEEDS * PER_SEED);
+    sigma = (pairs - expect) / sqrt(2 * expect);
+    printf("%s %u seeds: %.0f collisions across seeds, birthday bound %.0f "
+           "(%+.1f sigma)\n", fabs(sigma) > MAX_SIGMA ? "FAIL" : "ok",
+           (unsigned)NSEEDS, pairs, expect, sigma);
+    if (fabs(sigma) > MAX_SIGMA)
+        fail = 1;
+
+    free(ids);
+    free(all);
+    return fail;
+}
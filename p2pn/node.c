@@ -0,0 +1,2496 @@
+#define _POSIX_C_SOURCE     2       /* sigaction() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <ifaddrs.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <netinet/tcp.h>
+
+#include "list.h"
+#include "sock_util.h"
+#include "util.h"
+#include "proto.h"
+#include "pmon.h"
+#include "udp.h"
+#include "ctl.h"
+#include "p2pn.h"
+#include "query.h"
+#include "sub.h"
+#include "route.h"
+#ifdef USE_URING
+#include <linux/io_uring.h>
+#include "uring.h"
+#endif
+
+/* Data structure */
+struct key_value        g_kv_list;      /* List of key/value pairs */
+struct peer_cache       g_pc_list;      /* List of peer caches */
+struct message          g_msg_list;     /* List of messages */
+
+struct nb_node          g_nb_list;      /* List of neighbor nodes */
+int                     g_nb_list_size; /* Size of neighbor node list */
+unsigned int            g_nb_list_gen;  /* Changed with the neighbour set */
+
+struct wt_node          g_wt_list;      /* List of waiting nodes */
+int                     g_wt_list_size; /* Size of waiting node list */
+
+struct hc_entry         g_hc_list;      /* List of host cache entries */
+int                     g_hc_list_size; /* Size of host cache list */
+
+struct ifaddrs         *g_ifaddrs;      /* List of all interfaces */
+
+/* Node info */
+enum LOGLEVEL           g_loglv = INFO; /* Logging level */
+struct sockaddr_in6     g_lstn_addr;    /* Listening address */
+int                     g_ad_num;       /* Peers number in advertisement */
+int                     g_auto_join;    /* Flag of auto join nodes */
+enum NODEMODE           g_node_mode;    /* Role of this node */
+int                     g_nb_max;       /* Max number of neighbours */
+int                     g_udp_fd = -1;  /* Datagram socket, -1 if off */
+int                     g_dgram_in;     /* Handling a datagram? */
+
+static int              lstn_fd = -1;   /* Listen socket */
+static const char      *search_key;     /* Search key */
+static const char      *hc_file;        /* Host cache file */
+static const char      *kv_file;        /* Key/value data file */
+static struct stat      kv_stat;        /* Reloaded when it changes */
+static int              listen_queue;   /* Backlog of the listen socket */
+static int              recv_budget;    /* Bytes read from a peer at once */
+static int              use_udp;        /* Datagram side channel wanted */
+static const char      *ctl_path;       /* Control socket, NULL if none */
+static int              ctl_lfd = -1;   /* Listening control socket */
+
+/* Other static variables */
+static int              peer_error;
+static struct sigaction act;
+
+/* Hot restart under pmon */
+static int              handoff_in = -1;    /* Receive connections from */
+static int              handoff_out = -1;   /* Hand off connections to */
+static volatile sig_atomic_t handoff_req;   /* Restart has been requested */
+static int              health_fd = -1;     /* Liveness probes from pmon */
+static time_t           start_time;         /* When the node started */
+
+/* Counters */
+static unsigned long    query_throttled;    /* QUERY dropped by rate limit */
+static unsigned long    send_msgs;          /* Messages written to peers */
+static unsigned long    send_calls;         /* System calls writing them */
+
+/* The node handle of libp2pn, the state itself is global */
+struct p2pn_node {
+    int                 open;
+    int                 pending;    /* QUERY still queued after a step */
+    p2pn_hit_cb         hit_cb;
+    void               *hit_arg;
+};
+static struct p2pn_node node_handle;
+
+/* A hit passed to the application, see p2pn.h */
+struct p2pn_hit {
+    struct query_hit    qh;
+};
+
+/* The callback of a query of the application, see p2pn_query_async() */
+struct app_query {
+    p2pn_query_cb       cb;
+    void               *arg;
+};
+
+#if P2PN_HIT != QUERY_HIT || P2PN_DONE != QUERY_DONE || \
+    P2PN_CANCELLED != QUERY_CANCELLED || \
+    P2PN_QUERY_FIRST != QUERY_F_FIRST || P2PN_QUERY_WALK != QUERY_F_WALK
+#error "p2pn.h and query.h disagree on the status or flags of a query"
+#endif
+
+/* Time for maintenance */
+#define SELECT_SECONDS       3
+#define  HBEAT_SECONDS       5
+#define GOSSIP_SECONDS      10      /* Heartbeat even if busy, to gossip */
+#define  PROBE_SECONDS       8
+#define  PROBE_FANOUT        3
+#define  QUERY_SECONDS      10
+#define ZOMBIE_SECONDS      30
+#define UDP_MISS_MAX         2      /* Heartbeats lost before using TCP */
+#define CONNECT_SECONDS      3
+#define INCOMING_SECONDS     5
+#define  CACHE_SECONDS      30
+#define   CAND_SECONDS      60
+#define     KV_SECONDS       5      /* Check the kvfile for changes */
+
+#define INCOMING_MAX        16
+
+/* Query scheduling: bytes added to a neighbour's deficit per round, and
+ * max number of QUERY processed per loop iteration */
+#define QUERY_QUANTUM      256
+#define QUERY_BUDGET        64
+#define NEIGHBOUR_MAX        8
+#define NEIGHBOUR_MAX_SUPER 32
+#define NEIGHBOUR_MAX_LEAF   3
+
+
+static void sig_pipe(int s)
+{
+    peer_error = 4;
+    sigaction(s, &act, NULL);
+}
+
+static void sig_usr2(int s)
+{
+    (void)s;
+    handoff_req = 1;
+}
+
+/**
+ * Queue an inbound QUERY for processing by schedule_queries().
+ *
+ * Each neighbour has a token bucket on inbound QUERY and a bounded queue,
+ * so a noisy neighbour only loses its own messages.
+ */
+static void
+enqueue_query(struct nb_node *nb, void *msg, unsigned int len)
+{
+    if (!tb_take(&nb->qtb) || nb->qq_len >= NB_QUERY_QLEN) {
+        nb->q_throttled++;
+        query_throttled++;
+        p2plog(DEBUG, "QUERY throttled from %s, %lu so far\n",
+               sock_ntop(&nb->ip, nb->lport), nb->q_throttled);
+        return;
+    }
+
+    list_add_tail(&(msg_new(msg, len, nb->connfd)->list), &nb->qq.list);
+    nb->qq_len++;
+}
+
+/**
+ * Process queued QUERY messages with deficit round robin across neighbours.
+ *
+ * Every round each backlogged neighbour may process QUERY_QUANTUM bytes 
+ * worth of messages, so neighbours get an equal share of processing no 
+ * matter how fast they send. At most QUERY_BUDGET messages are processed
+ * per call to keep the loop responsive.
+ *
+ * @return the number of messages still queued
+ */
+static int
+schedule_queries()
+{
+    struct nb_node *nb;
+    struct message *msg;
+    int budget = QUERY_BUDGET, pending;
+
+    do {
+        pending = 0;
+        list_for_each_entry(nb, &g_nb_list.list, list) {
+            if (nb->qq_len == 0) {
+                nb->deficit = 0;
+                continue;
+            }
+
+            nb->deficit += QUERY_QUANTUM;
+            while (nb->qq_len > 0 && budget > 0) {
+                msg = list_entry(nb->qq.list.next, struct message, list);
+                if (msg->len > nb->deficit)
+                    break;
+                nb->deficit -= msg->len;
+                list_del(&msg->list);
+                nb->qq_len--;
+                budget--;
+                handle_query_message(nb->connfd, msg->content, msg->len);
+                msg_free(msg);
+            }
+            pending += nb->qq_len;
+        }
+    } while (pending > 0 && budget > 0);
+
+    /* Start with another neighbour next time */
+    if (!list_empty(&g_nb_list.list))
+        list_move_tail(g_nb_list.list.next, &g_nb_list.list);
+
+    return pending;
+}
+
+/**
+ * Pass a complete message to its handler.
+ *
+ * @param nb the neighbour it came from, NULL for a waiting node
+ * @return -1 if the message type is invalid
+ */
+static int
+handle_msg(int connfd, struct nb_node *nb, struct P2P_h *ph, 
+           unsigned int msglen)
+{
+    switch(ph->msg_type) {
+        case MSG_PING:
+            handle_ping_message(connfd, ph, msglen);
+            break;
+
+        case MSG_PONG:
+            handle_pong_message(connfd, ph, msglen);
+            break;
+
+        case MSG_BYE:
+            handle_bye_message(connfd);
+            break;
+
+        case MSG_JOIN:
+            handle_join_message(connfd, ph, msglen);
+            break;
+
+        case MSG_INDEX:
+            handle_index_message(connfd, ph, msglen);
+            break;
+
+        case MSG_QUERY:
+            p2plog(DEBUG, "Receive QUERY MSG: [%08X], len = %d, from %s\n",
+                   ph->msg_id, ntohs(ph->length), 
+                   sock_ntop(&nb->ip, nb->lport));
+            enqueue_query(nb, ph, msglen);
+        break;
+
+        case MSG_QHIT:
+            p2plog(DEBUG, "Receive QHIT MSG: [%08X], len = %d, from %s\n",
+                   ph->msg_id, ntohs(ph->length), 
+                   sock_ntop(&nb->ip, nb->lport));
+            handle_query_hit(connfd, ph, msglen);
+        break;
+
+        case MSG_CANCEL:
+            handle_cancel_message(connfd, ph, msglen);
+            break;
+
+        case MSG_WALK:
+            handle_walk_message(connfd, ph, msglen);
+            break;
+
+        case MSG_WALK_CHECK:
+            handle_walk_check(connfd, ph, msglen);
+            break;
+
+        default:
+            p2plog(ERROR, "Receive a message with an invalid message type\n");
+            return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * handle messages in the peer_cache
+ *
+ * @param pc the peer cache
+ * @return
+ */
+static int
+recv_msg(struct peer_cache *pc)
+{
+    if (pc->bp < HLEN) {
+        /* More data pending to parse header */
+        return 0;
+    }
+
+    int from_neigh, connfd;
+    unsigned int serial;
+
+#define from_neigh() \
+    (from_neigh == 1)
+#define set_from_neigh() \
+    (from_neigh = 1)
+#define unset_from_neigh() \
+    (from_neigh = 0)
+
+    connfd = pc->connfd;
+    serial = pc->serial;
+    unset_from_neigh();
+
+    struct wt_node *wt;
+    struct nb_node *nb;
+
+    nb = g_nb_list_find_by_connfd(connfd);
+    if (nb != NULL) {
+        set_from_neigh();
+    } else {
+        wt = g_wt_list_find_by_connfd(connfd);
+        if (wt == NULL) {
+            p2plog(ERROR, "Receive a message from an unknown sender.\n");
+            return 0;
+        }
+    }
+    
+    struct P2P_h *ph;
+    ph = (struct P2P_h *) (pc->recvbuf);
+
+    /* Validate message */
+    if (ph->version != P_VERSION) {
+        p2plog(ERROR, "Invalid version number: %d\n", ph->version);
+        goto CLEAR_CACHE;
+    }
+
+    if (ph->ttl == 0 || ph->ttl > MAX_TTL) {
+        p2plog(ERROR, "Invalid TTL: %d\n", ph->ttl);
+        goto CLEAR_CACHE;
+    }
+
+    unsigned int msglen = HLEN + ntohs(ph->length);
+
+    if (msglen > MSG_MAX) {
+        p2plog(WARN, "packet length (%d) might be too long\n", msglen);
+    }
+
+    if (pc->bp < msglen) {
+        /* More data pending to parse message */
+        return 0;
+    }
+
+    const char * strtmp = NULL;
+    if (from_neigh()) {
+        strtmp = sock_ntop(&nb->ip, nb->lport);
+        /* Update timestamp for neighbour node */
+        nb->ts = time(NULL);
+    } else {
+        strtmp = sock_ntop(&wt->ip, wt->lport);
+    }
+    p2plog(INFO, "In MSG: (%d) From %s (%02X)\n"
+                  "\t\t id = [%08X], len = %d, ttl = %d\n",
+           from_neigh(), strtmp, ph->msg_type,
+           ph->msg_id, ntohs(ph->length), ph->ttl);
+
+    if (!from_neigh() &&
+        ((ph->msg_type & MSG_JOIN) != MSG_JOIN)){
+        /* msg is not from a established neighbor, and it is not a JOIN 
+         * message, we should not allow this message. */
+           p2plog(ERROR, "Receive Non-JOIN from a waiting node\n");
+           goto CLEAR_MSG;
+    }
+
+    handle_msg(connfd, nb, ph, msglen);
+
+    /* The handler might have dropped the peer, e.g. on BYE or a rejected
+     * JOIN, and freed its cache */
+    if ((pc = g_pc_list_find_by_connfd(connfd)) == NULL || 
+        pc->serial != serial)
+        return 0;
+
+CLEAR_MSG:
+    memmove(pc->recvbuf, pc->recvbuf + msglen, pc->bp - msglen);
+    pc->bp -= msglen;
+
+    return msglen;
+
+CLEAR_CACHE:
+        pc->bp = 0;
+        return 0;
+}
+
+
+/**
+ * Handle a datagram. Only neighbours that agreed on datagrams in JOIN are
+ * heard, and only the messages they may send that way, except for
+ * subscriptions which are between any two nodes.
+ */
+static void
+udp_input(struct in6_addr *ip, uint16_t port, void *msg, unsigned int len)
+{
+    struct nb_node *nb;
+    struct P2P_h *ph = (struct P2P_h *)msg;
+    int sub, direct;
+
+    sub = len >= HLEN && 
+          (ph->msg_type == MSG_SUBSCRIBE || ph->msg_type == MSG_UPDATE);
+    /* Hits of our queries come straight from the responding nodes */
+    direct = len >= HLEN && ph->msg_type == MSG_QHIT && 
+             (ph->reserved & QHIT_F_DIRECT);
+    nb = g_nb_list_find_by_peer(ip, port);
+    if (!sub && !direct && (nb == NULL || !nb->udp)) {
+        p2plog(DEBUG, "Datagram from unknown peer %s\n", sock_ntop(ip, port));
+        return;
+    }
+
+    if (len < HLEN || ph->version != P_VERSION || 
+        ph->ttl == 0 || ph->ttl > MAX_TTL || 
+        HLEN + ntohs(ph->length) != len) {
+        p2plog(ERROR, "Invalid datagram from %s\n", sock_ntop(ip, port));
+        return;
+    }
+
+    if (sub) {
+        if (ph->msg_type == MSG_SUBSCRIBE)
+            handle_subscribe_message(ip, port, ph, len);
+        else
+            handle_update_message(ip, port, ph, len);
+        return;
+    }
+
+    if (direct) {
+        p2plog(DEBUG, "Receive direct QHIT MSG: [%08X], len = %d, from %s\n",
+               ph->msg_id, ntohs(ph->length), sock_ntop(ip, port));
+        handle_query_hit(0, ph, len);
+        return;
+    }
+
+    if (!(ph->msg_type == MSG_QUERY || ph->msg_type == MSG_QHIT ||
+          ph->msg_type == MSG_CANCEL ||
+          ((ph->msg_type == MSG_PING || ph->msg_type == MSG_PONG) && 
+           (len == HLEN || (ph->reserved & PING_F_GOSSIP))))) {
+        p2plog(ERROR, "Datagram with message type %02X from %s\n",
+               ph->msg_type, sock_ntop(ip, port));
+        return;
+    }
+
+    p2plog(INFO, "In DGRAM: From %s (%02X)\n"
+                  "\t\t id = [%08X], len = %d, ttl = %d\n",
+           sock_ntop(ip, port), ph->msg_type,
+           ph->msg_id, ntohs(ph->length), ph->ttl);
+    nb->ts = nb->udp_ts = time(NULL);
+    nb->udp_miss = 0;
+
+    g_dgram_in = 1;
+    handle_msg(nb->connfd, nb, ph, len);
+    g_dgram_in = 0;
+}
+
+
+#ifdef USE_URING
+/**
+ * Receive bytes from the remote side and save them in the peer cache.
+ * Used by the io_uring loop, which receives into buffers of the ring.
+ *
+ * @param connfd  the socket fd for the remote side
+ * @param buf     the buff which holds the received bytes
+ * @param bufsize the number of the received bytes
+ */
+static void
+recv_byte_stream(int connfd, char *buf, int bufsize)
+{
+    struct peer_cache *pc;
+    int n;
+
+    if((pc = g_pc_list_find_by_connfd(connfd)) == NULL) {
+        p2plog(ERROR, "Peer cache not found, connfd = %d\n", connfd);
+        peer_error = 2;
+        return;
+    }
+
+    if ((BUF_MAX - pc->bp) < (unsigned)bufsize) {
+        p2plog(ERROR, "Peer cache buffer full for connfd = %d\n", connfd);
+        peer_error = 3;
+        return;
+    }
+
+    memcpy(pc_recvbuf(pc) + pc->bp, buf, bufsize);
+    pc->bp += bufsize;
+
+    while ((n = recv_msg(pc)) != 0) {
+        /* blank */
+    }
+}
+#endif
+
+/**
+ * Messages are coalesced per peer and written at once, so they should leave
+ * right away rather than wait for outstanding ACKs (Nagle's algorithm).
+ */
+static void
+set_nodelay(int connfd)
+{
+    int enabled = 1;
+
+    if (setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &enabled,
+                   sizeof(enabled)) != 0) {
+        perror("setsockopt()");
+        p2plog(WARN, "Failed to set socket OPT: TCP_NODELAY\n");
+    }
+}
+
+/**
+ * Handle pending peers in the waiting list.
+ */
+static void
+handle_waiting_list(time_t now)
+{
+    static time_t cand_next;
+    struct wt_node *wt, *wt_tmp;
+    struct cand *c;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    int connfd;
+
+    list_for_each_entry_safe(wt, wt_tmp, &g_wt_list.list, list) {
+        /* Establish connections to newly discovered peers when
+         * it becomes 'urgent'. Connections are made in parallel, they are
+         * completed in node_loop() once the sockets become writable. */
+        if (!wt_connected(wt) && wt_urgent(wt)) {
+            addrlen = sock_sockaddr(&addr, &wt->ip, wt->lport);
+
+            if ((connfd = socket(addr.ss_family, SOCK_STREAM, 0)) >= 0) {
+                set_nodelay(connfd);
+                wt->connfd = connfd;
+                wt->ts = now;
+                wt_urgent_reset(wt);
+                switch (ConnectNonBlock(connfd, (SA *)&addr, addrlen)) {
+                    case 0:
+                        g_pc_list_add(pc_new(connfd));
+                        send_join_message(connfd);
+                        wt->status = 1;    /* Set to 1: Join Request sent */
+                        break;
+                    case 1:
+                        wt->status = 3;    /* Set to 3: Connection pending */
+                        break;
+                    default:
+                        p2plog(ERROR, 
+                           "Connection failed, drop waiting node %s, fd = %d\n", 
+                           sock_ntop(&wt->ip, wt->lport), connfd);
+                        Close(connfd);
+                        g_wt_list_del(wt);
+                }
+            } else {
+                p2plog(ERROR, "socket error\n");
+                g_wt_list_del(wt);
+            }
+        }
+    }
+
+    /* kick those who neither send Join Request nor accept our Join */
+    list_for_each_entry_safe(wt, wt_tmp, &g_wt_list.list, list) {
+        if (wt_connecting(wt) && now - wt->ts > CONNECT_SECONDS) {
+            p2plog(ERROR, "Connection timeout, drop waiting node %s, fd = %d\n",
+                   sock_ntop(&wt->ip, wt->lport), wt->connfd);
+            Close(wt->connfd);
+            g_wt_list_del(wt);
+        } else if (now - wt->ts > (ZOMBIE_SECONDS >> 1) ||
+                   (wt_connected(wt) && wt->status == 0 &&
+                    now - wt->ts > INCOMING_SECONDS)) {
+            p2plog(INFO, "Zombie, drop waiting node %s, fd = %d\n", 
+                   sock_ntop(&wt->ip, wt->lport), wt->connfd);
+            if (wt_connected(wt)) {
+                Close(wt->connfd);
+                g_pc_list_remove_by_connfd(wt->connfd);                 
+            }
+            g_wt_list_del(wt);
+        }
+    }
+
+    /* Currently, the only chance that a newly discovered peer can become
+     * 'urgent' is when we are in need of more neighbours. Here we pick the
+     * best candidate at a time, skipping those we got to know otherwise. */
+    if (g_nb_list_size < g_nb_max) {
+        while ((c = cand_take()) != NULL) {
+            if (g_wt_list_find_by_peer(&c->ip, c->lport) == NULL &&
+                g_nb_list_find_by_peer(&c->ip, c->lport) == NULL) {
+                wt = wt_new(0, &c->ip, c->lport);
+                wt_urgent_set(wt);
+                g_wt_list_add(wt);
+                break;
+            }
+        }
+    }
+
+    if (now > cand_next) {
+        cand_expire(now);
+        cand_next = now + CAND_SECONDS;
+    }
+}
+
+static void
+handle_neighbour_list(time_t now)
+{
+    /* Kick thouse zombie neighbours */
+    struct nb_node *nb, *nb_tmp;
+    list_for_each_entry_safe(nb, nb_tmp, &g_nb_list.list, list) {
+        if (now - nb->ts > ZOMBIE_SECONDS) {
+            p2plog(INFO, "Zombie, drop neighbour node %s, fd = %d\n", 
+                   sock_ntop(&nb->ip, nb->lport), nb->connfd);
+            Close(nb->connfd);
+            g_pc_list_remove_by_connfd(nb->connfd);
+            g_nb_list_del(nb);
+        }
+    }
+}
+
+/**
+ * Maintain the p2p network.
+ *
+ * Maintain the stable and availability of the p2p network by
+ * periodically send PING messages and renew its neighbor database.
+ */
+static void
+network_maintain()
+{   
+    static time_t    probe_next;
+    static time_t    query_next;
+    static time_t    cache_next;
+    static time_t    kv_next;
+
+    struct nb_node *nb, *probe;
+    struct stat st;
+    time_t now = time(NULL);
+    int i, subscribed;
+
+    handle_neighbour_list(now); 
+    handle_waiting_list(now);
+
+    /* Heart beat only idle neighbours, any message received proves the
+     * others are alive, and those we gossip with now and then. Resend if 
+     * the last one is still unanswered. Over UDP only a datagram proves 
+     * that datagrams get through, and those lost too often make the 
+     * neighbour go back to TCP. */
+    list_for_each_entry(nb, &g_nb_list.list, list) {
+        if ((now - (nb->udp ? nb->udp_ts : nb->ts) >= HBEAT_SECONDS ||
+             (nb->gossip && now - nb->gossiped >= GOSSIP_SECONDS)) && 
+            now - nb->hb_tv.tv_sec >= HBEAT_SECONDS) {
+            if (nb->udp && nb->hb_tv.tv_sec != 0 && 
+                ++nb->udp_miss >= UDP_MISS_MAX) {
+                p2plog(WARN, "Datagrams lost, use TCP for %s\n",
+                       sock_ntop(&nb->ip, nb->lport));
+                nb->udp = 0;
+            }
+            if (send_ping_message(nb->connfd, PING_TTL_HB) == 0)
+                gettimeofday(&nb->hb_tv, NULL);
+        }
+    }
+
+    if (now > probe_next) {
+        /* send neighbor query to the neighbours probed longest ago */
+        for (i = 0; i < PROBE_FANOUT; i++) {
+            probe = NULL;
+            list_for_each_entry(nb, &g_nb_list.list, list) {
+                if (nb->probed < now && 
+                    (probe == NULL || nb->probed < probe->probed))
+                    probe = nb;
+            }
+            if (probe == NULL)
+                break;
+            send_ping_message(probe->connfd, DEF_TTL);
+            probe->probed = now;
+        }
+        /* send probe randomly to avoid receiving JOIN simultaneously */
+        probe_next = now + PROBE_SECONDS + rand() % PROBE_SECONDS;
+    }
+    
+    /* The holders of the search key push its changes, the network is only
+     * searched now and then for new ones, or again if they stop answering */
+    subscribed = sub_maintain(search_key);
+    if (!subscribed && query_next > now + QUERY_SECONDS)
+        query_next = now;
+    if (search_key != NULL && now > query_next) {
+        /* search the network */
+        send_query_message(search_key);
+        query_next = now + (subscribed ? SUB_SEARCH_SECONDS : QUERY_SECONDS);
+    }
+
+    if (kv_file != NULL && now > kv_next) {
+        /* Take a new kvfile, tell the subscribers and the super-peers */
+        if (stat(kv_file, &st) == 0 && 
+            (st.st_mtime != kv_stat.st_mtime || 
+             st.st_size != kv_stat.st_size)) {
+            kv_stat = st;
+            p2plog(INFO, "Reload %s\n", kv_file);
+            if (g_kv_list_reload(kv_file, sub_notify) == 0 &&
+                g_node_mode == MODE_LEAF) {
+                list_for_each_entry(nb, &g_nb_list.list, list)
+                    send_index_message(nb->connfd);
+            }
+        }
+        kv_next = now + KV_SECONDS;
+    }
+
+    if (hc_file != NULL && now > cache_next) {
+        /* Remember current neighbours as known-good peers. Keep the old
+         * file if we have no neighbour at all, e.g. network is down. */
+        if (g_nb_list_size > 0) {
+            list_for_each_entry(nb, &g_nb_list.list, list) {
+                g_hc_list_update(&nb->ip, nb->lport, now, nb->rtt);
+            }
+            g_hc_list_save_to_file(hc_file);
+            cache_next = now + CACHE_SECONDS;
+        }
+    }
+}
+
+/* Types of the records for connection handoff */
+#define HO_NEIGHBOUR         1
+#define HO_END               2
+
+/* Leads every record, "P2H" and the version of the record layout. The node
+ * restarted may be another build, it must not restore a layout it does not
+ * know. Bump the version on any change to struct handoff_rec. */
+#define HO_MAGIC            0x50324801
+
+/* Max number of neighbours restored from a handoff */
+#define HO_MAX              64
+
+/* The record of a neighbour handed off to the restarted node. The socket
+ * descriptor is passed along as ancillary data. */
+struct handoff_rec {
+    uint32_t            magic;      /* HO_MAGIC */
+    int                 type;
+    struct in6_addr     ip;
+    uint16_t            lport;
+    time_t              ts;
+    int                 rtt;
+    int                 leaf;
+    int                 udp;
+    int                 kidx_len;
+    unsigned int        bp;
+    unsigned char       data[INDEX_MAX * sizeof(uint32_t) + BUF_MAX];
+                                    /* kidx followed by peer cache bytes */
+};
+
+/* The length of the handoff record header */
+#define HO_HLEN             offsetof(struct handoff_rec, data)
+
+/**
+ * Hand off all neighbour connections to the next p2pn started by pmon,
+ * then exit. Neighbours never notice that the node has been restarted.
+ *
+ * If the handoff fails, the node simply keeps running.
+ */
+static void
+handoff_node()
+{
+    static struct handoff_rec rec;
+    struct nb_node *nb;
+    struct peer_cache *pc;
+    int fd, count = 0;
+
+    handoff_req = 0;
+    if (handoff_out < 0) {
+        p2plog(WARN, "Restart requested but not running under pmon\n");
+        return;
+    }
+
+    list_for_each_entry(nb, &g_nb_list.list, list) {
+        memset(&rec, 0, HO_HLEN);
+        rec.magic = HO_MAGIC;
+        rec.type = HO_NEIGHBOUR;
+        rec.ip = nb->ip;
+        rec.lport = nb->lport;
+        rec.ts = nb->ts;
+        rec.rtt = nb->rtt;
+        rec.leaf = nb->leaf;
+        rec.udp = nb->udp;
+        rec.kidx_len = nb->kidx_len;
+        memcpy(rec.data, nb->kidx, nb->kidx_len * sizeof(uint32_t));
+        if ((pc = g_pc_list_find_by_connfd(nb->connfd)) != NULL && 
+            pc->bp > 0) {
+            rec.bp = pc->bp;
+            memcpy(rec.data + nb->kidx_len * sizeof(uint32_t), 
+                   pc->recvbuf, pc->bp);
+        }
+
+        if (SendFd(handoff_out, nb->connfd, &rec, HO_HLEN + 
+                   rec.kidx_len * sizeof(uint32_t) + rec.bp) < 0)
+            goto FAIL;
+        count++;
+    }
+
+    memset(&rec, 0, HO_HLEN);
+    rec.magic = HO_MAGIC;
+    rec.type = HO_END;
+    if (SendFd(handoff_out, -1, &rec, HO_HLEN) < 0)
+        goto FAIL;
+
+    p2plog(INFO, "Handed off %d neighbours, exit for restart\n", count);
+    ctl_close();
+    exit(PMON_EXIT_HANDOFF);
+
+FAIL:
+    /* Take back what has been sent so it is not restored later */
+    p2plog(ERROR, "Handoff failed, keep running\n");
+    while (RecvFd(handoff_in, &fd, &rec, sizeof(rec), MSG_DONTWAIT) >= 0) {
+        if (fd >= 0) Close(fd);
+    }
+}
+
+/**
+ * Restore the neighbour connections handed off by the previous p2pn.
+ *
+ * Records are only taken into use once the end record has been seen, 
+ * otherwise the previous node died halfway and they are dropped. Records
+ * without HO_MAGIC are dropped with their connections, the end record of
+ * another version included.
+ */
+static void
+restore_node()
+{
+    static struct handoff_rec rec;
+    struct nb_node *nbs[HO_MAX];
+    struct peer_cache *pcs[HO_MAX];
+    int fd, i, count = 0, done = 0, foreign = 0;
+    ssize_t n;
+
+    if (handoff_in < 0) 
+        return;
+
+    while (!done && 
+           (n = RecvFd(handoff_in, &fd, &rec, sizeof(rec), MSG_DONTWAIT)) >= 0) {
+        if ((size_t)n < HO_HLEN || rec.magic != HO_MAGIC) {
+            if (fd >= 0) Close(fd);
+            foreign++;
+            continue;
+        }
+
+        if (rec.type == HO_END) {
+            done = 1;
+        } else if (rec.type == HO_NEIGHBOUR && fd >= 0 && count < HO_MAX &&
+                   rec.kidx_len >= 0 && rec.kidx_len <= INDEX_MAX &&
+                   rec.bp <= BUF_MAX && (size_t)n == HO_HLEN + 
+                   rec.kidx_len * sizeof(uint32_t) + rec.bp) {
+            nbs[count] = nb_new(fd, &rec.ip, rec.lport);
+            nbs[count]->ts = rec.ts;
+            nbs[count]->rtt = rec.rtt;
+            nbs[count]->udp = rec.udp && g_udp_fd >= 0;
+            if (rec.leaf)
+                nb_kidx_set(nbs[count], (uint32_t *)rec.data, rec.kidx_len);
+            pcs[count] = pc_new(fd);
+            pcs[count]->bp = rec.bp;
+            if (rec.bp > 0)
+                memcpy(pc_recvbuf(pcs[count]), 
+                       rec.data + rec.kidx_len * sizeof(uint32_t), rec.bp);
+            count++;
+        } else if (fd >= 0) {
+            Close(fd);
+        }
+    }
+
+    for (i = 0; i < count; i++) {
+        if (done) {
+            /* Already a neighbour, no need to bootstrap through it */
+            g_wt_list_del(g_wt_list_find_by_peer(&nbs[i]->ip, nbs[i]->lport));
+            g_nb_list_add(nbs[i]);
+            g_pc_list_add(pcs[i]);
+        } else {
+            Close(nbs[i]->connfd);
+            free(nbs[i]->kidx);
+            free(nbs[i]);
+            free(pcs[i]);
+        }
+    }
+
+    if (foreign > 0)
+        p2plog(WARN, "Dropped %d handoff records of another version\n", 
+               foreign);
+    if (done) {
+        p2plog(INFO, "Restored %d neighbours from handoff\n", count);
+    } else if (count > 0) {
+        p2plog(WARN, "Incomplete handoff, dropped %d neighbours\n", count);
+    }
+}
+
+/**
+ * Answer a liveness probe from pmon.
+ *
+ * The probe is answered from the main loop, so a node stuck anywhere in
+ * the loop is detected even though the process is still alive.
+ */
+static void
+handle_health()
+{
+    char buf[M_LEN];
+    unsigned long seq;
+    ssize_t n;
+
+    if ((n = Read(health_fd, buf, sizeof(buf) - 1)) <= 0)
+        return;
+    buf[n] = '\0';
+
+    if (sscanf(buf, "ping %lu", &seq) != 1) {
+        p2plog(WARN, "Invalid probe from pmon\n");
+        return;
+    }
+
+    n = snprintf(buf, sizeof(buf), 
+                 "ok %lu uptime=%ld nb=%d wt=%d thr=%lu tx=%lu/%lu", 
+                 seq, (long)(time(NULL) - start_time), g_nb_list_size, 
+                 g_wt_list_size, query_throttled, send_msgs, send_calls);
+    Write(health_fd, buf, n < M_LEN ? n : M_LEN - 1);
+}
+
+/**
+ * Pass a QUERY_HIT to the query waiting for it, and to the application
+ * embedding the node.
+ */
+static void
+on_query_hit(const struct query_hit *hit)
+{
+    struct p2pn_hit h;
+    struct in6_addr ip;
+
+    /* Have the holder of the search key push its changes */
+    if (search_key != NULL && g_udp_fd >= 0 && hit->count > 0 &&
+        (hit->ph->reserved & QHIT_F_SUB) && 
+        !(hit->ph->reserved & H_F_ORG_IPV6) &&
+        strcmp(hit->key, search_key) == 0) {
+        sock_map_v4(&ip, hit->ph->org_ip);
+        sub_start(search_key, &ip, hit->ph->org_port, 
+                  ntohl(hit->entries[0].res_val), hit->msg_id);
+    }
+
+    query_hit(hit);
+
+    if (node_handle.hit_cb != NULL) {
+        h.qh = *hit;
+        node_handle.hit_cb(&h, node_handle.hit_arg);
+    }
+}
+
+/**
+ * Write the origin of a hit to buf, the digest of an IPv6 address as it is.
+ */
+static int
+hit_origin(const struct query_hit *hit, char *buf, size_t size)
+{
+    struct in6_addr org_ip;
+
+    if (hit->ph->reserved & H_F_ORG_IPV6)
+        return snprintf(buf, size, "ipv6:%08X:%d", ntohl(hit->ph->org_ip), 
+                        ntohs(hit->ph->org_port));
+    sock_map_v4(&org_ip, hit->ph->org_ip);
+    return snprintf(buf, size, "%s", sock_ntop(&org_ip, hit->ph->org_port));
+}
+
+/**
+ * Stream the hits of a query of p2pctl, one line per responding node.
+ */
+static void
+ctl_query_cb(uint32_t msg_id, int status, const struct query_hit *hit,
+             void *arg)
+{
+    struct ctl_client *c = arg;
+    char line[CTL_LINE * 4];
+    int i, n;
+
+    (void)msg_id;
+    if (status == QUERY_DONE) {
+        ctl_hits_end(c);
+        return;
+    }
+    if (status != QUERY_HIT)
+        return;
+
+    n = snprintf(line, sizeof(line), "hit %s ", hit->key);
+    n += hit_origin(hit, line + n, sizeof(line) - n);
+    for (i = 0; i < hit->count && n < (int)sizeof(line) - 24; i++) {
+        n += snprintf(line + n, sizeof(line) - n, " 0x%04X=0x%08X",
+                      ntohs(hit->entries[i].res_id), 
+                      ntohl(hit->entries[i].res_val));
+    }
+    snprintf(line + n, sizeof(line) - n, "\n");
+
+    ctl_hit(c, line);
+}
+
+/**
+ * Run a command of p2pctl. Dumps are answered at once, a query streams its
+ * hits until its time is up.
+ */
+static void
+ctl_command(struct ctl_client *c, char *line)
+{
+    struct nb_node *nb;
+    struct wt_node *wt;
+    struct peer_cache *pc;
+    char *cmd, *arg;
+    time_t now = time(NULL);
+    uint32_t msg_id;
+    int secs, flags;
+
+    if ((cmd = strtok(line, " \t")) == NULL) {
+        ctl_printf(c, "error empty command\n");
+    } else if (strcmp(cmd, "query") == 0 || strcmp(cmd, "walk") == 0) {
+        flags = strcmp(cmd, "walk") == 0 ? QUERY_F_WALK : 0;
+        if ((arg = strtok(NULL, " \t")) == NULL || strlen(arg) >= S_LEN) {
+            ctl_printf(c, "error usage: %s <key> [seconds]\n", cmd);
+            ctl_end(c);
+            return;
+        }
+        secs = CTL_QUERY_SECONDS;
+        if ((cmd = strtok(NULL, " \t")) != NULL &&
+            ((secs = atoi(cmd)) <= 0 || secs > CTL_QUERY_SECONDS_MAX)) {
+            ctl_printf(c, "error seconds should be 1 to %d\n", 
+                       CTL_QUERY_SECONDS_MAX);
+            ctl_end(c);
+            return;
+        }
+        if ((msg_id = query_start(arg, secs * 1000, flags, 
+                                  ctl_query_cb, c)) == 0) {
+            ctl_printf(c, "error query not sent\n");
+            ctl_end(c);
+            return;
+        }
+        ctl_printf(c, "ok %08X\n", msg_id);
+        ctl_wait_hits(c, msg_id);
+        return;
+    } else if (strcmp(cmd, "neighbours") == 0) {
+        list_for_each_entry(nb, &g_nb_list.list, list) {
+            pc = g_pc_list_find_by_connfd(nb->connfd);
+            ctl_printf(c, "%s fd=%d rtt=%d leaf=%d udp=%d deg=%d idle=%ld "
+                       "queued=%d thr=%lu sendq=%u\n", 
+                       sock_ntop(&nb->ip, nb->lport), nb->connfd, nb->rtt, 
+                       nb->leaf, nb->udp, nb->degree, (long)(now - nb->ts), 
+                       nb->qq_len, nb->q_throttled, pc != NULL ? pc->sp : 0);
+        }
+    } else if (strcmp(cmd, "waiting") == 0) {
+        list_for_each_entry(wt, &g_wt_list.list, list) {
+            ctl_printf(c, "%s fd=%d status=%d urgent=%d age=%ld\n", 
+                       sock_ntop(&wt->ip, wt->lport), wt->connfd, wt->status,
+                       wt->urgent, (long)(now - wt->ts));
+        }
+    } else if (strcmp(cmd, "stats") == 0) {
+        ctl_printf(c, "uptime=%ld nb=%d wt=%d cand=%d hc=%d thr=%lu "
+                   "tx=%lu/%lu udp=%d size=%d ttl=%d routes=%d\n", 
+                   (long)(now - start_time), g_nb_list_size, g_wt_list_size,
+                   cand_count(), g_hc_list_size, query_throttled, 
+                   send_msgs, send_calls, g_udp_fd >= 0, gossip_size(),
+                   query_ttl(), route_size());
+    } else {
+        ctl_printf(c, "error unknown command %s, "
+                   "try query, walk, neighbours, waiting or stats\n", cmd);
+    }
+    ctl_end(c);
+}
+
+/**
+ * Take a new connection from a peer into the waiting list.
+ */
+static void
+accept_peer(int connfd, SA *cliaddr)
+{
+    struct wt_node *wt;
+    struct in6_addr ip;
+    uint16_t port;
+    int opt_recv_low = HLEN;
+
+    if (sock_fromaddr(cliaddr, &ip, &port) < 0) {
+        p2plog(ERROR, "Unknown address family, fd = %d\n", connfd);
+        Close(connfd);
+        return;
+    }
+
+    if (!adm_admit(&ip)) {
+        p2plog(WARN, "Rate limited, drop connection from %s\n",
+               sock_ntop(&ip, port));
+        Close(connfd);
+        return;
+    }
+
+    if (g_wt_list_count_incoming() >= INCOMING_MAX) {
+        p2plog(WARN, "Too many pending, drop connection from %s\n",
+               sock_ntop(&ip, port));
+        Close(connfd);
+        return;
+    }
+
+    if (setsockopt(connfd, SOL_SOCKET, SO_RCVLOWAT, &opt_recv_low,
+                   sizeof(int)) != 0) {
+        perror("setsockopt()");
+        p2plog(ERROR, "Failed to set socket OPT: SO_RCVLOWAT");
+        return;
+    }
+    set_nodelay(connfd);
+
+    /**
+     * Should not always create a waiting node when receiving a new
+     * connection (Normally the JOIN Request is coming). The reason
+     * for this is that the node sending JOIN Request by creating a 
+     * new connection might have been already in the waiting list 
+     * or even in the neighbor list. This happens when a node is added 
+     * to the waiting list by handling PONG and later on that node 
+     * starts to send JOIN. Therefore, a new waiting node can only be
+     * created when it is not in either waiting list or neighbor list.
+     * 
+     * Solution: The new incoming connection should be stored in 
+     * the third list different from neither waiting list nor neighbor 
+     * list. When the following JOIN comes, we should check if waiting
+     * list or neighbor list has already contained the node by 
+     * identifying both IP address and listening port. If nothing in 
+     * the lists, then a new entry of neighbor list can be allocated. 
+     * Note that listening port is different from the port returned by
+     * accept(). Therefore, wtn->lport will be updated when JOIN
+     * message is handled. See handle_join_message() in detail.
+     *
+     * Bug is fixed here by merging the third list with waiting list, 
+     * then separating them from each other when handling JOIN request 
+     * message in handle_join_message().
+     */
+    wt = wt_new(connfd, &ip, port);
+    wt->status = 0;  /* set to 0: new peer that connected to us,
+                      * but no Join Request yet */
+    p2plog(INFO, "Connection from %s, fd = %d\n",
+            sock_ntop(&ip, port),
+            wt->connfd);
+    /* save to waiting list */
+    g_wt_list_add(wt);
+    g_pc_list_add(pc_new(connfd));
+}
+
+/**
+ * Complete a pending connection to a waiting node, and send JOIN.
+ */
+static void
+connect_done(struct wt_node *wt)
+{
+    if (ConnectFinish(wt->connfd) == 0) {
+        g_pc_list_add(pc_new(wt->connfd));
+        send_join_message(wt->connfd);
+        wt->status = 1;    /* Set to 1: Join Request sent */
+        wt->ts = time(NULL);
+    } else {
+        p2plog(ERROR, 
+               "Connection failed, drop waiting node %s, fd = %d\n", 
+               sock_ntop(&wt->ip, wt->lport), wt->connfd);
+        Close(wt->connfd);
+        g_wt_list_del(wt);
+    }
+}
+
+/**
+ * Drop a peer after end of file (n = 0), a read error (n < 0) or an error
+ * in its byte stream (n > 0).
+ */
+static void
+drop_peer(int connfd, int n)
+{
+    struct nb_node *nb;
+    struct wt_node *wt;
+
+    /* Look up again, handling JOIN moves the peer to the neighbour list */
+    if ((nb = g_nb_list_find_by_connfd(connfd)) != NULL) {
+        if (n == 0) {
+            p2plog(INFO, "Disconnect from neighbour node: %s, fd = %d\n",
+                   sock_ntop(&nb->ip, nb->lport), nb->connfd);
+        } else if (n < 0) {
+            p2plog(ERROR, "Read error, drop neighbour node: %s, fd = %d\n",
+                   sock_ntop(&nb->ip, nb->lport), nb->connfd);
+        }
+        Close(nb->connfd);
+        g_pc_list_remove_by_connfd(nb->connfd);
+        g_nb_list_del(nb);
+    } else if ((wt = g_wt_list_find_by_connfd(connfd)) != NULL) {
+        if (n == 0) {
+            p2plog(INFO, "Disconnect from waiting node: %s, fd = %d\n",
+                   sock_ntop(&wt->ip, wt->lport), wt->connfd);
+        } else if (n < 0) {
+            p2plog(ERROR, "Read error, drop waiting node: %s, fd = %d\n",
+                   sock_ntop(&wt->ip, wt->lport), wt->connfd);
+        }
+        Close(wt->connfd);
+        g_pc_list_remove_by_connfd(wt->connfd);
+        g_wt_list_del(wt);
+    }
+}
+
+/**
+ * Drain a readable peer: read straight into its peer cache and handle all
+ * complete messages, until the socket is empty or recv_budget bytes have 
+ * been read. The budget keeps one busy peer from starving the others, the
+ * rest is read in the next iteration.
+ */
+static void
+drain_peer(int connfd)
+{
+    struct peer_cache *pc;
+    unsigned int serial;
+    ssize_t n;
+    int total = 0, budget;
+
+    if ((pc = g_pc_list_find_by_connfd(connfd)) == NULL) {
+        p2plog(ERROR, "Peer cache not found, connfd = %d\n", connfd);
+        return;
+    }
+    serial = pc->serial;
+    budget = recv_budget > 0 ? recv_budget : RECV_BUDGET;
+    peer_error = 0;
+
+    do {
+        if (pc->bp >= BUF_MAX) {
+            /* A message longer than the whole buffer never completes */
+            p2plog(ERROR, "Peer cache buffer full for connfd = %d\n", connfd);
+            drop_peer(connfd, 1);
+            return;
+        }
+
+        n = recv(connfd, pc_recvbuf(pc) + pc->bp, BUF_MAX - pc->bp, 
+                 MSG_DONTWAIT);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || 
+                      errno == EINTR))
+            return;
+        if (n <= 0) {
+            if (n < 0) perror("recv()");
+            drop_peer(connfd, n);
+            return;
+        }
+        pc->bp += n;
+        total += n;
+
+        while (recv_msg(pc) != 0) {
+            /* blank */
+        }
+
+        /* Handlers might have dropped the peer */
+        if ((pc = g_pc_list_find_by_connfd(connfd)) == NULL || 
+            pc->serial != serial)
+            return;
+    } while (total < budget);
+}
+
+/**
+ * Write the bytes queued for each peer during the iteration with one system
+ * call per peer. What the socket does not take now stays queued until it
+ * becomes writable, so one slow peer never blocks the loop.
+ *
+ * @return the number of peers with bytes still queued
+ */
+static int
+flush_peers()
+{
+    struct peer_cache *pc;
+    ssize_t n;
+    int left = 0;
+
+    list_for_each_entry(pc, &g_pc_list.list, list) {
+        if (pc->sp == 0)
+            continue;
+
+        n = send(pc->connfd, pc->sendbuf, pc->sp, MSG_DONTWAIT);
+        send_calls++;
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                left++;
+                continue;
+            }
+            /* Leave the connection alive, it will be dropped on read error 
+             * or when becoming zombie */
+            p2plog(ERROR, "Write error, fd = %d: %s\n", 
+                   pc->connfd, strerror(errno));
+            pc->sp = 0;
+            pc->sq = 0;
+            continue;
+        }
+
+        memmove(pc->sendbuf, pc->sendbuf + n, pc->sp - n);
+        pc->sp -= n;
+        if (pc->sp > 0) {
+            left++;
+        } else {
+            /* Only now all the messages queued have been written */
+            send_msgs += pc->sq;
+            pc->sq = 0;
+        }
+    }
+
+    return left;
+}
+
+/**
+ * Work done once per loop iteration after all events are handled.
+ *
+ * @return the number of QUERY still queued
+ */
+static int
+loop_tick()
+{
+    static int wt_logged = -1, nb_logged = -1;
+    int pending;
+
+    pending = schedule_queries();
+
+    network_maintain();
+
+    query_expire();
+
+    walk_expire();
+
+    route_expire();
+
+    /* Datagrams queued by this iteration go out in one batch */
+    if (g_udp_fd >= 0)
+        udp_flush();
+
+    ctl_flush();
+
+    /* Log only changes, the loop runs once per batch of events */
+    if (g_wt_list_size != wt_logged || g_nb_list_size != nb_logged) {
+        p2plog(INFO, "Waiting: %d  Neighbours: %d\n", 
+               g_wt_list_size, g_nb_list_size);
+        wt_logged = g_wt_list_size;
+        nb_logged = g_nb_list_size;
+    }
+
+    if (peer_error == 4) {
+        p2plog(WARN, "SIGPIPE captured.\n");
+    }
+
+    return pending;
+}
+
+/**
+ * Milliseconds the loop may wait for events: a tick, or less if a query is
+ * due or is to be flooded, and none if QUERY are queued.
+ */
+static int
+loop_timeout(int pending)
+{
+    int ms, rms;
+
+    if (pending > 0)
+        return 0;
+    ms = query_timeout();
+    rms = route_timeout();
+    if (rms >= 0 && (ms < 0 || rms < ms))
+        ms = rms;
+    return ms >= 0 && ms < SELECT_SECONDS * 1000 ? ms : SELECT_SECONDS * 1000;
+}
+
+/**
+ * The descriptors the node waits for, as poll() takes them, and the events
+ * found ready on them indexed by fd. Unlike the sets of select() neither is
+ * bounded by FD_SETSIZE, the node and an application embedding it may have
+ * more descriptors open.
+ */
+static struct pollfd   *watch;
+static int              watch_n, watch_cap;
+static short           *ready;
+static int              ready_size;
+
+/* Wait for the events on fd, a fd watched already gets them added */
+static void
+watch_fd(int fd, short events)
+{
+    int i;
+
+    for (i = 0; i < watch_n; i++) {
+        if (watch[i].fd == fd) {
+            watch[i].events |= events;
+            return;
+        }
+    }
+    if (watch_n == watch_cap) {
+        watch_cap = watch_cap > 0 ? watch_cap * 2 : 64;
+        if ((watch = realloc(watch, watch_cap * sizeof(struct pollfd))) == NULL) {
+            perror("realloc error");
+            exit(1);
+        }
+    }
+    watch[watch_n].fd = fd;
+    watch[watch_n].events = events;
+    watch[watch_n].revents = 0;
+    watch_n++;
+}
+
+/**
+ * Collect the descriptors the node waits for into watch.
+ *
+ * @return their number
+ */
+static int
+watch_fds()
+{
+    struct nb_node *nb;
+    struct wt_node *wt;
+    struct peer_cache *pc;
+
+    watch_n = 0;
+    watch_fd(lstn_fd, POLLIN);
+    if (g_udp_fd >= 0)
+        watch_fd(g_udp_fd, POLLIN);
+    if (health_fd >= 0)
+        watch_fd(health_fd, POLLIN);
+    ctl_watch(watch_fd);
+    list_for_each_entry(nb, &g_nb_list.list, list) {
+        watch_fd(nb->connfd, POLLIN);
+    }
+    list_for_each_entry(wt, &g_wt_list.list, list) {
+        if (wt_connected(wt))
+            watch_fd(wt->connfd, wt_connecting(wt) ? POLLOUT : POLLIN);
+    }
+    /* Wait to write the rest if a peer did not take all bytes */
+    list_for_each_entry(pc, &g_pc_list.list, list) {
+        if (pc->sp > 0)
+            watch_fd(pc->connfd, POLLOUT);
+    }
+
+    return watch_n;
+}
+
+/**
+ * Take the events found ready by poll(). Hangups and errors count as
+ * readable and writable, the handlers find out about them when reading or
+ * completing the connect.
+ */
+static void
+ready_set(const struct pollfd *fds, int n)
+{
+    int i, size;
+
+    for (i = 0, size = ready_size; i < n; i++) {
+        if (fds[i].fd >= size)
+            size = fds[i].fd + 1;
+    }
+    if (size > ready_size) {
+        if ((ready = realloc(ready, size * sizeof(short))) == NULL) {
+            perror("realloc error");
+            exit(1);
+        }
+        ready_size = size;
+    }
+    memset(ready, 0, ready_size * sizeof(short));
+
+    for (i = 0; i < n; i++) {
+        if (fds[i].fd < 0)
+            continue;
+        if (fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+            ready[fds[i].fd] |= POLLIN;
+        if (fds[i].revents & (POLLOUT | POLLHUP | POLLERR))
+            ready[fds[i].fd] |= POLLOUT;
+    }
+}
+
+static int
+fd_readable(int fd)
+{
+    return fd >= 0 && fd < ready_size && (ready[fd] & POLLIN);
+}
+
+static int
+fd_writable(int fd)
+{
+    return fd >= 0 && fd < ready_size && (ready[fd] & POLLOUT);
+}
+
+/**
+ * Handle the descriptors found ready, see ready_set().
+ */
+static void
+handle_ready()
+{
+    struct sockaddr_storage cliaddr;
+    socklen_t clisize;
+    int connfd;
+
+    struct nb_node *nb, *nb_tmp;
+    struct wt_node *wt, *wt_tmp;
+
+    if (health_fd >= 0 && fd_readable(health_fd)) {
+        handle_health();
+    }
+
+    if (fd_readable(lstn_fd)) {
+        /* New connection arrives */
+        clisize = sizeof(cliaddr);
+        connfd = Accept(lstn_fd, (SA *)&cliaddr, &clisize);
+
+        if (connfd < 0) {
+            p2plog(ERROR, "Accept() failed\n");
+        } else {
+            accept_peer(connfd, (SA *)&cliaddr);
+        }
+    }
+
+    if (g_udp_fd >= 0 && fd_readable(g_udp_fd)) {
+        udp_recv(udp_input);
+    }
+
+    ctl_handle(fd_readable);
+
+    /* Complete pending connections to waiting nodes */
+    list_for_each_entry_safe(wt, wt_tmp, &g_wt_list.list, list) {
+        if (wt_connecting(wt) && fd_writable(wt->connfd)) {
+            connect_done(wt);
+        }
+    }
+
+    /**
+     * NOTE HERE!!! 
+     * When list_for_each_entry_safe() is used, make sure only current 
+     * entry can be deleted and other entries must be retained. Otherwise,
+     * the link will be broken. This is really hard to check as there might
+     * be many deep functions in the body of it. To make this true, you 
+     * have to check all the inner functions.
+     */ 
+
+    /* Check all neighbor nodes if they are readable */
+    list_for_each_entry_safe(nb, nb_tmp, &g_nb_list.list, list) {
+        if (fd_readable(nb->connfd)) {
+            drain_peer(nb->connfd);
+        }
+    }
+
+    /* check nodes in waiting list */
+    list_for_each_entry_safe(wt, wt_tmp, &g_wt_list.list, list) {
+        if (wt_connected(wt) && fd_readable(wt->connfd)) {
+            drain_peer(wt->connfd);
+        }
+    }
+}
+
+/**
+ * The main loop for message receving and handling
+ */
+static int
+node_loop()
+{
+    int i, n, pending = 0;
+
+    for ( ; ; ) {
+        if (handoff_req) {
+            /* Neighbours must get all queued bytes before the handoff */
+            for (i = 0; i < 20 && flush_peers() > 0; i++)
+                poll(NULL, 0, 100);
+            handoff_node();
+        }
+
+        n = watch_fds();
+
+        /* Wait up to TICK seconds, poll if QUERY are queued */
+        if (poll(watch, n, loop_timeout(pending)) == -1) {
+          if (errno == EINTR) continue;
+          perror("poll()");
+          p2plog(ERROR, "Failed to poll\n");
+          continue;
+        }
+
+        ready_set(watch, n);
+        handle_ready();
+
+        pending = loop_tick();
+
+        flush_peers();
+    }
+
+    return 0;
+}
+
+#ifdef USE_URING
+/**
+ * The io_uring backend of the node loop.
+ *
+ * Accept and receive are multishot requests armed once per socket, bytes
+ * received land in buffers provided to the kernel and are fed to the same
+ * handlers as the poll loop. Messages sent during an iteration are queued
+ * per connection and submitted with a single send each, together with the
+ * wait for the next completions in one system call.
+ *
+ * The kind of a request is in the top byte of its user data, then the fd and
+ * the serial of the peer cache (or generation of the poll), so completions 
+ * for a connection closed in the meantime are recognised and ignored even if
+ * the fd number has been reused.
+ */
+#define UD_ACCEPT       1
+#define UD_RECV         2
+#define UD_SEND         3
+#define UD_CONNECT      4
+#define UD_HEALTH       5
+#define UD_CANCEL       6
+#define UD_UDP          7
+#define UD_CTL_ACCEPT   8
+#define UD_CTL          9
+
+#define UD(kind, fd, serial) \
+    (((uint64_t)(kind) << 56) | ((uint64_t)(fd) << 32) | (uint32_t)(serial))
+#define UD_KIND(ud)     ((int)((ud) >> 56))
+#define UD_FD(ud)       ((int)(((ud) >> 32) & 0xFFFFFF))
+#define UD_SERIAL(ud)   ((uint32_t)(ud))
+#define UD_PTR(ud)      ((void *)(uintptr_t)((ud) & ((1ULL << 56) - 1)))
+
+/* Requests armed for a fd */
+struct uring_fd {
+    uint32_t            recv;       /* Serial of the peer cache */
+    uint32_t            conn;       /* Generation of the connect poll */
+    uint32_t            ctl;        /* Serial of the control client */
+};
+
+/* A send in flight, owns the bytes taken from the peer cache */
+struct send_req {
+    int                 connfd;
+    unsigned int        serial;
+    unsigned char      *buf;
+    unsigned int        len;
+    unsigned int        off;
+    unsigned int        msgs;       /* Counted once all len bytes are sent */
+};
+
+static struct uring_fd *ufd;        /* Indexed by fd */
+static int              ufd_size;
+static int              recv_inflight;
+static int              send_inflight;
+static int              quiescing;  /* Draining the ring before handoff */
+
+/* Get the requests armed for fd, the table grows on demand */
+static struct uring_fd *
+ufd_get(int fd)
+{
+    int n;
+
+    if (fd >= ufd_size) {
+        n = ufd_size > 0 ? ufd_size : 64;
+        while (n <= fd)
+            n *= 2;
+        if ((ufd = realloc(ufd, n * sizeof(struct uring_fd))) == NULL) {
+            perror("realloc error");
+            exit(1);
+        }
+        memset(ufd + ufd_size, 0, (n - ufd_size) * sizeof(struct uring_fd));
+        ufd_size = n;
+    }
+
+    return &ufd[fd];
+}
+
+/**
+ * Arm receive for new peer caches, and poll for pending connections.
+ */
+static void
+uring_arm()
+{
+    static uint32_t gen;
+    struct peer_cache *pc;
+    struct wt_node *wt;
+    struct uring_fd *u;
+    unsigned int serial;
+    int i, fd;
+
+    list_for_each_entry(pc, &g_pc_list.list, list) {
+        u = ufd_get(pc->connfd);
+        if (u->recv == pc->serial)
+            continue;
+        /* The fd has been reused, the old request still holds the socket */
+        if (u->recv != 0)
+            uring_cancel(UD(UD_RECV, pc->connfd, u->recv), UD(UD_CANCEL, 0, 0));
+        u->recv = 0;
+        if (uring_recv(pc->connfd, UD(UD_RECV, pc->connfd, pc->serial)) == 0) {
+            u->recv = pc->serial;
+            recv_inflight++;
+        }
+    }
+
+    list_for_each_entry(wt, &g_wt_list.list, list) {
+        if (!wt_connecting(wt))
+            continue;
+        u = ufd_get(wt->connfd);
+        if (u->conn != 0)
+            continue;
+        if (++gen == 0) gen++;
+        if (uring_poll(wt->connfd, POLLOUT, 0, 
+                       UD(UD_CONNECT, wt->connfd, gen)) == 0)
+            u->conn = gen;
+    }
+
+    /* One read per poll, the client may be closed by the command */
+    for (i = 0; (fd = ctl_client_fd(i)) >= 0; i++) {
+        u = ufd_get(fd);
+        serial = ctl_serial(fd);
+        if (u->ctl == serial)
+            continue;
+        if (uring_poll(fd, POLLIN, 0, UD(UD_CTL, fd, serial)) == 0)
+            u->ctl = serial;
+    }
+}
+
+/**
+ * Cancel requests on sockets which have been closed. Close() does not stop
+ * them, the ring holds a reference to the socket until they complete.
+ */
+static void
+uring_cancel_stale()
+{
+    struct peer_cache *pc;
+    struct wt_node *wt;
+    int fd;
+
+    for (fd = 0; fd < ufd_size; fd++) {
+        if (ufd[fd].recv != 0) {
+            pc = g_pc_list_find_by_connfd(fd);
+            if (pc == NULL || pc->serial != ufd[fd].recv) {
+                uring_cancel(UD(UD_RECV, fd, ufd[fd].recv), UD(UD_CANCEL,0,0));
+                ufd[fd].recv = 0;
+            }
+        }
+        if (ufd[fd].conn != 0) {
+            wt = g_wt_list_find_by_connfd(fd);
+            if (wt == NULL || !wt_connecting(wt)) {
+                uring_cancel(UD(UD_CONNECT, fd, ufd[fd].conn), 
+                             UD(UD_CANCEL, 0, 0));
+                ufd[fd].conn = 0;
+            }
+        }
+        if (ufd[fd].ctl != 0 && ctl_serial(fd) != ufd[fd].ctl) {
+            uring_cancel(UD(UD_CTL, fd, ufd[fd].ctl), UD(UD_CANCEL, 0, 0));
+            ufd[fd].ctl = 0;
+        }
+    }
+}
+
+/**
+ * Submit the bytes queued for each peer, one send in flight per peer keeps
+ * them in order.
+ */
+static void
+uring_flush()
+{
+    struct peer_cache *pc;
+    struct send_req *req;
+
+    list_for_each_entry(pc, &g_pc_list.list, list) {
+        if (pc->sp == 0 || pc->sending)
+            continue;
+
+        if ((req = malloc(sizeof(struct send_req))) == NULL) {
+            perror("malloc error");
+            exit(1);
+        }
+        req->connfd = pc->connfd;
+        req->serial = pc->serial;
+        req->buf = pc->sendbuf;
+        req->len = pc->sp;
+        req->off = 0;
+        req->msgs = pc->sq;
+        pc->sendbuf = NULL;
+        pc->sp = 0;
+        pc->sendcap = 0;
+        pc->sq = 0;
+        send_calls++;
+
+        if (uring_send(req->connfd, req->buf, req->len, 
+                       UD(UD_SEND, 0, 0) | (uintptr_t)req) != 0) {
+            p2plog(ERROR, "Failed to submit send, fd = %d\n", req->connfd);
+            free(req->buf);
+            free(req);
+            continue;
+        }
+        pc->sending = 1;
+        send_inflight++;
+    }
+}
+
+/**
+ * Handle completion of a send, resubmit the rest after a short send.
+ */
+static void
+uring_send_done(uint64_t ud, int res)
+{
+    struct send_req *req = UD_PTR(ud);
+    struct peer_cache *pc;
+
+    pc = g_pc_list_find_by_connfd(req->connfd);
+    if (pc != NULL && pc->serial != req->serial)
+        pc = NULL;
+
+    if (res < 0) {
+        /* Leave the connection alive as the poll loop does, it will be 
+         * dropped when becoming zombie */
+        if (pc != NULL)
+            p2plog(ERROR, "Write error, fd = %d: %s\n", 
+                   req->connfd, strerror(-res));
+    } else if ((req->off += res) < req->len && pc != NULL) {
+        if (uring_send(req->connfd, req->buf + req->off, req->len - req->off,
+                       ud) == 0) {
+            send_calls++;
+            return;
+        }
+    } else if (req->off == req->len) {
+        send_msgs += req->msgs;
+    }
+
+    if (pc != NULL)
+        pc->sending = 0;
+    send_inflight--;
+    free(req->buf);
+    free(req);
+}
+
+/**
+ * Handle the result of reading from a peer: n bytes received in buf, 0 on
+ * end of file, -1 on error. The peer is dropped on end of file or error.
+ */
+static void
+peer_input(int connfd, char *buf, int n)
+{
+    peer_error = 0;
+    if (n > 0) {
+        recv_byte_stream(connfd, buf, n);
+        if (peer_error == 0)
+            return;
+    }
+
+    drop_peer(connfd, n);
+}
+
+/**
+ * Handle completion of a receive.
+ */
+static void
+uring_recv_done(uint64_t ud, int res, unsigned int flags)
+{
+    struct peer_cache *pc;
+    int fd = UD_FD(ud);
+
+    pc = g_pc_list_find_by_connfd(fd);
+    if (pc != NULL && pc->serial == UD_SERIAL(ud)) {
+        if (res > 0)
+            peer_input(fd, uring_buf(flags), res);
+        else if (res == 0)
+            peer_input(fd, NULL, 0);
+        else if (res != -ENOBUFS && res != -ECANCELED)
+            peer_input(fd, NULL, -1);
+    }
+    uring_buf_recycle(flags);
+
+    /* Not armed anymore, armed again by uring_arm() if the peer is alive */
+    if (!(flags & IORING_CQE_F_MORE)) {
+        recv_inflight--;
+        if (ufd_get(fd)->recv == UD_SERIAL(ud))
+            ufd_get(fd)->recv = 0;
+    }
+}
+
+/**
+ * Dispatch a completion.
+ */
+static void
+uring_dispatch(uint64_t ud, int res, unsigned int flags)
+{
+    struct sockaddr_storage cliaddr;
+    socklen_t clisize;
+    struct wt_node *wt;
+    struct uring_fd *u;
+
+    switch (UD_KIND(ud)) {
+        case UD_ACCEPT:
+            if (res >= 0) {
+                clisize = sizeof(cliaddr);
+                if (getpeername(res, (SA *)&cliaddr, &clisize) == 0) {
+                    accept_peer(res, (SA *)&cliaddr);
+                } else {
+                    p2plog(ERROR, "Accept() failed\n");
+                    Close(res);
+                }
+            } else if (res != -ECANCELED) {
+                p2plog(ERROR, "Accept() failed: %s\n", strerror(-res));
+            }
+            if (!(flags & IORING_CQE_F_MORE) && !quiescing)
+                uring_accept(lstn_fd, UD(UD_ACCEPT, lstn_fd, 0));
+            break;
+
+        case UD_RECV:
+            uring_recv_done(ud, res, flags);
+            break;
+
+        case UD_SEND:
+            uring_send_done(ud, res);
+            break;
+
+        case UD_CONNECT:
+            u = ufd_get(UD_FD(ud));
+            if (u->conn != UD_SERIAL(ud))
+                break;
+            u->conn = 0;
+            wt = g_wt_list_find_by_connfd(UD_FD(ud));
+            if (wt != NULL && wt_connecting(wt))
+                connect_done(wt);
+            break;
+
+        case UD_HEALTH:
+            if (res > 0)
+                handle_health();
+            if (!(flags & IORING_CQE_F_MORE))
+                uring_poll(health_fd, POLLIN, 1, UD(UD_HEALTH, health_fd, 0));
+            break;
+
+        case UD_UDP:
+            if (res > 0)
+                udp_recv(udp_input);
+            if (!(flags & IORING_CQE_F_MORE))
+                uring_poll(g_udp_fd, POLLIN, 1, UD(UD_UDP, g_udp_fd, 0));
+            break;
+
+        case UD_CTL_ACCEPT:
+            if (res > 0)
+                ctl_accept();
+            if (!(flags & IORING_CQE_F_MORE) && !quiescing)
+                uring_poll(ctl_lfd, POLLIN, 1, UD(UD_CTL_ACCEPT, ctl_lfd, 0));
+            break;
+
+        case UD_CTL:
+            u = ufd_get(UD_FD(ud));
+            if (u->ctl != UD_SERIAL(ud))
+                break;
+            u->ctl = 0;
+            if (res > 0 && ctl_serial(UD_FD(ud)) == UD_SERIAL(ud))
+                ctl_input(UD_FD(ud));
+            break;
+
+        default:
+            break;
+    }
+}
+
+/**
+ * Stop accepting and receiving, and wait for all sends to complete, so the
+ * peer caches are complete before connections are handed off.
+ */
+static void
+uring_quiesce()
+{
+    uint64_t ud;
+    unsigned int flags;
+    int fd, res, i;
+
+    quiescing = 1;
+    uring_cancel(UD(UD_ACCEPT, lstn_fd, 0), UD(UD_CANCEL, 0, 0));
+    for (fd = 0; fd < ufd_size; fd++) {
+        if (ufd[fd].recv != 0) {
+            uring_cancel(UD(UD_RECV, fd, ufd[fd].recv), UD(UD_CANCEL, 0, 0));
+            ufd[fd].recv = 0;
+        }
+    }
+
+    for (i = 0; i < 20 && (recv_inflight > 0 || send_inflight > 0); i++) {
+        uring_flush();
+        uring_wait(100);
+        while (uring_next(&ud, &res, &flags))
+            uring_dispatch(ud, res, flags);
+    }
+}
+
+/**
+ * The main loop on io_uring, falls back to poll if it is unavailable.
+ */
+static int
+node_loop_uring()
+{
+    uint64_t ud;
+    unsigned int flags;
+    int res, pending = 0;
+
+    if (uring_init(URING_ENTRIES, URING_NBUFS, URING_BUFSIZE) != 0) {
+        p2plog(WARN, "io_uring not available, use poll\n");
+        return node_loop();
+    }
+    p2plog(INFO, "Using io_uring\n");
+
+    uring_accept(lstn_fd, UD(UD_ACCEPT, lstn_fd, 0));
+    if (health_fd >= 0)
+        uring_poll(health_fd, POLLIN, 1, UD(UD_HEALTH, health_fd, 0));
+    if (g_udp_fd >= 0)
+        uring_poll(g_udp_fd, POLLIN, 1, UD(UD_UDP, g_udp_fd, 0));
+    if (ctl_lfd >= 0)
+        uring_poll(ctl_lfd, POLLIN, 1, UD(UD_CTL_ACCEPT, ctl_lfd, 0));
+
+    for ( ; ; ) {
+        if (handoff_req) {
+            uring_quiesce();
+            handoff_node();
+            /* Handoff failed, resume */
+            quiescing = 0;
+            uring_accept(lstn_fd, UD(UD_ACCEPT, lstn_fd, 0));
+        }
+
+        uring_arm();
+        uring_flush();
+
+        /* Wait TICK seconds, poll if QUERY are queued */
+        if (uring_wait(loop_timeout(pending)) != 0) {
+            p2plog(ERROR, "Failed to wait for completions\n");
+            continue;
+        }
+
+        while (uring_next(&ud, &res, &flags))
+            uring_dispatch(ud, res, flags);
+
+        pending = loop_tick();
+
+        uring_cancel_stale();
+    }
+
+    return 0;
+}
+#endif
+
+/**
+ * Start the p2p node.
+ */
+static int
+start_node()
+{
+    char *env;
+
+    if ((env = getenv(PMON_ENV_LISTEN)) != NULL) {
+        /* pmon owns the listening socket, so it survives our restarts */
+        struct sockaddr_storage addr;
+        socklen_t addrlen = sizeof(addr);
+        lstn_fd = atoi(env);
+        if (GetSockName(lstn_fd, (SA *)&addr, &addrlen) != 0 ||
+            sock_fromaddr((SA *)&addr, &g_lstn_addr.sin6_addr, 
+                          &g_lstn_addr.sin6_port) != 0) {
+            p2plog(ERROR, "Invalid listening socket from pmon\n");
+            return -1;
+        }
+        /* Calling listen() again only changes the backlog */
+        if (listen_queue > 0)
+            Listen(lstn_fd, listen_queue);
+    } else {
+        lstn_fd = ListenOn(&g_lstn_addr.sin6_addr, g_lstn_addr.sin6_port,
+                           listen_queue > 0 ? listen_queue : LISTEN_QUEUE);
+    }
+    p2plog(INFO, "P2P node starts on %s\n", 
+           sock_ntop(&g_lstn_addr.sin6_addr, g_lstn_addr.sin6_port));
+
+    if (use_udp && 
+        (g_udp_fd = udp_open(&g_lstn_addr.sin6_addr, g_lstn_addr.sin6_port,
+                             handle_datagram_error)) < 0) {
+        p2plog(WARN, "Failed to open datagram socket, use TCP only\n");
+    }
+
+    if (ctl_path != NULL &&
+        (ctl_lfd = ctl_open(ctl_path, ctl_command)) < 0) {
+        p2plog(WARN, "Failed to open control socket %s\n", ctl_path);
+    }
+    g_query_hit_cb = on_query_hit;
+
+    if ((env = getenv(PMON_ENV_HANDOFF_IN)) != NULL)
+        handoff_in = atoi(env);
+    if ((env = getenv(PMON_ENV_HANDOFF_OUT)) != NULL)
+        handoff_out = atoi(env);
+    if ((env = getenv(PMON_ENV_HEALTH)) != NULL)
+        health_fd = atoi(env);
+    start_time = time(NULL);
+    restore_node();
+
+    /* Start connecting to bootstrap and cached peers right away */
+    network_maintain();
+
+    return 0;
+}
+
+/**
+ * Drop all peers and free the node state, for p2pn_close() and a failed
+ * p2pn_open(). Pending queries are cancelled, the candidate set and the
+ * PONG cache are kept.
+ */
+static void
+node_free()
+{
+    struct nb_node *nb, *nb_tmp;
+    struct wt_node *wt, *wt_tmp;
+    struct key_value *kv, *kv_tmp;
+    struct hc_entry *hc, *hc_tmp;
+
+    list_for_each_entry_safe(nb, nb_tmp, &g_nb_list.list, list) {
+        drop_peer(nb->connfd, 1);
+    }
+    list_for_each_entry_safe(wt, wt_tmp, &g_wt_list.list, list) {
+        if (wt_connected(wt))
+            drop_peer(wt->connfd, 1);
+        else
+            g_wt_list_del(wt);
+    }
+    query_clear();
+    walk_clear();
+    sub_clear();
+    route_clear();
+    adm_clear();
+    g_msg_list_clear();
+    list_for_each_entry_safe(kv, kv_tmp, &g_kv_list.list, list) {
+        list_del(&kv->list);
+        free(kv);
+    }
+    list_for_each_entry_safe(hc, hc_tmp, &g_hc_list.list, list) {
+        list_del(&hc->list);
+        free(hc);
+    }
+    g_hc_list_size = 0;
+    free(watch);
+    watch = NULL;
+    watch_n = watch_cap = 0;
+    free(ready);
+    ready = NULL;
+    ready_size = 0;
+
+    ctl_close();
+    ctl_lfd = -1;
+    if (g_udp_fd >= 0) {
+        udp_close();
+        g_udp_fd = -1;
+    }
+    if (lstn_fd >= 0) {
+        Close(lstn_fd);
+        lstn_fd = -1;
+    }
+    if (g_ifaddrs != NULL) {
+        freeifaddrs(g_ifaddrs);
+        g_ifaddrs = NULL;
+    }
+    g_query_hit_cb = NULL;
+}
+
+/**
+ * Set up the node state from the configuration and start the node. The
+ * configuration is used as is by the node afterwards, its strings must stay
+ * valid until p2pn_close().
+ */
+struct p2pn_node *
+p2pn_open(const struct p2pn_config *cfg)
+{
+    if (node_handle.open) {
+        p2plog(ERROR, "A node is running already\n");
+        return NULL;
+    }
+
+    /*********************** Set node configuration **************************/
+    /* set "g_lstn_addr", IPv4 addresses are mapped, see sock_util.c */
+    memset(&g_lstn_addr, 0, sizeof(g_lstn_addr));
+    g_lstn_addr.sin6_family = AF_INET6;
+    if (cfg->listen != NULL) {
+        if (sock_pton(cfg->listen, &g_lstn_addr.sin6_addr, 
+                      &g_lstn_addr.sin6_port) < 0) {
+            p2plog(ERROR, "Invalid listen format (should be ipaddr:port)\n");
+            return NULL;
+        }
+
+        if (g_lstn_addr.sin6_port == 0) {
+            p2plog(ERROR, "Invalid listen port (should be nonzero)\n");
+            return NULL;
+        }
+    } else {
+        /* Dual-stack on any address */
+        g_lstn_addr.sin6_addr = in6addr_any;
+        g_lstn_addr.sin6_port = htons(PORT_DEFAULT);
+    }
+
+    /* set "g_ad_num" */
+    if (cfg->ad_num > 0 && cfg->ad_num <= MAX_PEER_AD) {
+        g_ad_num = cfg->ad_num;
+    } else {
+        if (cfg->ad_num != 0)
+            p2plog(WARN, "Invalid peer_ad number %d, set to DEFAULT:%d\n",
+                   cfg->ad_num, MAX_PEER_AD);
+        g_ad_num = MAX_PEER_AD;
+    }
+
+    /* set "g_node_mode" and "g_nb_max" */
+    if (cfg->mode == NULL || strcmp(cfg->mode, "peer") == 0) {
+        g_node_mode = MODE_PEER;
+        g_nb_max = NEIGHBOUR_MAX;
+    } else if (strcmp(cfg->mode, "super") == 0) {
+        g_node_mode = MODE_SUPER;
+        g_nb_max = NEIGHBOUR_MAX_SUPER;
+    } else if (strcmp(cfg->mode, "leaf") == 0) {
+        g_node_mode = MODE_LEAF;
+        g_nb_max = NEIGHBOUR_MAX_LEAF;
+    } else {
+        p2plog(ERROR, "Invalid node mode (should be peer, super or leaf)\n");
+        return NULL;
+    }
+
+    g_auto_join = cfg->no_join;
+    search_key = cfg->search_key;
+    hc_file = cfg->hc_file;
+    kv_file = cfg->kvfile;
+    ctl_path = cfg->ctl_path;
+    listen_queue = cfg->listen_queue;
+    recv_budget = cfg->recv_budget;
+    use_udp = cfg->udp;
+    
+    /********************  Init data structures ******************************/
+    memset(&g_kv_list, 0, sizeof(g_kv_list));
+    INIT_LIST_HEAD(&g_kv_list.list);
+
+    memset(&g_pc_list, 0, sizeof(g_pc_list));
+    INIT_LIST_HEAD(&g_pc_list.list);
+
+    memset(&g_msg_list, 0, sizeof(g_msg_list));
+    INIT_LIST_HEAD(&g_msg_list.list);
+
+    memset(&g_nb_list, 0, sizeof(g_nb_list));
+    INIT_LIST_HEAD(&g_nb_list.list);
+    g_nb_list_size = 0;
+
+    memset(&g_wt_list, 0, sizeof(g_wt_list));
+    INIT_LIST_HEAD(&g_wt_list.list);
+    g_wt_list_size = 0;
+
+    memset(&g_hc_list, 0, sizeof(g_hc_list));
+    INIT_LIST_HEAD(&g_hc_list.list);
+    g_hc_list_size = 0;
+
+    /* load key/value from kvfile */
+    if (cfg->kvfile != NULL) {
+        if(g_kv_list_load_from_file(cfg->kvfile) != 0) {
+            p2plog(ERROR, "Fail to read kvfile\n");
+            node_free();
+            return NULL;
+        }
+        stat(cfg->kvfile, &kv_stat);
+    }
+
+    /* put bootstrap node into waiting list */
+    struct in6_addr btstrp_ip;
+    uint16_t btstrp_port;
+    if (cfg->bootstrap) {
+        if ((sock_pton(cfg->bootstrap, &btstrp_ip, &btstrp_port)) < 0) {
+            p2plog(ERROR, 
+                   "Invalid bootstrap format (should be ipaddr:port)\n");
+            node_free();
+            return NULL;
+        }
+        struct wt_node *wt;
+        wt = wt_new(0, &btstrp_ip, btstrp_port);
+        wt_urgent_set(wt);
+        g_wt_list_add(wt);
+    }
+
+    /* put the best known peers from host cache into waiting list, they are 
+     * all connected in parallel together with bootstrap node */
+    if (hc_file != NULL && g_hc_list_load_from_file(hc_file) == 0) {
+        struct hc_entry *hc;
+        struct wt_node *wt;
+        int n = 0;
+        list_for_each_entry(hc, &g_hc_list.list, list) {
+            if (n >= g_nb_max) break;
+            if (g_wt_list_find_by_peer(&hc->ip, hc->lport) != NULL)
+                continue;
+            wt = wt_new(0, &hc->ip, hc->lport);
+            wt_urgent_set(wt);
+            g_wt_list_add(wt);
+            n++;
+        }
+    }
+
+    /* save all interfaces, used for self-loop determination */
+    if (getifaddrs(&g_ifaddrs) == -1) {
+        perror("getifaddrs()");
+        p2plog(ERROR, "Failed to get interfaces\n");
+        g_ifaddrs = NULL;
+        node_free();
+        return NULL;
+    }
+
+    /* set seed for rand() */
+    srand(time(NULL));
+
+    /* Start the p2p node */
+    if (start_node() != 0) {
+        node_free();
+        return NULL;
+    }
+
+    memset(&node_handle, 0, sizeof(node_handle));
+    node_handle.open = 1;
+    return &node_handle;
+}
+
+/* The only node there can be, see p2pn.h */
+static int
+node_check(const struct p2pn_node *node, const char *func)
+{
+    if (node == &node_handle && node->open)
+        return 1;
+
+    p2plog(ERROR, "%s() called without the open node\n", func);
+    return 0;
+}
+
+void
+p2pn_close(struct p2pn_node *node)
+{
+    if (node == NULL || !node->open || !node_check(node, __func__))
+        return;
+
+    node_free();
+    node->open = 0;
+}
+
+/**
+ * Run the node loop of the p2pn program, with the signal handlers it needs
+ * for pmon.
+ */
+int
+p2pn_run(struct p2pn_node *node)
+{
+    if (!node_check(node, __func__))
+        return -1;
+
+    /* set signal handler for SIGPIPE */
+    memset(&act, 0, sizeof(struct sigaction));
+    act.sa_handler = sig_pipe;
+    if (sigaction(SIGPIPE, &act, NULL) != 0) {
+        perror("sigaction()");
+        p2plog(ERROR, "Failed to set signal action\n");
+        return -1;
+    }
+
+    /* set signal handler for SIGUSR2, planned restart from pmon */
+    struct sigaction act_usr2;
+    memset(&act_usr2, 0, sizeof(struct sigaction));
+    act_usr2.sa_handler = sig_usr2;
+    if (sigaction(SIGUSR2, &act_usr2, NULL) != 0) {
+        perror("sigaction()");
+        p2plog(ERROR, "Failed to set signal action\n");
+        return -1;
+    }
+
+#ifdef USE_URING
+    return node_loop_uring();
+#else
+    return node_loop();
+#endif
+}
+
+/**
+ * The descriptors are those the node loop waits for, so the application's
+ * poll() takes the place of the node's own.
+ */
+int
+p2pn_pollfds(struct p2pn_node *node, struct pollfd *fds, int max)
+{
+    int n;
+
+    if (!node_check(node, __func__))
+        return -1;
+    n = watch_fds();
+    memcpy(fds, watch, (n < max ? n : max) * sizeof(struct pollfd));
+
+    return n;
+}
+
+int
+p2pn_timeout(struct p2pn_node *node)
+{
+    if (!node_check(node, __func__))
+        return -1;
+    return loop_timeout(node->pending);
+}
+
+/**
+ * One iteration of the node loop, with the descriptors found ready by the 
+ * application.
+ */
+int
+p2pn_step(struct p2pn_node *node, const struct pollfd *fds, int n)
+{
+    if (!node_check(node, __func__))
+        return -1;
+    ready_set(fds, n);
+    handle_ready();
+
+    node->pending = loop_tick();
+
+    flush_peers();
+    return 0;
+}
+
+uint32_t
+p2pn_query(struct p2pn_node *node, const char *key)
+{
+    if (!node_check(node, __func__))
+        return 0;
+    return send_query_message(key);
+}
+
+int
+p2pn_on_hit(struct p2pn_node *node, p2pn_hit_cb cb, void *arg)
+{
+    if (!node_check(node, __func__))
+        return -1;
+    node->hit_cb = cb;
+    node->hit_arg = arg;
+    return 0;
+}
+
+/* Pass a hit or the end of a query to the application, see query.h */
+static void
+app_query_cb(uint32_t msg_id, int status, const struct query_hit *hit,
+             void *arg)
+{
+    struct app_query *aq = arg;
+    struct p2pn_hit h;
+
+    if (hit != NULL) {
+        h.qh = *hit;
+        aq->cb(msg_id, status, &h, aq->arg);
+    } else {
+        aq->cb(msg_id, status, NULL, aq->arg);
+    }
+
+    /* The last call of the query */
+    if (status != QUERY_HIT)
+        free(aq);
+}
+
+uint32_t
+p2pn_query_async(struct p2pn_node *node, const char *key, int timeout_ms,
+                 int flags, p2pn_query_cb cb, void *arg)
+{
+    struct app_query *aq;
+    uint32_t msg_id;
+
+    if (!node_check(node, __func__))
+        return 0;
+
+    if ((aq = calloc(1, sizeof(struct app_query))) == NULL) {
+        perror("calloc error");
+        exit(1);
+    }
+    aq->cb = cb;
+    aq->arg = arg;
+    if ((msg_id = query_start(key, timeout_ms, flags, app_query_cb, aq)) == 0)
+        free(aq);
+
+    return msg_id;
+}
+
+int
+p2pn_query_cancel(struct p2pn_node *node, uint32_t msg_id)
+{
+    if (!node_check(node, __func__))
+        return -1;
+    return query_cancel(msg_id);
+}
+
+uint32_t
+p2pn_hit_query(const struct p2pn_hit *hit)
+{
+    return hit->qh.msg_id;
+}
+
+const char *
+p2pn_hit_key(const struct p2pn_hit *hit)
+{
+    return hit->qh.key;
+}
+
+int
+p2pn_hit_origin(const struct p2pn_hit *hit, char *buf, size_t size)
+{
+    return hit_origin(&hit->qh, buf, size);
+}
+
+int
+p2pn_hit_count(const struct p2pn_hit *hit)
+{
+    return hit->qh.count;
+}
+
+uint16_t
+p2pn_hit_id(const struct p2pn_hit *hit, int i)
+{
+    return i >= 0 && i < hit->qh.count ? ntohs(hit->qh.entries[i].res_id) : 0;
+}
+
+uint32_t
+p2pn_hit_value(const struct p2pn_hit *hit, int i)
+{
+    return i >= 0 && i < hit->qh.count ? ntohl(hit->qh.entries[i].res_val) : 0;
+}
@@ -0,0 +1,93 @@
+#define _POSIX_C_SOURCE     2       /* getopt */
+
+/**
+ * @brief p2pctl, talk to a running p2pn through its control socket
+ *
+ * The arguments are sent as one command line, and whatever the node answers
+ * is printed until it closes the connection.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "ctl.h"
+
+static void
+usage()
+{
+    printf("Usage: p2pctl -x [ctlsock] command [args]\n");
+    printf("    query <key> [seconds]   Search the network, print the hits\n");
+    printf("    walk <key> [seconds]    Search by random walks, not flooding\n");
+    printf("    neighbours              List the neighbours\n");
+    printf("    waiting                 List the waiting nodes\n");
+    printf("    stats                   Show the node counters\n");
+}
+
+int
+main(int argc, char **argv)
+{
+    struct sockaddr_un addr;
+    char line[CTL_LINE], buf[4096];
+    char *path = NULL;
+    size_t len = 0;
+    ssize_t n;
+    int fd, i, opt;
+
+    while ((opt = getopt(argc, argv, "x:")) != -1) {
+        switch (opt) {
+            case 'x':
+                path = optarg;
+                break;
+            default:
+                usage();
+                exit(1);
+        }
+    }
+    if (path == NULL || optind >= argc) {
+        usage();
+        exit(1);
+    }
+
+    for (i = optind; i < argc; i++) {
+        if (len + strlen(argv[i]) + 2 > sizeof(line)) {
+            fprintf(stderr, "p2pctl: command too long\n");
+            exit(1);
+        }
+        len += sprintf(line + len, "%s%s", argv[i], i + 1 < argc ? " " : "\n");
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "p2pctl: path too long: %s\n", path);
+        exit(1);
+    }
+    strcpy(addr.sun_path, path);
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+        connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        fprintf(stderr, "p2pctl: %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    if (write(fd, line, len) != (ssize_t)len) {
+        fprintf(stderr, "p2pctl: write: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    /* Hits are printed as they arrive */
+    while ((n = read(fd, buf, sizeof(buf))) > 0 ||
+           (n < 0 && errno == EINTR)) {
+        if (n > 0) {
+            fwrite(buf, 1, n, stdout);
+            fflush(stdout);
+        }
+    }
+    close(fd);
+
+    return n < 0 ? 1 : 0;
+}
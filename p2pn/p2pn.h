@@ -0,0 +1,135 @@
+#ifndef P2PN_H
+#define P2PN_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <poll.h>
+
+/**
+ * libp2pn, the P2P node as a library to embed in an application.
+ *
+ * The application either hands the thread over to p2pn_run(), as the p2pn
+ * program does, or drives the node from its own event loop:
+ *
+ *     n = p2pn_pollfds(node, fds, max);
+ *     poll(fds, n, p2pn_timeout(node));
+ *     p2pn_step(node, fds, n);
+ *
+ * The node state is global, so there can be only one node per process, and
+ * all calls must come from the same thread. Every call takes the handle
+ * p2pn_open() returned, with any other it logs an error and fails.
+ * Writes to a peer that has gone raise SIGPIPE, an application not using
+ * p2pn_run() should ignore it.
+ */
+
+/* The library exports these functions only, it is built -fvisibility=hidden */
+#define P2PN_API __attribute__((visibility("default")))
+
+/* Configuration of a node, fields left zero take the defaults of p2pn */
+struct p2pn_config {
+    const char *listen;         /* ip:port or [ipv6]:port, NULL for any */
+    const char *bootstrap;      /* Node to join first, or NULL */
+    const char *kvfile;         /* Key/value data file, or NULL */
+    const char *search_key;     /* Searched periodically, or NULL */
+    const char *hc_file;        /* Host cache file, or NULL */
+    const char *ctl_path;       /* Control socket for p2pctl, or NULL */
+    const char *mode;           /* "peer", "super" or "leaf", NULL for peer */
+    int         ad_num;         /* Max peers in PONG */
+    int         no_join;        /* Suppress auto join behaviour */
+    int         listen_queue;   /* Backlog of the listening socket */
+    int         recv_budget;    /* Bytes read from a peer at once */
+    int         udp;            /* Datagram side channel wanted */
+};
+
+struct p2pn_node;
+
+/* A QUERY_HIT, valid only during the callback it is passed to */
+struct p2pn_hit;
+
+/* Status passed to the callback of a query */
+#define P2PN_HIT            0           /* A hit, more may follow */
+#define P2PN_DONE           1           /* Deadline, or the first hit */
+#define P2PN_CANCELLED      2
+
+/* Flags of p2pn_query_async() */
+#define P2PN_QUERY_FIRST    0x01        /* Done at the first hit */
+#define P2PN_QUERY_WALK     0x02        /* Sent by random walkers */
+
+/* Called for each QUERY_HIT of a query sent by this node */
+typedef void (*p2pn_hit_cb)(const struct p2pn_hit *hit, void *arg);
+
+/**
+ * Called with P2PN_HIT and the hit for each hit of a query, then once with
+ * P2PN_DONE or P2PN_CANCELLED and no hit.
+ */
+typedef void (*p2pn_query_cb)(uint32_t msg_id, int status,
+                              const struct p2pn_hit *hit, void *arg);
+
+/* Start a node, NULL if the configuration is invalid or one is running */
+P2PN_API struct p2pn_node * p2pn_open(const struct p2pn_config *cfg);
+
+/* Disconnect all peers and stop the node */
+P2PN_API void p2pn_close(struct p2pn_node *node);
+
+/**
+ * Run the node loop of p2pn (poll or io_uring). Returns -1 only if the loop
+ * could not be started, it runs for good otherwise.
+ */
+P2PN_API int p2pn_run(struct p2pn_node *node);
+
+/**
+ * Fill fds with the descriptors to wait for, at most max of them. Returns
+ * the number the node has, call again with a larger array if it is more
+ * than max, or -1 with a bad handle.
+ */
+P2PN_API int p2pn_pollfds(struct p2pn_node *node, struct pollfd *fds, int max);
+
+/* Milliseconds to wait before p2pn_step() is due even if nothing is ready,
+ * -1 with a bad handle */
+P2PN_API int p2pn_timeout(struct p2pn_node *node);
+
+/* Handle the descriptors poll() found ready, and the timers that are due,
+ * -1 with a bad handle */
+P2PN_API int p2pn_step(struct p2pn_node *node, const struct pollfd *fds,
+                        int n);
+
+/* Send a QUERY, return its message ID to match hits, 0 on failure */
+P2PN_API uint32_t p2pn_query(struct p2pn_node *node, const char *key);
+
+/**
+ * Send a QUERY and report its hits to cb until timeout_ms have passed, or
+ * the first hit with P2PN_QUERY_FIRST. Returns its message ID, 0 on
+ * failure.
+ */
+P2PN_API uint32_t p2pn_query_async(struct p2pn_node *node, const char *key,
+                                   int timeout_ms, int flags,
+                                   p2pn_query_cb cb, void *arg);
+
+/* Stop waiting for hits of a query, cb is called with P2PN_CANCELLED */
+P2PN_API int p2pn_query_cancel(struct p2pn_node *node, uint32_t msg_id);
+
+/* Set the callback for hits of queries, NULL to clear it */
+P2PN_API int p2pn_on_hit(struct p2pn_node *node, p2pn_hit_cb cb, void *arg);
+
+/* Message ID of the QUERY the hit is for */
+P2PN_API uint32_t p2pn_hit_query(const struct p2pn_hit *hit);
+
+/* Key searched */
+P2PN_API const char * p2pn_hit_key(const struct p2pn_hit *hit);
+
+/**
+ * Write the address and port of the node that hit to buf, as ip:port, or
+ * ipv6:digest:port for an IPv6 node, whose address the header only holds a
+ * digest of. Returns what snprintf() does.
+ */
+P2PN_API int p2pn_hit_origin(const struct p2pn_hit *hit, char *buf,
+                             size_t size);
+
+/* Number of entries, resource ID and value pairs */
+P2PN_API int p2pn_hit_count(const struct p2pn_hit *hit);
+
+/* Resource ID and value of entry i, in host byte order, 0 past the last */
+P2PN_API uint16_t p2pn_hit_id(const struct p2pn_hit *hit, int i);
+P2PN_API uint32_t p2pn_hit_value(const struct p2pn_hit *hit, int i);
+
+#endif
@@ -10,23 +10,235 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <signal.h>
+#include <time.h>
 #include <sys/types.h>
+#include <sys/select.h>
 #include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "sock_util.h"
+#include "pmon.h"
 
 
 #define MAX_CMDLINE_PART 128
+#define LISTEN_QUEUE     5
+#define HANDOFF_SNDBUF   (1 << 20)
+
+/* Restart backoff in seconds, doubled on every crash */
+#define BACKOFF_MIN      1
+#define BACKOFF_MAX     64
+/* A child running this long is stable, the backoff is reset */
+#define STABLE_SECONDS  60
+/* At most RESTART_MAX crash restarts within RESTART_WINDOW seconds */
+#define RESTART_MAX     10
+#define RESTART_WINDOW 600
+/* Liveness probe interval, and how many missed probes mean a hang */
+#define HEALTH_SECONDS   5
+#define HEALTH_MISS      3
+
+static volatile pid_t child;
+static volatile sig_atomic_t stats_req;
+static int health_fd = -1;
+static char health[128] = "none";
+static time_t mon_start, child_start;
+
+/* Counters */
+static struct {
+  unsigned long restarts;
+  unsigned long crashes;
+  unsigned long hangs;
+  unsigned long handoffs;
+} stats;
 
 void usage()
 {
-  printf("pmon -c [COMMAND]\n");
+  printf("pmon -c [COMMAND] [-l [ip:port]]\n");
+  printf("    -c: Command to run and restart\n");
+  printf("    -l: Own the listening socket and hand it to the command\n");
+  printf("  Send SIGHUP to pmon to restart the command without dropping\n"
+         "  its connections, SIGUSR1 to print restart counters.\n");
+}
+
+/* Ask the child to hand off its connections and exit for a restart */
+static void sig_hup(int s)
+{
+  (void)s;
+  if (child > 0)
+    kill(child, SIGUSR2);
+}
+
+/* Print counters on request */
+static void sig_usr1(int s)
+{
+  (void)s;
+  stats_req = 1;
+}
+
+static void print_stats()
+{
+  time_t now = time(NULL);
+
+  stats_req = 0;
+  printf("pmon: up %ld s, child %d up %ld s, restarts %lu, crashes %lu, "
+         "hangs %lu, handoffs %lu, health \"%s\"\n",
+         (long)(now - mon_start), (int)child,
+         child > 0 ? (long)(now - child_start) : 0L,
+         stats.restarts, stats.crashes, stats.hangs, stats.handoffs, health);
+}
+
+/* Put a descriptor into the environment of the monitored process */
+static void setenv_fd(const char *name, int fd)
+{
+  char buf[16];
+
+  sprintf(buf, "%d", fd);
+  setenv(name, buf, 1);
+}
+
+/* Create the listening socket that survives restarts of the child */
+static int open_listen(char *lstn)
+{
+  struct in6_addr ip;
+  uint16_t port;
+
+  if (sock_pton(lstn, &ip, &port) < 0) {
+    fprintf(stderr, "pmon: invalid listen format (should be ipaddr:port)\n");
+    exit(1);
+  }
+
+  return ListenOn(&ip, port, LISTEN_QUEUE);
+}
+
+/* Create the unix socket pair to hand off connections between children.
+ * In-flight descriptors are kept by the kernel, so pmon itself never needs
+ * to read them. */
+static void open_handoff()
+{
+  int sv[2], size = HANDOFF_SNDBUF;
+
+  if (socketpair(AF_UNIX, SOCK_DGRAM, 0, sv) != 0) {
+    perror("socketpair()");
+    exit(1);
+  }
+  if (setsockopt(sv[1], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size)) != 0)
+    perror("setsockopt(SO_SNDBUF)");
+
+  setenv_fd(PMON_ENV_HANDOFF_IN, sv[0]);
+  setenv_fd(PMON_ENV_HANDOFF_OUT, sv[1]);
+}
+
+/* Wait for some seconds, even if interrupted by signals */
+static void sleep_for(unsigned int seconds)
+{
+  while (seconds > 0) {
+    seconds = sleep(seconds);
+    if (stats_req)
+      print_stats();
+  }
+}
+
+/**
+ * Watch the running child until it exits.
+ *
+ * Besides waiting for the exit, the child is probed over the health socket.
+ * A child that misses HEALTH_MISS probes in a row is considered hung and
+ * killed, so that it is restarted like a crashed one.
+ */
+static void supervise(pid_t pid, int *status)
+{
+  unsigned long seq = 0, acked = 0, s;
+  int missed = 0;
+  time_t now, next_probe;
+  char buf[128];
+  ssize_t n;
+
+  next_probe = time(NULL) + HEALTH_SECONDS;
+  for (;;) {
+    if (waitpid(pid, status, WNOHANG) == pid)
+      return;
+
+    if (stats_req)
+      print_stats();
+
+    if (health_fd < 0) {
+      sleep(1);
+      continue;
+    }
+
+    fd_set rset;
+    struct timeval tv = { 1, 0 };
+    FD_ZERO(&rset);
+    FD_SET(health_fd, &rset);
+    select(health_fd + 1, &rset, NULL, NULL, &tv);
+
+    while ((n = recv(health_fd, buf, sizeof(buf) - 1, MSG_DONTWAIT)) > 0) {
+      buf[n] = '\0';
+      /* replies to older probes, e.g. of the previous child, don't count */
+      if (sscanf(buf, "ok %lu", &s) == 1 && s <= seq && s > acked) {
+        acked = s;
+        strcpy(health, buf);
+      }
+    }
+
+    now = time(NULL);
+    if (now < next_probe)
+      continue;
+
+    if (seq > acked && ++missed >= HEALTH_MISS) {
+      printf("pmon: child %d missed %d probes, killing it.\n", pid, missed);
+      stats.hangs++;
+      kill(pid, SIGKILL);
+      missed = 0;
+    } else if (seq == acked) {
+      missed = 0;
+    }
+
+    n = sprintf(buf, "ping %lu", ++seq);
+    send(health_fd, buf, n, MSG_DONTWAIT);
+    next_probe = now + HEALTH_SECONDS;
+  }
+}
+
+/* Create the unix socket pair to probe the liveness of the child */
+static void open_health()
+{
+  int sv[2];
+
+  if (socketpair(AF_UNIX, SOCK_DGRAM, 0, sv) != 0) {
+    perror("socketpair()");
+    exit(1);
+  }
+
+  health_fd = sv[0];
+  setenv_fd(PMON_ENV_HEALTH, sv[1]);
 }
 
 int start_mon(char *argv[])
 {
   pid_t pid;
   int ret, status;
+  unsigned int backoff = BACKOFF_MIN, delay = 0;
+  time_t crashes[RESTART_MAX] = { 0 };
+  int ci = 0;
+  time_t now, uptime;
 
   for (;;) {
+    if (delay > 0) {
+      printf("pmon: restarting in %u seconds.\n", delay);
+      sleep_for(delay);
+    }
+
+    /* Rate limit: no more than RESTART_MAX crashes in RESTART_WINDOW */
+    now = time(NULL);
+    if (crashes[ci] != 0 && now - crashes[ci] < RESTART_WINDOW) {
+      delay = RESTART_WINDOW - (now - crashes[ci]);
+      printf("pmon: %d crashes within %d seconds, holding for %u seconds.\n",
+             RESTART_MAX, RESTART_WINDOW, delay);
+      sleep_for(delay);
+    }
+
     pid = fork();
 
     if (pid == -1) {
@@ -45,8 +257,34 @@ int start_mon(char *argv[])
     }
 
     if (pid > 0) { 
-      pid = wait(&status);
-      printf("pmon: child %d returned %d, restarting.\n", pid, status);
+      child = pid;
+      child_start = time(NULL);
+      supervise(pid, &status);
+      child = 0;
+
+      stats.restarts++;
+      uptime = time(NULL) - child_start;
+      if (WIFEXITED(status) && WEXITSTATUS(status) == PMON_EXIT_HANDOFF) {
+        /* planned restart, no delay */
+        stats.handoffs++;
+        delay = 0;
+        printf("pmon: child %d handed off after %ld seconds, restarting.\n",
+               pid, (long)uptime);
+      } else {
+        stats.crashes++;
+        crashes[ci] = time(NULL);
+        ci = (ci + 1) % RESTART_MAX;
+
+        /* exponential backoff, reset once the child has been stable */
+        if (uptime >= STABLE_SECONDS)
+          backoff = BACKOFF_MIN;
+        delay = backoff;
+        if (backoff < BACKOFF_MAX)
+          backoff <<= 1;
+        printf("pmon: child %d returned %d after %ld seconds, restarting.\n",
+               pid, status, (long)uptime);
+      }
+      print_stats();
     }
   }
 
@@ -56,17 +294,22 @@ int start_mon(char *argv[])
 int main(int argc, char *argv[])
 {
   int opt;
-  char *command, *p;
+  char *command, *lstn, *p;
   char *subopt[MAX_CMDLINE_PART] = { NULL };
   int soix;
 
   command = NULL;
-  while ((opt = getopt(argc, argv, "c:")) != -1) {
+  lstn = NULL;
+  while ((opt = getopt(argc, argv, "c:l:")) != -1) {
     switch (opt) {
       case 'c':
         command = optarg;
         break;
 
+      case 'l':
+        lstn = optarg;
+        break;
+
       default:
         usage();
         exit(1);
@@ -86,6 +329,29 @@ int main(int argc, char *argv[])
     soix++;
   }
   subopt[soix] = NULL;
+
+  if (lstn != NULL)
+    setenv_fd(PMON_ENV_LISTEN, open_listen(lstn));
+  open_handoff();
+  open_health();
+
+  struct sigaction act;
+  memset(&act, 0, sizeof(act));
+  act.sa_handler = sig_hup;
+  if (sigaction(SIGHUP, &act, NULL) != 0) {
+    perror("sigaction()");
+    exit(1);
+  }
+  act.sa_handler = sig_usr1;
+  if (sigaction(SIGUSR1, &act, NULL) != 0) {
+    perror("sigaction()");
+    exit(1);
+  }
+
+  /* Force output immediately */
+  setbuf(stdout, NULL);
+  mon_start = time(NULL);
+
   start_mon(subopt);
 
   return 0;
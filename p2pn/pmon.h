@@ -0,0 +1,19 @@
+#ifndef PMON_H
+#define PMON_H
+
+/* Environment variables set by pmon for the monitored process */
+
+/* Listening socket owned by pmon, inherited across restarts */
+#define PMON_ENV_LISTEN     "PMON_LISTEN_FD"
+/* Both ends of the unix socket used to hand off connections on restart,
+ * the old process sends to the OUT end and the new one receives from IN. */
+#define PMON_ENV_HANDOFF_IN     "PMON_HANDOFF_IN"
+#define PMON_ENV_HANDOFF_OUT    "PMON_HANDOFF_OUT"
+/* The unix socket on which pmon probes the liveness of the process. pmon
+ * sends "ping <seq>", the process replies "ok <seq> <status>". */
+#define PMON_ENV_HEALTH         "PMON_HEALTH_FD"
+
+/* Exit status of a process that handed off its state for a planned restart */
+#define PMON_EXIT_HANDOFF   75
+
+#endif
@@ -7,6 +7,8 @@
 #include <string.h>
 #include <errno.h> 
 #include <time.h>
+#include <unistd.h>
+#include <sys/time.h>
 #include <ifaddrs.h>
 #include <arpa/inet.h>
 
@@ -14,13 +16,25 @@
 #include "sock_util.h"
 #include "util.h"
 #include "proto.h"
+#include "udp.h"
+#include "sub.h"
+#include "route.h"
 
+extern struct key_value     g_kv_list;      /* List of key/value pairs */
 extern struct nb_node       g_nb_list;      /* List of neighbour nodes */
+extern int                  g_nb_list_size; /* Size of neighbor node list */
+extern unsigned int         g_nb_list_gen;  /* Changed with the neighbour set */
+extern int                  g_nb_max;       /* Max number of neighbours */
+extern enum NODEMODE        g_node_mode;    /* Role of this node */
 
-extern struct sockaddr_in   g_lstn_addr;    /* Listening address */
+extern struct sockaddr_in6  g_lstn_addr;    /* Listening address */
 extern int                  g_auto_join;    /* Flag of auto join nodes */
 extern int                  g_ad_num;       /* Peers number in advertisement */
 extern struct ifaddrs      *g_ifaddrs;      /* List of all interfaces */
+extern int                  g_udp_fd;       /* Datagram socket, -1 if off */
+extern int                  g_dgram_in;     /* Handling a datagram? */
+
+void (*g_query_hit_cb)(const struct query_hit *hit);
 
 
 
@@ -76,70 +90,110 @@ SuperFastHash (const char * data, int len) {
 /*---------------- END of the hash implementation -----------------------*/
 
 /**
- * Generate a message ID for new messages.
- *
- * The ID is generated by combining a prefix, current time stamp and the
- * message sequence together, and then hash the combination.
- *
- * @param prefix the prefix for hashing.
+ * Mix the bits of a 32-bit integer. It is a bijection, so distinct inputs
+ * always give distinct outputs ("lowbias32" by Chris Wellons).
  */
 static uint32_t
-gen_msgid(char *prefix)
+mix32(uint32_t x)
 {
-    static int msg_seq = 0;
-    if (msg_seq == 0) { /* initial the sequence number */        
-        msg_seq = rand() % 0xFFFF;
-    }
+    x ^= x >> 16;
+    x *= 0x7FEB352DU;
+    x ^= x >> 15;
+    x *= 0x846CA68BU;
+    x ^= x >> 16;
 
-    struct timeval now;
-    gettimeofday(&now, NULL);
+    return x;
+}
 
-    int n;
-    char buf[S_LEN];
-    n = sprintf(buf, "%s#%ld#%ld#%u",
-        prefix, (long)now.tv_sec, (long)now.tv_usec, ++msg_seq);
+/**
+ * The next message ID of a node, from its seed and sequence number.
+ *
+ * The ID is the sequence number mixed with the seed. As the mixing is a
+ * bijection of the sequence number, a node never repeats an ID within 2^32
+ * messages. The seed is mixed too, or seeds differing in a few bits would
+ * give IDs that collide more often than random ones. The ID is never 0.
+ * msgid_test.c checks all of this.
+ */
+uint32_t
+msgid_next(uint32_t seed, uint32_t *seq)
+{
+    uint32_t msg_id;
 
-    if (n > S_LEN) {
-        p2plog(ERROR, "Buffer out of boundary\n");
-        return 0;
-    }
+    do {
+        msg_id = mix32(mix32(++(*seq)) ^ mix32(seed));
+    } while (msg_id == 0);
 
-    return SuperFastHash(buf, n);
+    return msg_id;
 }
 
+/**
+ * Generate a message ID for new messages, see msgid_next(). The seed is
+ * made once from the origin address, the clock and the pid, so no string
+ * is formatted and no clock is read per message.
+ *
+ * @param ipaddr the IP address of the origin, for the seed.
+ * @param port   the listening port of the origin, for the seed.
+ */
 static uint32_t
-gen_msgid_wrap(uint32_t ipaddr, uint16_t port)
+gen_msgid(uint32_t ipaddr, uint16_t port)
 {
-    int n;
-    char buf[XS_LEN];
-    n = sprintf(buf, "%08X:%04X", ipaddr, port);
-
-    if (n > XS_LEN) {
-        p2plog(ERROR, "Buffer out of boundary\n");
-        return 0;
+    static uint32_t seed, msg_seq;
+    static int seeded;
+
+    if (!seeded) { /* initial the seed and the sequence number */
+        struct timeval now;
+        gettimeofday(&now, NULL);
+        seed = mix32(ipaddr ^ mix32(port ^ mix32(now.tv_sec ^ 
+                     mix32(now.tv_usec ^ mix32(getpid())))));
+        msg_seq = rand();
+        seeded = 1;
     }
 
-    return gen_msgid(buf);
+    return msgid_next(seed, &msg_seq);
+}
+
+/**
+ * Hash a search key, used by leaves to upload their key index and by
+ * super-peers to match queries against it.
+ */
+static uint32_t
+key_hash(const char *key)
+{
+    return SuperFastHash(key, strlen(key));
 }
 
+/* Hash the search key carried in the body of a QUERY message */
+static uint32_t
+query_key_hash(void *msg, unsigned int len)
+{
+    unsigned int keylen;
+    char buf[KEY_MAX + 1];
+
+    keylen = len - HLEN;
+    if (keylen > KEY_MAX)
+        keylen = KEY_MAX;
+    memcpy(buf, (char *)msg + HLEN, keylen);
+    buf[keylen] = '\0';
+
+    return key_hash(buf);
+}
 
 static uint32_t
-is_myself(struct in_addr *addr, uint16_t port)
+is_myself(struct in6_addr *addr, uint16_t port)
 {
-    if (port != g_lstn_addr.sin_port)
+    if (port != g_lstn_addr.sin6_port)
         return 0;
 
     struct ifaddrs *ifa;
+    struct in6_addr tmp;
+    uint16_t tmp_port;
     for (ifa = g_ifaddrs; ifa != NULL; ifa = ifa->ifa_next) {
         if (ifa->ifa_addr == NULL)
             continue;
 
-        if (ifa->ifa_addr->sa_family == AF_INET) {
-            struct in_addr *tmp;
-            tmp = &((struct sockaddr_in *)ifa->ifa_addr)->sin_addr;
-            if (memcmp(addr, tmp, sizeof(struct in_addr)) == 0)
-                return 1;
-        }
+        if (sock_fromaddr(ifa->ifa_addr, &tmp, &tmp_port) == 0 &&
+            memcmp(addr, &tmp, sizeof(struct in6_addr)) == 0)
+            return 1;
    }
 
    return 0;
@@ -158,7 +212,7 @@ init_p2ph(struct P2P_h* ph, uint8_t msgType)
     memset(ph, 0, sizeof(struct P2P_h));
 
     ph->version = 1;
-    ph->ttl = 5;
+    ph->ttl = DEF_TTL;
     ph->msg_type = msgType;
     ph->length = 0;
     ph->reserved = 0;
@@ -193,33 +247,22 @@ send_p2p_message(int connfd, void *msg, unsigned int len)
     struct P2P_h *ph;
     ph = (struct P2P_h *) msg;
 
-    /* Filling IP and PORT in header if necessary */
+    /* Filling IP and PORT in header if necessary, from the template of 
+     * the connection */
+    struct peer_cache *pc = g_pc_list_find_by_connfd(connfd);
     if (ph->org_ip == 0) {
-        struct sockaddr_in outgoing_addr;
-        socklen_t addrlen = sizeof(struct sockaddr_in);
-        if (GetSockName(connfd, (struct sockaddr *)&outgoing_addr, 
-                        &addrlen) == 0) {
-            ph->org_ip = outgoing_addr.sin_addr.s_addr;
-        } else {
-            if (g_lstn_addr.sin_addr.s_addr != INADDR_ANY)
-                ph->org_ip = g_lstn_addr.sin_addr.s_addr;
-            else {
-                p2plog(ERROR, "Orginal IP set failed\n");
-                return -1;
-            }
+        if (pc == NULL || pc->hdr.org_ip == INADDR_ANY) {
+            p2plog(ERROR, "Orginal IP set failed\n");
+            return -1;
         }
-        ph->org_port = g_lstn_addr.sin_port;
+        ph->org_ip = pc->hdr.org_ip;
+        ph->org_port = pc->hdr.org_port;
+        ph->reserved |= pc->hdr.reserved;
     }
 
     /* Filling the message id in header if necessary */
     if (ph->msg_id == 0) {
-        uint32_t msg_id;
-        msg_id = gen_msgid_wrap(ph->org_ip, ph->org_port);
-        if (msg_id == 0) {
-            p2plog(ERROR, "Message ID set failed\n");
-            return -1;
-        }
-        ph->msg_id = msg_id;
+        ph->msg_id = gen_msgid(ph->org_ip, ph->org_port);
     }
 
     /* filling the length field in header */
@@ -230,35 +273,24 @@ send_p2p_message(int connfd, void *msg, unsigned int len)
            nb != NULL, strtmp, ph->msg_type,
            ph->msg_id, ntohs(ph->length), ph->ttl);
 
-    /* sendint to the remote destination */
-    int nbytes, nsent = 0, nleft = len;
-    while (nleft) {
-        if ((nbytes = Write(connfd, (char*)msg + nsent, nleft)) < 0) {
-            if (errno == EINTR) continue;
-
-            /* Leave the connection alive because it is not safe to clear the 
-             * neighbour list or waiting list here as for_each_entry_safe() is
-             * not really safe. Therefore, we leave the connection alive here 
-             * and wait for it becoming zombie, then it will be removed 
-             * eventually. */
-            if (nb) {
-                p2plog(ERROR, "Write error, drop neighbour node %s, fd = %d\n", 
-                       sock_ntop(&nb->ip, nb->lport), connfd);
-//                Close(connfd);
-//                g_pc_list_remove_by_connfd(connfd);
-//                g_nb_list_del(nb);
-            } else if (wt) {
-                p2plog(ERROR, "Write error, drop waiting node %s, fd = %d\n", 
-                       sock_ntop(&wt->ip, wt->lport), connfd);
-//                Close(connfd);
-//                g_pc_list_remove_by_connfd(connfd);
-//                g_wt_list_del(wt);                
-            }
+    /* Heartbeats, QUERY and QHIT skip the TCP stream if the neighbour takes
+     * datagrams, a heartbeat is answered the way it came */
+    if (nb != NULL && nb->udp &&
+        (ph->msg_type == MSG_QUERY || ph->msg_type == MSG_QHIT ||
+         ph->msg_type == MSG_CANCEL ||
+         (ph->msg_type == MSG_PING && ph->ttl == PING_TTL_HB && 
+          (len == HLEN || (ph->reserved & PING_F_GOSSIP))) ||
+         (ph->msg_type == MSG_PONG && g_dgram_in &&
+          (len == HLEN || (ph->reserved & PING_F_GOSSIP)))) &&
+        udp_send(&nb->ip, nb->lport, msg, len, connfd) == 0)
+        return 0;
 
-            return -1;
-        }
-        nsent += nbytes;
-        nleft -= nbytes;
+    /* Queue to the peer cache, the node loop sends all bytes queued for a
+     * peer during an iteration at once. See flush_peers() in node.c */
+    if (pc == NULL || pc_enqueue(pc, msg, len) != 0) {
+        p2plog(ERROR, "Send queue full, drop message to %s, fd = %d\n",
+               strtmp, connfd);
+        return -1;
     }
 
     return 0;
@@ -278,16 +310,107 @@ forward_p2p_message(int connfd, void *msg, unsigned int len)
     }
 }
 
+/**
+ * Forward a flooded message to a neighbour, which may take a lower TTL.
+ * A QUERY sent is noted in its record, if given, for its CANCEL.
+ */
+static void
+relay_msg(struct nb_node *nb, void *msg, unsigned int len, 
+          struct message *query)
+{
+    struct P2P_h *ph;
+    uint8_t ttl;
+
+    ph = (struct P2P_h *) msg;
+    ttl = ph->ttl;
+    if (!nb->gossip && ttl > DEF_TTL)
+        ph->ttl = DEF_TTL;
+    if (forward_p2p_message(nb->connfd, msg, len) == 0 && ttl > 0 &&
+        query != NULL)
+        msg_sent_to(query, nb->connfd);
+    ph->ttl = ttl;
+}
+
+static void
+flood_msg(int fromfd, void *msg, unsigned int len, struct message *query)
+{
+    struct nb_node *nb;
+
+    list_for_each_entry(nb, &g_nb_list.list, list) {
+        /* Leaves never relay floods, they are served by their index */
+        if (nb->connfd != fromfd && !nb->leaf)
+            relay_msg(nb, msg, len, query);
+    }
+}
+
+/* Send a CANCEL to the neighbours its QUERY was sent to */
+static void
+cancel_msg(struct message *query, void *msg, unsigned int len)
+{
+    struct nb_node *nb;
+    int i;
+
+    for (i = 0; i < query->ntofd; i++) {
+        if ((nb = g_nb_list_find_by_connfd(query->tofd[i])) != NULL)
+            relay_msg(nb, msg, len, NULL);
+    }
+}
+
+/**
+ * Send a QUERY only to the neighbours its key was hit through lately, see
+ * route.h. Return -1 if there are none and it is to be flooded.
+ */
+static int
+route_query(struct message *query, void *msg, unsigned int len)
+{
+    struct nb_node *nb;
+    int fds[ROUTE_NB], i, n;
+
+    if (((struct P2P_h *)msg)->ttl == 0)
+        return -1;
+    n = route_lookup(query_key_hash(msg, len), query->fromfd, fds, ROUTE_NB);
+    if (n == 0 || route_wait(((struct P2P_h *)msg)->msg_id) != 0)
+        return -1;
+
+    for (i = 0; i < n; i++) {
+        if ((nb = g_nb_list_find_by_connfd(fds[i])) != NULL)
+            relay_msg(nb, msg, len, query);
+    }
+    query->routed = 1;
+    p2plog(DEBUG, "Query %08X sent along %d learnt routes\n",
+           ((struct P2P_h *)msg)->msg_id, n);
+
+    return 0;
+}
+
+/**
+ * Pass a QUERY to those leaves whose key index contains the search key.
+ *
+ * Leaves hang off this node, so they are reached even if the TTL of the
+ * query has run out here.
+ */
 static void
-flood_msg(int fromfd, void *msg, unsigned int len)
+route_to_leaves(int fromfd, void *msg, unsigned int len)
 {
     struct nb_node *nb;
+    struct P2P_h *ph;
+    uint32_t hash;
+    uint8_t ttl;
+
+    ph = (struct P2P_h *) msg;
+    hash = query_key_hash(msg, len);
+    ttl = ph->ttl;
+    ph->ttl = 1;
 
     list_for_each_entry(nb, &g_nb_list.list, list) {
-        if (nb->connfd != fromfd) {
-            forward_p2p_message(nb->connfd, msg, len);
+        if (nb->connfd != fromfd && nb->leaf && nb_kidx_has(nb, hash)) {
+            p2plog(DEBUG, "Query routed to leaf %s\n",
+                   sock_ntop(&nb->ip, nb->lport));
+            send_p2p_message(nb->connfd, msg, len);
         }
     }
+
+    ph->ttl = ttl;
 }
 
 /*------------------------------------------------------------------------*/
@@ -298,6 +421,8 @@ send_join_message(int connfd)
     struct P2P_h ph_out;
 
     init_p2ph(&ph_out, MSG_JOIN);
+    if (g_udp_fd >= 0)
+        ph_out.reserved = JOIN_F_UDP;
 
     return send_p2p_message(connfd, &ph_out, HLEN);
 }
@@ -314,7 +439,7 @@ handle_join_message(int connfd, void *msg, unsigned int len)
     ph_in = (struct P2P_h *) msg;
 
     if (len == HLEN) { /* JOIN REQUEST */
-        struct in_addr *ipaddr = (struct in_addr *)&ph_in->org_ip;
+        struct in6_addr *ipaddr, org_ip;
         uint16_t lport = ph_in->org_port;
 
         /* JOIN message is sent normally after a node connects another one
@@ -340,10 +465,11 @@ handle_join_message(int connfd, void *msg, unsigned int len)
              * Normally a node using NAT will not accept JOIN request sending
              * by us because it cannot accept the connection from outside 
              * except for specific configuration at NAT gateway. */
-            if (memcmp(ipaddr, &wt_in->ip, sizeof(struct in_addr))) {
+            if (ph_in->org_ip != sock_addr32(&wt_in->ip)) {
+                sock_map_v4(&org_ip, ph_in->org_ip);
                 p2plog(INFO, "NAT Found: %s\n", 
                        sock_ntop(&wt_in->ip, wt_in->lport));
-                p2plog(INFO, "origin IP: %s\n", sock_ntop(ipaddr, lport));
+                p2plog(INFO, "origin IP: %s\n", sock_ntop(&org_ip, lport));
             }
             ipaddr = &wt_in->ip;
 
@@ -356,7 +482,15 @@ handle_join_message(int connfd, void *msg, unsigned int len)
              * might be inserted by PONG message handler. */
             struct wt_node *wt_dup = g_wt_list_find_by_peer(ipaddr, lport);
 
-            if (nb_dup == NULL && wt_dup == NULL) {
+            if (g_node_mode == MODE_LEAF && g_nb_list_size >= g_nb_max) {
+                /* A leaf only keeps a few super-peers, refuse the rest */
+                p2plog(INFO, "Leaf is full, drop %s, fd = %d\n",
+                       sock_ntop(ipaddr, lport), connfd);
+                Close(connfd);
+                g_pc_list_remove_by_connfd(connfd);
+                g_wt_list_del(wt_in);
+                return -1;
+            } else if (nb_dup == NULL && wt_dup == NULL) {
                 /* This is a new neighbor, insert it into neighbor list */
                 p2plog(INFO, "NEW NEIGHBOR, accept from %s\n",
                        sock_ntop(ipaddr, lport));
@@ -385,18 +519,28 @@ handle_join_message(int connfd, void *msg, unsigned int len)
                 return -1;
             }
         }
+        /* Datagrams are used only if both sides take them */
+        struct nb_node *nb_acc = g_nb_list_find_by_connfd(connfd);
+        if (nb_acc != NULL)
+            nb_acc->udp = g_udp_fd >= 0 && (ph_in->reserved & JOIN_F_UDP);
+
         /* prepare for outgoing JOIN_ACC message */
         char buf[S_LEN];
         struct P2P_h *ph_out;
     
         ph_out = (struct P2P_h *) buf;
         init_p2ph(ph_out, MSG_JOIN);
+        if (g_udp_fd >= 0)
+            ph_out->reserved = JOIN_F_UDP;
         ph_out->ttl = 1;
         ph_out->msg_id = ph_in->msg_id;
         pj = (struct P2P_join *) (buf + HLEN);
         pj->status = htons(JOIN_ACC);
 
         send_p2p_message(connfd, ph_out, HLEN + JOINLEN);
+
+        if (nb == NULL && g_node_mode == MODE_LEAF)
+            send_index_message(connfd);
     } else if (len == HLEN + JOINLEN && 
                ntohs(ph_in->length) == JOINLEN) { /* JOIN RESPONSE */
         wt_in = g_wt_list_find_by_connfd(connfd);
@@ -425,83 +569,351 @@ handle_join_message(int connfd, void *msg, unsigned int len)
         nb = g_nb_list_find_by_connfd(connfd);
         if (nb == NULL) {
             nb = nb_new(connfd, &wt_in->ip, wt_in->lport);
+            nb->udp = g_udp_fd >= 0 && (ph_in->reserved & JOIN_F_UDP);
             g_nb_list_add(nb);
             g_wt_list_del(wt_in);
             p2plog(INFO, "NEW NEIGHBOR, accepted by %s\n",
                    sock_ntop(&nb->ip, nb->lport));
+            cand_joined(&nb->ip, nb->lport);
+
+            if (g_node_mode == MODE_LEAF)
+                send_index_message(connfd);
         }
     }
 
     return 0;
 }
 
+/**
+ * Network size estimation. Each node draws GOSSIP_K random values, and
+ * neighbours keep each other's element-wise minima in their heartbeats, so
+ * after as many heartbeats as the diameter of the network every node has
+ * the minima over all nodes. The minimum of N uniform values is about
+ * 1 / (N + 1), which gives N from the sum of the minima.
+ */
+static struct {
+    uint16_t    epoch;
+    time_t      started;            /* 0 before the first epoch */
+    uint32_t    min[GOSSIP_K];
+    int         last_size;          /* Estimate of the previous epoch */
+} gossip;
+
+static int
+gossip_estimate()
+{
+    double sum = 0;
+    int i;
+
+    for (i = 0; i < GOSSIP_K; i++)
+        sum += gossip.min[i] / 4294967296.0;
+
+    return sum > 0 ? (int)((GOSSIP_K - 1) / sum - 1 + 0.5) : 1;
+}
+
+/* Start over with values of our own */
+static void
+gossip_epoch(uint16_t epoch, time_t now)
+{
+    int i;
+
+    if (gossip.started != 0)
+        gossip.last_size = gossip_estimate();
+    gossip.epoch = epoch;
+    gossip.started = now;
+    for (i = 0; i < GOSSIP_K; i++)
+        gossip.min[i] = gen_msgid(sock_addr32(&g_lstn_addr.sin6_addr), 
+                                  g_lstn_addr.sin6_port);
+}
+
+static void
+gossip_fill(struct P2P_gossip *g)
+{
+    struct nb_node *nb;
+    time_t now = time(NULL);
+    int i, degree = 0;
+
+    if (gossip.started == 0 || now - gossip.started >= GOSSIP_EPOCH_SECONDS)
+        gossip_epoch(gossip.epoch + 1, now);
+
+    list_for_each_entry(nb, &g_nb_list.list, list) {
+        if (!nb->leaf)
+            degree++;
+    }
+    g->epoch = htons(gossip.epoch);
+    g->degree = htons(degree);
+    for (i = 0; i < GOSSIP_K; i++)
+        g->min[i] = htonl(gossip.min[i]);
+}
+
+/* Take the minima of a neighbour, or its epoch if that is newer */
+static void
+gossip_merge(struct nb_node *nb, const struct P2P_gossip *g)
+{
+    int16_t age;
+    int i;
+
+    nb->degree = ntohs(g->degree);
+
+    age = (int16_t)(ntohs(g->epoch) - gossip.epoch);
+    if (gossip.started == 0 || age > 0)
+        gossip_epoch(ntohs(g->epoch), time(NULL));
+    else if (age < 0)
+        return;
+
+    for (i = 0; i < GOSSIP_K; i++) {
+        if (ntohl(g->min[i]) < gossip.min[i])
+            gossip.min[i] = ntohl(g->min[i]);
+    }
+}
+
+int
+gossip_size()
+{
+    int size;
+
+    if (gossip.started == 0)
+        return 1;
+
+    /* The minima of a new epoch take a while to spread */
+    size = gossip_estimate();
+    return size > gossip.last_size ? size : gossip.last_size;
+}
+
+/**
+ * The smallest TTL that reaches TTL_REACH times the estimated size, if the
+ * QUERY spread as a tree whose branching is the average degree of the
+ * neighbours less the link it came on. DEF_TTL until the neighbours have
+ * gossiped.
+ */
+int
+query_ttl()
+{
+    struct nb_node *nb;
+    double branch = 0, hop, reach;
+    int ttl, degree = 0, known = 0;
+
+    list_for_each_entry(nb, &g_nb_list.list, list) {
+        if (nb->leaf)
+            continue;
+        degree++;
+        if (nb->degree > 0) {
+            branch += nb->degree - 1;
+            known++;
+        }
+    }
+    if (known == 0)
+        return DEF_TTL;
+    branch /= known;
+
+    hop = reach = degree;
+    for (ttl = 1; ttl < MAX_TTL && reach < TTL_REACH * (gossip_size() - 1);
+         ttl++) {
+        hop *= branch;
+        reach += hop;
+    }
+
+    return ttl;
+}
+
 int
 send_ping_message(int connfd, int ttl)
 {
-    struct P2P_h ph_out;
+    struct nb_node *nb;
+    char buf[HLEN + GOSSIPLEN];
+    struct P2P_h *ph_out;
+    unsigned int len = HLEN;
 
-    init_p2ph(&ph_out, MSG_PING);
-    ph_out.ttl = ttl;
+    ph_out = (struct P2P_h *) buf;
+    init_p2ph(ph_out, MSG_PING);
+    ph_out->ttl = ttl;
+    /* Probes ask for IPv6 entries as well */
+    if (ttl > PING_TTL_HB) {
+        ph_out->reserved = PING_F_IPV6;
+    } else {
+        /* Heartbeats offer to gossip, with the minima once it is taken */
+        ph_out->reserved = PING_F_GOSSIP;
+        if ((nb = g_nb_list_find_by_connfd(connfd)) != NULL && nb->gossip) {
+            gossip_fill((struct P2P_gossip *) (buf + HLEN));
+            len += GOSSIPLEN;
+            nb->gossiped = time(NULL);
+        }
+    }
     
-    return send_p2p_message(connfd, &ph_out, HLEN);
+    return send_p2p_message(connfd, buf, len);
+}
+
+/**
+ * Entries advertised in PONG, rebuilt only when the neighbour set changes.
+ * One more entry than advertised is kept, as the neighbour probing us is
+ * left out of its PONG.
+ */
+static struct {
+    unsigned int            gen;
+    int                     count;
+    int                     connfd[MAX_PEER_AD + 1];
+    struct in6_addr         ip[MAX_PEER_AD + 1];
+    uint16_t                port[MAX_PEER_AD + 1];
+} pong_cache;
+
+/* Check if a neighbour is in the PONG cache, or shares its subnet (/24 for
+ * IPv4, /64 for IPv6) or its IP address with an entry (level 0 and 1) */
+static int
+pong_cache_has(struct nb_node *nb, int level)
+{
+    size_t n;
+    int i;
+
+    if (level == 0)
+        n = sock_is_v4(&nb->ip) ? 15 : 8;
+    else
+        n = sizeof(struct in6_addr);
+    for (i = 0; i < pong_cache.count; i++) {
+        if (pong_cache.connfd[i] == nb->connfd)
+            return 1;
+        if (level < 2 && memcmp(&pong_cache.ip[i], &nb->ip, n) == 0)
+            return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Choose the neighbours to advertise in PONG. Spread them over as many
+ * subnets as possible, then hosts, so the peers learning them get paths
+ * into different parts of the network instead of the head of our list.
+ */
+static void
+pong_cache_build()
+{
+    struct nb_node *nb;
+    int level;
+
+    pong_cache.count = 0;
+    for (level = 0; level < 3; level++) {
+        list_for_each_entry(nb, &g_nb_list.list, list) {
+            if (pong_cache.count > g_ad_num)
+                break;
+            /* Leaves do not accept JOIN from strangers, never advertise them */
+            if (nb->leaf || pong_cache_has(nb, level))
+                continue;
+            pong_cache.connfd[pong_cache.count] = nb->connfd;
+            pong_cache.ip[pong_cache.count] = nb->ip;
+            pong_cache.port[pong_cache.count] = nb->lport;
+            pong_cache.count++;
+        }
+    }
+    pong_cache.gen = g_nb_list_gen;
 }
 
 int
 handle_ping_message(int connfd, void *msg, unsigned int len)
 {
     struct P2P_h *ph_in, *ph_out;
-    char buf[M_LEN];
+    char buf[HLEN + PONG_MINLEN + MAX_PEER_AD * PONG_ENTRY6LEN];
 
     ph_in = (struct P2P_h *)msg;
-    memset(buf, 0, M_LEN);
+    memset(buf, 0, sizeof(buf));
     ph_out = (struct P2P_h *) buf;
     init_p2ph(ph_out, MSG_PONG);
     ph_out->ttl = 1;
     ph_out->msg_id = ph_in->msg_id;
 
-    if (ph_in->ttl == 1 && len == HLEN) {
+    if (ph_in->ttl == 1 && (len == HLEN || 
+        ((ph_in->reserved & PING_F_GOSSIP) && len == HLEN + GOSSIPLEN))) {
         /* heartbeat */
         p2plog(DEBUG, "Heartbeat\n");
-        return send_p2p_message(connfd, ph_out, HLEN);
+        if (!(ph_in->reserved & PING_F_GOSSIP))
+            return send_p2p_message(connfd, ph_out, HLEN);
+
+        struct nb_node *nb;
+        if ((nb = g_nb_list_find_by_connfd(connfd)) != NULL) {
+            nb->gossip = 1;
+            if (len > HLEN)
+                gossip_merge(nb, (struct P2P_gossip *) ((char *)msg + HLEN));
+        }
+        ph_out->reserved = PING_F_GOSSIP;
+        gossip_fill((struct P2P_gossip *) (buf + HLEN));
+        return send_p2p_message(connfd, ph_out, HLEN + GOSSIPLEN);
     }
 
-    /* network probe */
+    /* network probe, answered once even if it reaches us again */
     p2plog(DEBUG, "Probe\n");
+    struct message *msg_saved;
+    if ((msg_saved = g_msg_list_find(ph_in->msg_id, MSG_PING)) != NULL) {
+        p2plog(DEBUG, "Duplicate probe [%08X], ignored\n", ph_in->msg_id);
+        return 0;
+    }
+    g_msg_list_gc();
+    g_msg_list_add(msg_new(ph_in, HLEN, connfd));
+
     struct P2P_pong_front *pf;
     struct P2P_pong_entry *pe;
-
-    /* Fill in pong entry */
-    struct nb_node *nb;
-    int count = 0;
-
-    list_for_each_entry(nb, &g_nb_list.list, list) {
-        pe = (struct P2P_pong_entry *)
-                (buf + HLEN + PONG_MINLEN + count * PONG_ENTRYLEN);
-        if (nb->connfd != connfd) {
-            pe->ip = nb->ip;
-            pe->port = nb->lport;
-            pe->sbz = 0;
+    struct P2P_pong_entry6 *pe6;
+
+    /* Fill in pong entry, IPv4 entries first, then IPv6 ones if the 
+     * requester understands them */
+    int i, count = 0, count6 = 0;
+    int ipv6 = ph_in->reserved & PING_F_IPV6;
+    char *p = buf + HLEN + PONG_MINLEN;
+
+    if (pong_cache.gen != g_nb_list_gen)
+        pong_cache_build();
+    for (i = 0; i < pong_cache.count && count < g_ad_num; i++) {
+        if (pong_cache.connfd[i] != connfd && 
+            sock_is_v4(&pong_cache.ip[i])) {
+            pe = (struct P2P_pong_entry *)p;
+            pe->ip.s_addr = sock_addr32(&pong_cache.ip[i]);
+            pe->port = pong_cache.port[i];
+            p += PONG_ENTRYLEN;
             count++;
         }
-        if (count >= g_ad_num) break;
+    }
+    for (i = 0; ipv6 && i < pong_cache.count && count + count6 < g_ad_num; 
+         i++) {
+        if (pong_cache.connfd[i] != connfd && 
+            !sock_is_v4(&pong_cache.ip[i])) {
+            pe6 = (struct P2P_pong_entry6 *)p;
+            pe6->ip = pong_cache.ip[i];
+            pe6->port = pong_cache.port[i];
+            p += PONG_ENTRY6LEN;
+            count6++;
+        }
     }
     /* Fill in pong front */
     pf = (struct P2P_pong_front *) (buf + HLEN);
     pf->entry_size = htons(count);
-    pf->sbz = 0;
+    pf->sbz = htons(count6);
+    if (ipv6)
+        ph_out->reserved = PING_F_IPV6;
 
-    return send_p2p_message(connfd, ph_out, 
-                            HLEN + PONG_MINLEN + count * PONG_ENTRYLEN);
+    return send_p2p_message(connfd, ph_out, p - buf);
 
 }
 
 /* TODO: send_pong_message() */
 
 int
-handle_pong_message(void *msg, unsigned int len)
+handle_pong_message(int connfd, void *msg, unsigned int len)
 {
-    if (len == HLEN) {
-        /* This is a pong message reacting to heartbeat */
+    if (len == HLEN || 
+        ((((struct P2P_h *)msg)->reserved & PING_F_GOSSIP) && 
+         len == HLEN + GOSSIPLEN)) {
+        /* This is a pong message reacting to heartbeat, measure RTT */
+        struct nb_node *nb;
+        struct timeval now;
+
+        nb = g_nb_list_find_by_connfd(connfd);
+        if (nb != NULL && nb->hb_tv.tv_sec != 0) {
+            gettimeofday(&now, NULL);
+            nb->rtt = (now.tv_sec - nb->hb_tv.tv_sec) * 1000 +
+                      (now.tv_usec - nb->hb_tv.tv_usec) / 1000;
+            memset(&nb->hb_tv, 0, sizeof(nb->hb_tv));
+            cand_rtt(&nb->ip, nb->lport, nb->rtt);
+        }
+        if (nb != NULL && len > HLEN) {
+            nb->gossip = 1;
+            gossip_merge(nb, (struct P2P_gossip *) ((char *)msg + HLEN));
+        }
         return 0;
     }
 
@@ -512,106 +924,152 @@ handle_pong_message(void *msg, unsigned int len)
     }
 
     struct P2P_pong_front *pf;
-    int entry_size;
+    struct P2P_h *ph_in = (struct P2P_h *)msg;
+    int entry_size, entry6_size = 0;
 
     pf = (struct P2P_pong_front *) ((char *)msg + HLEN);
     entry_size = ntohs(pf->entry_size);
-    if (len != entry_size*PONG_ENTRYLEN + PONG_MINLEN + HLEN) {
+    if (ph_in->reserved & PING_F_IPV6)
+        entry6_size = ntohs(pf->sbz);
+    if (len != entry_size*PONG_ENTRYLEN + entry6_size*PONG_ENTRY6LEN + 
+               PONG_MINLEN + HLEN) {
         /* check if pong's entry size is valid */
-        p2plog(ERROR, "PONG invalid length (%d) with entry size = %d\n", 
-               len, entry_size);
+        p2plog(ERROR, "PONG invalid length (%d) with entry size = %d + %d\n", 
+               len, entry_size, entry6_size);
         return -1;
     }
 
-    struct P2P_pong_entry *pe;
-    /* iterate each pong entry and add it to waiting list */
-    pe = (struct P2P_pong_entry *)((char *)msg + HLEN + PONG_MINLEN);
-    p2plog(DEBUG, "PONG with %d entries.\n", entry_size);
+    p2plog(DEBUG, "PONG with %d + %d entries.\n", entry_size, entry6_size);
     if (g_auto_join) {
         p2plog(DEBUG, "Auto join suppressed\n");
         return 0;
     }
 
     int i;
-    for (i = 0; i < entry_size; i++) {
-        p2plog(DEBUG, "HLEN %d MINLEN %d ENTRYLEN %d\n",
-               HLEN, PONG_MINLEN, PONG_ENTRYLEN * i);
-        pe = (struct P2P_pong_entry *)
-                ((char *)msg + HLEN + PONG_MINLEN + PONG_ENTRYLEN * i);
+    struct in6_addr ip;
+    uint16_t port;
+    struct P2P_pong_entry *pe;
+    struct P2P_pong_entry6 *pe6;
+    time_t now = time(NULL);
+    /* iterate each pong entry and add it to the candidates */
+    for (i = 0; i < entry_size + entry6_size; i++) {
+        if (i < entry_size) {
+            pe = (struct P2P_pong_entry *)
+                    ((char *)msg + HLEN + PONG_MINLEN + PONG_ENTRYLEN * i);
+            sock_map_v4(&ip, pe->ip.s_addr);
+            port = pe->port;
+        } else {
+            pe6 = (struct P2P_pong_entry6 *)
+                    ((char *)msg + HLEN + PONG_MINLEN + 
+                     PONG_ENTRYLEN * entry_size + 
+                     PONG_ENTRY6LEN * (i - entry_size));
+            memcpy(&ip, &pe6->ip, sizeof(ip));
+            port = pe6->port;
+            /* An IPv6 entry must not smuggle in an IPv4 address */
+            if (sock_is_v4(&ip))
+                continue;
+        }
 
         /* If the entry contains a self address, ignore it. */
-        if (is_myself(&pe->ip, pe->port)) {
-            p2plog(WARN, "Self loop detected: %s\n", 
-                   sock_ntop(&pe->ip, pe->port));
+        if (is_myself(&ip, port)) {
+            p2plog(WARN, "Self loop detected: %s\n", sock_ntop(&ip, port));
             continue;
         }
 
-        if (g_wt_list_find_by_peer(&pe->ip, pe->port) == NULL && 
-            g_nb_list_find_by_peer(&pe->ip, pe->port) == NULL) {
-            g_wt_list_add(wt_new(0, &pe->ip, pe->port));
-            p2plog(DEBUG, "ENTRY: %s, inserted\n",
-                   sock_ntop(&pe->ip, pe->port));
+        if (g_wt_list_find_by_peer(&ip, port) == NULL && 
+            g_nb_list_find_by_peer(&ip, port) == NULL &&
+            cand_seen(&ip, port, now) == 0) {
+            p2plog(DEBUG, "ENTRY: %s, inserted\n", sock_ntop(&ip, port));
         } else {
-            p2plog(DEBUG, "ENTRY: %s, discarded\n",
-                   sock_ntop(&pe->ip, pe->port));
+            p2plog(DEBUG, "ENTRY: %s, discarded\n", sock_ntop(&ip, port));
         }
     }
 
     return 0;
 }
 
-int
-send_query_message(char *search_key)
+/* When a hit last came straight to this node */
+static time_t direct_seen;
+
+/**
+ * Flags of a QUERY or WALK sent by this node. Hits only go straight to it
+ * while it is known that datagrams from other nodes reach it, a node behind
+ * NAT or a firewall may not get them.
+ */
+static uint8_t
+query_hit_flags()
+{
+    if (g_udp_fd < 0)
+        return 0;
+    return time(NULL) - direct_seen <= DIRECT_SECONDS ? 
+           QUERY_F_DIRECT : QUERY_F_PROBE;
+}
+
+uint32_t
+send_query_message(const char *search_key)
 {
     int slen;
     slen = strlen(search_key);
 
     if(slen > KEY_MAX) {
         p2plog(ERROR, "Search key too long\n");
-        return -1;
+        return 0;
     }
 
     struct P2P_h *ph_out;
     char buf[M_LEN];
+    int fds[ROUTE_NB];
 
     ph_out = (struct P2P_h *) buf;
     init_p2ph(ph_out, MSG_QUERY);
+    ph_out->ttl = query_ttl();
+    ph_out->reserved = query_hit_flags();
     memcpy(buf + HLEN, search_key, slen);
     buf[HLEN + slen] = '\0';
     ph_out->length = htons(slen + 1);
 
-    /* Set message id for query-initiator */
-    uint32_t msg_id = gen_msgid("query-initiator");
-    if (msg_id == 0) {
-        p2plog(ERROR, "Query Message ID failed\n");
-        return -1;
-    }
-    ph_out->msg_id = msg_id;
+    /* Relays learn routes only from hits that pass them, and flood a QUERY
+     * whose hits go straight. Only a key with a route to follow is worth
+     * direct hits, the others come back along the path to find one. */
+    if ((ph_out->reserved & QUERY_F_DIRECT) &&
+        route_lookup(query_key_hash(ph_out, HLEN + slen + 1), 0, fds, 
+                     ROUTE_NB) == 0)
+        ph_out->reserved = (ph_out->reserved & ~QUERY_F_DIRECT) | 
+                           QUERY_F_PROBE;
+
+    /* Set message id for query-initiator, it is the same to all neighbours */
+    ph_out->msg_id = gen_msgid(sock_addr32(&g_lstn_addr.sin6_addr), 
+                               g_lstn_addr.sin6_port);
 
     int msglen = HLEN + slen + 1;
-    g_msg_list_add(msg_new(ph_out, msglen, 0));
+    struct message *msg_saved = msg_new(ph_out, msglen, 0);
+    g_msg_list_add(msg_saved);
 
-    struct nb_node *nb;
-    list_for_each_entry(nb, &g_nb_list.list, list) {
-        send_p2p_message(nb->connfd, ph_out, msglen);
-    }
+    if (route_query(msg_saved, ph_out, msglen) != 0)
+        flood_msg(0, ph_out, msglen, msg_saved);
+    route_to_leaves(0, ph_out, msglen);
 
-    return 0;
+    /* Keep the original sender as sent, a CANCEL must carry the same */
+    memcpy(msg_saved->content, ph_out, HLEN);
+
+    return ph_out->msg_id;
 }
 
 int
 handle_query_message(int connfd, void *msg, unsigned int len)
 {
     struct P2P_h *ph_in;
+    struct message *msg_saved;
     ph_in = (struct P2P_h *) msg;
 
-    if (g_msg_list_find_by_id(ph_in->msg_id) != NULL) {
+    if (g_msg_list_find(ph_in->msg_id, MSG_QUERY) != NULL) {
         p2plog(DEBUG, "Discard duplicated msg\n");
         return -1;
     }
 
     g_msg_list_gc();
-    g_msg_list_add(msg_new(ph_in, len, connfd));
+    msg_saved = msg_new(ph_in, len, connfd);
+    g_msg_list_add(msg_saved);
 
     /* match local keys */
     uint32_t kval;
@@ -619,24 +1077,78 @@ handle_query_message(int connfd, void *msg, unsigned int len)
         send_query_hit(connfd, ph_in, kval);
     }
 
-    /* still forward msg to find more result */
+    if (g_node_mode == MODE_LEAF) {
+        /* Leaves answer for their own keys only and never relay */
+        return 0;
+    }
+
+    /* still forward msg to find more result, along learnt routes unless the
+     * hits go straight to the initiator and would not be seen here */
     ph_in->ttl --;
-    flood_msg(connfd, ph_in, len);
+    if ((ph_in->reserved & QUERY_F_DIRECT) || 
+        route_query(msg_saved, ph_in, len) != 0)
+        flood_msg(connfd, ph_in, len, msg_saved);
+    route_to_leaves(connfd, ph_in, len);
     p2plog(DEBUG, "flood query message\n");
 
     return 0;
 }
 
+/**
+ * Send a QUERY_HIT straight to the initiator of the QUERY, rather than back
+ * along the path of the QUERY. Return -1 if it has to go along the path.
+ * Should the datagram fail, it goes along the path after all, see
+ * handle_datagram_error(). An empty hit only probes the way.
+ */
+static int
+send_direct_hit(int connfd, struct P2P_h *ph_query, struct P2P_h *ph_hit, 
+                unsigned int len)
+{
+    struct peer_cache *pc;
+    struct in6_addr ip;
+
+    /* The address of an IPv6 initiator is only a digest */
+    if (g_udp_fd < 0 || (ph_query->reserved & H_F_ORG_IPV6))
+        return -1;
+
+    /* Sign it as it would be on the connection the QUERY came from */
+    if ((pc = g_pc_list_find_by_connfd(connfd)) == NULL || 
+        pc->hdr.org_ip == INADDR_ANY)
+        return -1;
+    ph_hit->org_ip = pc->hdr.org_ip;
+    ph_hit->org_port = pc->hdr.org_port;
+    ph_hit->reserved |= pc->hdr.reserved | QHIT_F_DIRECT;
+    ph_hit->length = htons(len - HLEN);
+
+    sock_map_v4(&ip, ph_query->org_ip);
+    if (udp_send(&ip, ph_query->org_port, ph_hit, len, connfd) != 0) {
+        ph_hit->org_ip = 0;
+        ph_hit->reserved &= ~(QHIT_F_DIRECT | H_F_ORG_IPV6);
+        return -1;
+    }
+
+    p2plog(DEBUG, "QUERY_HIT for %08X straight to %s\n", ph_hit->msg_id,
+           sock_ntop(&ip, ph_query->org_port));
+    return 0;
+}
+
 int
 send_query_hit(int connfd, void *msg, uint32_t val)
 {
     struct P2P_h *ph_in, *ph_out;
+    struct nb_node *nb;
     char buf[S_LEN];
     
     ph_in = (struct P2P_h *) msg;
     ph_out = (struct P2P_h *) buf;
     init_p2ph(ph_out, MSG_QHIT);
     ph_out->msg_id = ph_in->msg_id;
+    /* The hit retraces as many hops as the QUERY may have taken, nodes that
+     * do not gossip were sent no more than DEF_TTL */
+    nb = g_nb_list_find_by_connfd(connfd);
+    ph_out->ttl = nb != NULL && !nb->gossip ? DEF_TTL : MAX_TTL;
+    if (g_udp_fd >= 0)
+        ph_out->reserved = QHIT_F_SUB;
 
     /* We don't support fussy matching currently. Therefore, only one entry 
      * for each query. */
@@ -652,13 +1164,23 @@ send_query_hit(int connfd, void *msg, uint32_t val)
     qe->res_id = htons(1);
     qe->res_val = htonl(val);
 
+    if ((ph_in->reserved & QUERY_F_DIRECT) &&
+        send_direct_hit(connfd, ph_in, ph_out, 
+                        HLEN + QHIT_MINLEN + QHIT_ENTRYLEN) == 0)
+        return 0;
     send_p2p_message(connfd, ph_out, HLEN + QHIT_MINLEN + QHIT_ENTRYLEN);
 
+    /* Let the initiator find out whether hits could come straight */
+    if (ph_in->reserved & QUERY_F_PROBE) {
+        qf->entry_size = 0;
+        send_direct_hit(connfd, ph_in, ph_out, HLEN + QHIT_MINLEN);
+    }
+
     return 0;
 }
 
 int
-handle_query_hit(void *msg, unsigned int len)
+handle_query_hit(int connfd, void *msg, unsigned int len)
 {
     struct P2P_h *ph_in;
     struct P2P_qhit_front *qf;
@@ -680,16 +1202,58 @@ handle_query_hit(void *msg, unsigned int len)
     }
 
     struct message *msg_saved;
-    if ((msg_saved = g_msg_list_find_by_id(ph_in->msg_id)) != NULL) {
+    if ((msg_saved = g_msg_list_find(ph_in->msg_id, MSG_QUERY)) != NULL) {
+        struct nb_node *nb_from = NULL;
+        struct in6_addr org_ip;
+
+        if (ph_in->reserved & QHIT_F_DIRECT) {
+            /* Only the initiator takes hits from any node */
+            if (msg_saved->fromfd != 0) {
+                p2plog(ERROR, "Direct QUERY_HIT of query %08X not sent "
+                       "here\n", ph_in->msg_id);
+                return -1;
+            }
+            direct_seen = time(NULL);
+            /* A probe, the hit itself comes along the path */
+            if (nEntry == 0)
+                return 0;
+        }
+        if (msg_saved->cancelled) {
+            p2plog(DEBUG, "Drop QUERY_HIT of cancelled query %08X\n",
+                   ph_in->msg_id);
+            return 0;
+        }
+
+        /* The key can be found through the neighbour the hit came from. A
+         * direct hit passed no neighbour, unless the holder is one. */
+        msg_saved->routed = 0;
+        if (connfd != 0) {
+            nb_from = g_nb_list_find_by_connfd(connfd);
+        } else if (!(ph_in->reserved & H_F_ORG_IPV6)) {
+            sock_map_v4(&org_ip, ph_in->org_ip);
+            nb_from = g_nb_list_find_by_peer(&org_ip, ph_in->org_port);
+        }
+        if (nb_from != NULL && !nb_from->leaf)
+            route_learn(query_key_hash(msg_saved->content, msg_saved->len),
+                        &nb_from->ip, nb_from->lport);
+
         if (msg_saved->fromfd == 0) {
             /* This QHIT has reached the QUERY initiator. */
-            char buf[S_LEN];
-            memcpy(buf, (char *)msg_saved->content + HLEN, 
-                   msg_saved->len - HLEN);
+            char buf[KEY_MAX + 1];
+            int klen = msg_saved->len - HLEN;
+            if (klen > KEY_MAX)
+                klen = KEY_MAX;
+            memcpy(buf, (char *)msg_saved->content + HLEN, klen);
             /* Make sure search key is NULL-terminated */
-            buf[msg_saved->len - HLEN] = '\0';
-            p2plog(INFO, "Query: \"%s\" hit at %s\n", buf, 
-                   sock_ntop((struct in_addr*)&ph_in->org_ip, ph_in->org_port));
+            buf[klen] = '\0';
+            if (ph_in->reserved & H_F_ORG_IPV6) {
+                p2plog(INFO, "Query: \"%s\" hit at IPv6 node %08X port %d\n",
+                       buf, ntohl(ph_in->org_ip), ntohs(ph_in->org_port));
+            } else {
+                sock_map_v4(&org_ip, ph_in->org_ip);
+                p2plog(INFO, "Query: \"%s\" hit at %s\n", buf, 
+                       sock_ntop(&org_ip, ph_in->org_port));
+            }
 
             int i;
             for (i = 0; i < nEntry; i++) {
@@ -698,11 +1262,27 @@ handle_query_hit(void *msg, unsigned int len)
                 p2plog(INFO, "Resource: 0x%08x = 0x%08X\n", 
                        ntohs(qe->res_id), ntohl(qe->res_val));
             }
-        } else {
+
+            if (g_query_hit_cb != NULL) {
+                struct query_hit hit;
+                hit.msg_id = ph_in->msg_id;
+                hit.key = buf;
+                hit.ph = ph_in;
+                hit.count = nEntry;
+                hit.entries = (struct P2P_qhit_entry *)
+                              ((char *)msg + HLEN + QHIT_MINLEN);
+                g_query_hit_cb(&hit);
+            }
+        } else {
             /* This QHIT is for a previously forwarded QUERY. */
             struct nb_node *nb;
             if((nb = g_nb_list_find_by_connfd(msg_saved->fromfd)) != NULL){
-                ph_in->ttl --;
+                /* The path of a walk is longer than any TTL, but has no 
+                 * loops */
+                if (!msg_saved->walk)
+                    ph_in->ttl --;
+                if (!nb->gossip && ph_in->ttl > DEF_TTL)
+                    ph_in->ttl = DEF_TTL;
                 /* Relay it back. */
                 forward_p2p_message(nb->connfd, msg, len);
             } else {
@@ -718,6 +1298,615 @@ handle_query_hit(void *msg, unsigned int len)
     return 0;
 }
 
+/**
+ * Flood a QUERY to the neighbours it was not sent to, as the learnt routes
+ * it took did not lead to a hit in time. The routes of its key are dropped.
+ */
+void
+widen_query_message(uint32_t msg_id)
+{
+    struct message *query;
+    struct nb_node *nb;
+    struct P2P_h *ph;
+    char buf[M_LEN];
+
+    if ((query = g_msg_list_find(msg_id, MSG_QUERY)) == NULL || 
+        !query->routed || query->cancelled)
+        return;
+    query->routed = 0;
+
+    route_forget(query_key_hash(query->content, query->len));
+    p2plog(DEBUG, "Query %08X got no hit along learnt routes, flood it\n",
+           msg_id);
+
+    /* A relay keeps the QUERY as it came */
+    memcpy(buf, query->content, query->len);
+    ph = (struct P2P_h *) buf;
+    if (query->fromfd != 0)
+        ph->ttl --;
+
+    /* Not again to the neighbours it went to along the routes */
+    list_for_each_entry(nb, &g_nb_list.list, list) {
+        if (nb->connfd == query->fromfd || nb->leaf ||
+            msg_was_sent_to(query, nb->connfd))
+            continue;
+        relay_msg(nb, buf, query->len, query);
+    }
+}
+
+/**
+ * Flood a CANCEL behind a QUERY sent by this node, once it has the hits it
+ * needs. Relays stop forwarding the QUERY and relaying its hits.
+ */
+int
+send_cancel_message(uint32_t query_id)
+{
+    struct message *msg_saved;
+    struct P2P_h *ph_out;
+    struct P2P_cancel *cancel;
+    char buf[HLEN + CANCELLEN];
+
+    if ((msg_saved = g_msg_list_find(query_id, MSG_QUERY)) == NULL ||
+        msg_saved->fromfd != 0 || msg_saved->cancelled) {
+        return -1;
+    }
+    msg_saved->cancelled = 1;
+
+    /* Walkers learn it when they check back, there is no flood to prune */
+    if (msg_saved->walk)
+        return 0;
+
+    /* Relays only take it from the original sender of the QUERY */
+    ph_out = (struct P2P_h *) buf;
+    init_p2ph(ph_out, MSG_CANCEL);
+    ph_out->org_ip = ((struct P2P_h *)msg_saved->content)->org_ip;
+    ph_out->org_port = ((struct P2P_h *)msg_saved->content)->org_port;
+    ph_out->reserved = ((struct P2P_h *)msg_saved->content)->reserved;
+    ph_out->ttl = ((struct P2P_h *)msg_saved->content)->ttl;
+    ph_out->msg_id = gen_msgid(sock_addr32(&g_lstn_addr.sin6_addr), 
+                               g_lstn_addr.sin6_port);
+    ph_out->length = htons(CANCELLEN);
+    cancel = (struct P2P_cancel *) (buf + HLEN);
+    cancel->msg_id = query_id;
+
+    g_msg_list_add(msg_new(ph_out, HLEN + CANCELLEN, 0));
+    cancel_msg(msg_saved, ph_out, HLEN + CANCELLEN);
+
+    return 0;
+}
+
+/**
+ * Drop the QUERY of a CANCEL still queued for processing, and forward the
+ * CANCEL along the paths the QUERY went.
+ *
+ * If the CANCEL overtook the QUERY, a tombstone QUERY with no key under its
+ * id makes it a duplicate when it comes.
+ */
+int
+handle_cancel_message(int connfd, void *msg, unsigned int len)
+{
+    struct P2P_h *ph_in, *ph_saved;
+    struct P2P_cancel *cancel;
+    struct message *msg_saved, *qmsg, *qmsg_tmp;
+    struct nb_node *nb;
+    uint32_t query_id;
+
+    ph_in = (struct P2P_h *) msg;
+    if (len != HLEN + CANCELLEN) {
+        p2plog(ERROR, "Invalid CANCEL length %d\n", len);
+        return -1;
+    }
+
+    if (g_msg_list_find(ph_in->msg_id, MSG_CANCEL) != NULL) {
+        p2plog(DEBUG, "Discard duplicated msg\n");
+        return -1;
+    }
+
+    g_msg_list_gc();
+    g_msg_list_add(msg_new(ph_in, len, connfd));
+
+    cancel = (struct P2P_cancel *) ((char *)msg + HLEN);
+    query_id = cancel->msg_id;
+
+    if ((msg_saved = g_msg_list_find(query_id, MSG_QUERY)) != NULL) {
+        ph_saved = (struct P2P_h *) msg_saved->content;
+        if (ph_saved->org_ip != ph_in->org_ip || 
+            ph_saved->org_port != ph_in->org_port) {
+            p2plog(WARN, "CANCEL of %08X not from its sender\n", query_id);
+            return -1;
+        }
+        if (msg_saved->fromfd == 0 || msg_saved->cancelled)
+            return 0;
+        msg_saved->cancelled = 1;
+    } else {
+        msg_saved = msg_new(ph_in, HLEN, connfd);
+        ((struct P2P_h *)msg_saved->content)->msg_type = MSG_QUERY;
+        ((struct P2P_h *)msg_saved->content)->msg_id = query_id;
+        msg_saved->cancelled = 1;
+        g_msg_list_add(msg_saved);
+    }
+
+    list_for_each_entry(nb, &g_nb_list.list, list) {
+        list_for_each_entry_safe(qmsg, qmsg_tmp, &nb->qq.list, list) {
+            if (((struct P2P_h *)qmsg->content)->msg_id == query_id) {
+                list_del(&qmsg->list);
+                msg_free(qmsg);
+                nb->qq_len--;
+            }
+        }
+    }
+
+    p2plog(DEBUG, "Cancel query %08X\n", query_id);
+    ph_in->ttl --;
+    cancel_msg(msg_saved, ph_in, len);
+
+    return 0;
+}
+
+/**
+ * Random walks. A walk query is searched by walkers, each a WALK message
+ * that visits one neighbour per hop instead of being flooded. Every node
+ * keeps the query as a QUERY under its own ID in the message table, which
+ * routes the hits back, and the walker under the walker ID, which routes
+ * its check-backs to the initiator and their answers back to it.
+ */
+
+/* Walkers waiting at this node for the answer to their check-back */
+struct parked_walk {
+    uint32_t            walker_id;
+    time_t              deadline;
+    struct list_head    list;
+};
+
+static LIST_HEAD(parked_list);          /* Ordered by deadline */
+static int parked_size;
+
+/* At the initiator a walk query goes on while it is pending */
+static int
+walk_live(const struct message *query)
+{
+    return !query->cancelled && (query->fromfd != 0 || query->pinned);
+}
+
+/**
+ * Pick the neighbour a walker goes to next, at random among the ones least
+ * likely to have been visited: not the one it came from, nor the one where
+ * a walker of the query went last, nor the one the query first came from.
+ * Returns 0 if there is no neighbour.
+ */
+static int
+walk_next_hop(int fromfd, const struct message *query)
+{
+    struct nb_node *nb;
+    int next = 0, best = -1, n = 0, score;
+
+    list_for_each_entry(nb, &g_nb_list.list, list) {
+        if (nb->leaf)
+            continue;
+        score = (nb->connfd == fromfd) * 4 + 
+                (nb->connfd == query->nextfd) * 2 +
+                (nb->connfd == query->fromfd);
+        if (best < 0 || score < best) {
+            best = score;
+            next = nb->connfd;
+            n = 1;
+        } else if (score == best && rand() % ++n == 0) {
+            next = nb->connfd;
+        }
+    }
+
+    return next;
+}
+
+static void
+walk_forward(int fromfd, struct message *walker, struct message *query)
+{
+    int next;
+
+    if ((next = walk_next_hop(fromfd, query)) == 0) {
+        p2plog(DEBUG, "Walker %08X has no neighbour to go to\n",
+               ((struct P2P_h *)walker->content)->msg_id);
+        return;
+    }
+    walker->nextfd = query->nextfd = next;
+    send_p2p_message(next, walker->content, walker->len);
+}
+
+static void
+send_walk_check(int connfd, uint32_t walker_id, uint32_t query_id, 
+                uint8_t flags)
+{
+    struct P2P_h *ph_out;
+    struct P2P_walk_check *check;
+    char buf[HLEN + WALK_CHECKLEN];
+
+    ph_out = (struct P2P_h *) buf;
+    init_p2ph(ph_out, MSG_WALK_CHECK);
+    ph_out->ttl = 1;
+    ph_out->reserved = flags;
+    ph_out->msg_id = walker_id;
+    ph_out->length = htons(WALK_CHECKLEN);
+    check = (struct P2P_walk_check *) (buf + HLEN);
+    check->query_id = query_id;
+
+    send_p2p_message(connfd, buf, HLEN + WALK_CHECKLEN);
+}
+
+/**
+ * Hold a walker until the initiator answers whether its query goes on.
+ * Returns -1 if too many are held, the walker then goes on unchecked.
+ */
+static int
+walk_park(struct message *walker, uint32_t query_id)
+{
+    struct parked_walk *pw;
+
+    if (parked_size >= WALK_PARKED_MAX)
+        return -1;
+
+    if ((pw = malloc(sizeof(struct parked_walk))) == NULL) {
+        perror("malloc error");
+        exit(1);
+    }
+    pw->walker_id = ((struct P2P_h *)walker->content)->msg_id;
+    pw->deadline = time(NULL) + WALK_CHECK_SECONDS;
+    list_add_tail(&pw->list, &parked_list);
+    parked_size++;
+    walker->pinned = 1;
+
+    send_walk_check(walker->fromfd, pw->walker_id, query_id, 0);
+    return 0;
+}
+
+/* Release a held walker, -1 if it is not held here */
+static int
+walk_unpark(struct message *walker)
+{
+    struct parked_walk *pw;
+    uint32_t walker_id = ((struct P2P_h *)walker->content)->msg_id;
+
+    list_for_each_entry(pw, &parked_list, list) {
+        if (pw->walker_id == walker_id) {
+            list_del(&pw->list);
+            free(pw);
+            parked_size--;
+            walker->pinned = 0;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+uint32_t
+send_walk_message(const char *search_key, int walkers)
+{
+    struct P2P_h *ph_out, *ph_q;
+    struct P2P_walk *walk;
+    struct message *query, *walker;
+    char buf[M_LEN], qbuf[M_LEN];
+    int slen, i;
+
+    slen = strlen(search_key);
+    if (slen > KEY_MAX) {
+        p2plog(ERROR, "Search key too long\n");
+        return 0;
+    }
+
+    /* The query is kept as a QUERY, the hits are matched to it */
+    ph_q = (struct P2P_h *) qbuf;
+    init_p2ph(ph_q, MSG_QUERY);
+    memcpy(qbuf + HLEN, search_key, slen + 1);
+    ph_q->length = htons(slen + 1);
+    ph_q->msg_id = gen_msgid(sock_addr32(&g_lstn_addr.sin6_addr), 
+                             g_lstn_addr.sin6_port);
+    query = msg_new(ph_q, HLEN + slen + 1, 0);
+    query->walk = 1;
+    g_msg_list_add(query);
+
+    ph_out = (struct P2P_h *) buf;
+    init_p2ph(ph_out, MSG_WALK);
+    ph_out->ttl = 1;
+    ph_out->reserved = query_hit_flags();
+    ph_out->length = htons(WALK_MINLEN + slen + 1);
+    walk = (struct P2P_walk *) (buf + HLEN);
+    memset(walk, 0, WALK_MINLEN);
+    walk->query_id = ph_q->msg_id;
+    walk->max_hops = WALK_HOPS;
+    memcpy(buf + HLEN + WALK_MINLEN, search_key, slen + 1);
+
+    for (i = 0; i < walkers; i++) {
+        ph_out->msg_id = gen_msgid(sock_addr32(&g_lstn_addr.sin6_addr), 
+                                   g_lstn_addr.sin6_port);
+        walker = msg_new(buf, HLEN + WALK_MINLEN + slen + 1, 0);
+        g_msg_list_add(walker);
+        walk_forward(0, walker, query);
+
+        /* Keep the original sender as sent, hits carry the same */
+        ph_out = (struct P2P_h *) walker->content;
+        if (ph_out->org_ip != 0) {
+            ((struct P2P_h *)query->content)->org_ip = ph_out->org_ip;
+            ((struct P2P_h *)query->content)->org_port = ph_out->org_port;
+            ((struct P2P_h *)query->content)->reserved = ph_out->reserved;
+        }
+        memcpy(buf, ph_out, HLEN);
+        ph_out = (struct P2P_h *) buf;
+    }
+    route_to_leaves(0, query->content, query->len);
+
+    return walk->query_id;
+}
+
+int
+handle_walk_message(int connfd, void *msg, unsigned int len)
+{
+    struct P2P_h *ph_in, *ph_q;
+    struct P2P_walk *walk;
+    struct message *query, *walker;
+    char buf[M_LEN];
+    unsigned int keylen;
+    uint32_t kval;
+
+    ph_in = (struct P2P_h *) msg;
+    walk = (struct P2P_walk *) ((char *)msg + HLEN);
+    if (len < HLEN + WALK_MINLEN + 2 || 
+        len > HLEN + WALK_MINLEN + KEY_MAX + 1 ||
+        ((char *)msg)[len - 1] != '\0') {
+        p2plog(ERROR, "Invalid WALK length %d\n", len);
+        return -1;
+    }
+
+    g_msg_list_gc();
+
+    /* The first walker of the query here searches the local keys */
+    if ((query = g_msg_list_find(walk->query_id, MSG_QUERY)) == NULL) {
+        keylen = len - HLEN - WALK_MINLEN;
+        ph_q = (struct P2P_h *) buf;
+        memcpy(buf, ph_in, HLEN);
+        memcpy(buf + HLEN, (char *)msg + HLEN + WALK_MINLEN, keylen);
+        ph_q->msg_type = MSG_QUERY;
+        ph_q->msg_id = walk->query_id;
+        ph_q->length = htons(keylen);
+        query = msg_new(ph_q, HLEN + keylen, connfd);
+        query->walk = 1;
+        g_msg_list_add(query);
+
+        if ((kval = g_kv_list_search(query->content, query->len)) != 0)
+            send_query_hit(connfd, query->content, kval);
+        if (g_node_mode != MODE_LEAF)
+            route_to_leaves(connfd, query->content, query->len);
+    } else if (!walk_live(query)) {
+        p2plog(DEBUG, "Walker %08X of query %08X is over\n", 
+               ph_in->msg_id, walk->query_id);
+        return 0;
+    }
+
+    if ((walker = g_msg_list_find(ph_in->msg_id, MSG_WALK)) == NULL) {
+        walker = msg_new(msg, len, connfd);
+        g_msg_list_add(walker);
+    } else if (walker->len == (int)len && !walker->pinned) {
+        /* Visited again, it goes on from here */
+        memcpy(walker->content, msg, len);
+    } else {
+        return -1;
+    }
+
+    if (g_node_mode == MODE_LEAF) {
+        /* Leaves are never sent walkers, and never relay */
+        return 0;
+    }
+
+    walk = (struct P2P_walk *) ((char *)walker->content + HLEN);
+    if (++walk->hops >= walk->max_hops) {
+        p2plog(DEBUG, "Walker %08X is done after %d hops\n", 
+               ph_in->msg_id, walk->hops);
+        return 0;
+    }
+
+    /* Checks back at 4, 8, 16... hops, which costs about as many messages
+     * as the walk itself */
+    if (walker->fromfd != 0 && walk->hops >= WALK_CHECK_HOPS &&
+        (walk->hops & (walk->hops - 1)) == 0 &&
+        walk_park(walker, walk->query_id) == 0) {
+        return 0;
+    }
+
+    walk_forward(connfd, walker, query);
+    return 0;
+}
+
+/**
+ * A check-back goes to the initiator by the path of the walker, unless a
+ * node on the way knows the query is over. The answer goes back the same
+ * way, telling the nodes on it if the query is over.
+ */
+int
+handle_walk_check(int connfd, void *msg, unsigned int len)
+{
+    struct P2P_h *ph_in;
+    struct P2P_walk_check *check;
+    struct message *query, *walker;
+    uint8_t flags;
+
+    ph_in = (struct P2P_h *) msg;
+    if (len != HLEN + WALK_CHECKLEN) {
+        p2plog(ERROR, "Invalid WALK_CHECK length %d\n", len);
+        return -1;
+    }
+    check = (struct P2P_walk_check *) ((char *)msg + HLEN);
+    flags = ph_in->reserved & (WALK_F_GO | WALK_F_STOP);
+
+    if ((walker = g_msg_list_find(ph_in->msg_id, MSG_WALK)) == NULL) {
+        p2plog(DEBUG, "No walker %08X\n", ph_in->msg_id);
+        return -1;
+    }
+    query = g_msg_list_find(check->query_id, MSG_QUERY);
+
+    if (flags == 0) {
+        walker->nextfd = connfd;
+        if (query == NULL || !walk_live(query)) {
+            send_walk_check(connfd, ph_in->msg_id, check->query_id, 
+                            WALK_F_STOP);
+        } else if (walker->fromfd == 0) {
+            send_walk_check(connfd, ph_in->msg_id, check->query_id, 
+                            WALK_F_GO);
+        } else {
+            send_p2p_message(walker->fromfd, msg, len);
+        }
+        return 0;
+    }
+
+    if ((flags & WALK_F_STOP) && query != NULL)
+        query->cancelled = 1;
+
+    if (walk_unpark(walker) == 0) {
+        if ((flags & WALK_F_GO) && query != NULL && walk_live(query))
+            walk_forward(walker->fromfd, walker, query);
+        else
+            p2plog(DEBUG, "Walker %08X stops\n", ph_in->msg_id);
+    } else if (walker->nextfd != 0) {
+        send_p2p_message(walker->nextfd, msg, len);
+    }
+
+    return 0;
+}
+
+void
+walk_expire()
+{
+    struct parked_walk *pw, *pw_tmp;
+    struct message *walker;
+    time_t now = time(NULL);
+
+    list_for_each_entry_safe(pw, pw_tmp, &parked_list, list) {
+        if (pw->deadline > now)
+            break;
+        /* The path back is broken, hits could not come back either */
+        p2plog(DEBUG, "Walker %08X got no answer, stops\n", pw->walker_id);
+        if ((walker = g_msg_list_find(pw->walker_id, MSG_WALK)) != NULL)
+            walker->pinned = 0;
+        list_del(&pw->list);
+        free(pw);
+        parked_size--;
+    }
+}
+
+void
+walk_clear()
+{
+    struct parked_walk *pw, *pw_tmp;
+
+    list_for_each_entry_safe(pw, pw_tmp, &parked_list, list) {
+        list_del(&pw->list);
+        free(pw);
+    }
+    parked_size = 0;
+}
+
+/* Send a SUBSCRIBE or UPDATE straight to a node, over the side channel */
+static int
+send_sub_message(uint8_t type, const struct in6_addr *ip, uint16_t port,
+                 const char *key, uint32_t value, int lease, uint32_t nonce)
+{
+    struct P2P_h *ph_out;
+    struct P2P_sub *sb;
+    char buf[HLEN + SUB_MINLEN + KEY_MAX];
+    int klen;
+
+    if ((klen = strlen(key)) >= KEY_MAX)
+        return -1;
+
+    ph_out = (struct P2P_h *) buf;
+    init_p2ph(ph_out, type);
+    ph_out->ttl = 1;
+    ph_out->org_ip = sock_addr32(&g_lstn_addr.sin6_addr);
+    ph_out->org_port = g_lstn_addr.sin6_port;
+    if (!sock_is_v4(&g_lstn_addr.sin6_addr))
+        ph_out->reserved = H_F_ORG_IPV6;
+    ph_out->msg_id = gen_msgid(ph_out->org_ip, ph_out->org_port);
+    ph_out->length = htons(SUB_MINLEN + klen + 1);
+
+    sb = (struct P2P_sub *) (buf + HLEN);
+    memset(sb, 0, SUB_MINLEN);
+    sb->lease = htons(lease);
+    sb->value = htonl(value);
+    sb->nonce = nonce;
+    memcpy(buf + HLEN + SUB_MINLEN, key, klen + 1);
+
+    return udp_send(ip, port, buf, HLEN + SUB_MINLEN + klen + 1, 0);
+}
+
+/* Check a SUBSCRIBE or UPDATE, return its key, NULL if it is invalid */
+static const char *
+sub_message_key(void *msg, unsigned int len)
+{
+    if (len < HLEN + SUB_MINLEN + 2 || len > HLEN + SUB_MINLEN + KEY_MAX ||
+        ((char *)msg)[len - 1] != '\0') {
+        p2plog(ERROR, "Invalid %s length %d\n", 
+               ((struct P2P_h *)msg)->msg_type == MSG_UPDATE ? 
+               "UPDATE" : "SUBSCRIBE", len);
+        return NULL;
+    }
+    return (char *)msg + HLEN + SUB_MINLEN;
+}
+
+int
+send_subscribe_message(const struct in6_addr *ip, uint16_t port,
+                       const char *key, int lease, uint32_t nonce)
+{
+    return send_sub_message(MSG_SUBSCRIBE, ip, port, key, 0, lease, nonce);
+}
+
+/**
+ * A node asks to be told when the value of a key changes. It is answered
+ * with the value and the lease granted, so a renewal is also a refresh.
+ * A SUBSCRIBE that does not come from the node whose QUERY was hit is not
+ * answered, so a forged one cannot turn UPDATEs on a third node.
+ */
+int
+handle_subscribe_message(const struct in6_addr *ip, uint16_t port,
+                         void *msg, unsigned int len)
+{
+    struct P2P_sub *sb;
+    struct key_value *kv;
+    const char *key;
+    int lease;
+
+    if ((key = sub_message_key(msg, len)) == NULL)
+        return -1;
+    sb = (struct P2P_sub *) ((char *)msg + HLEN);
+
+    lease = sub_add(ip, port, key, ntohs(sb->lease), sb->nonce);
+    if (lease < 0 || ntohs(sb->lease) == 0)
+        return 0;
+
+    kv = g_kv_list_find(key);
+    return send_update_message(ip, port, key, kv != NULL ? kv->value : 0, 
+                               lease, sb->nonce);
+}
+
+int
+send_update_message(const struct in6_addr *ip, uint16_t port,
+                    const char *key, uint32_t value, int lease, uint32_t nonce)
+{
+    return send_sub_message(MSG_UPDATE, ip, port, key, value, lease, nonce);
+}
+
+int
+handle_update_message(const struct in6_addr *ip, uint16_t port,
+                      void *msg, unsigned int len)
+{
+    struct P2P_sub *sb;
+    const char *key;
+
+    if ((key = sub_message_key(msg, len)) == NULL)
+        return -1;
+    sb = (struct P2P_sub *) ((char *)msg + HLEN);
+
+    sub_update(ip, port, key, ntohl(sb->value), ntohs(sb->lease), sb->nonce);
+    return 0;
+}
+
 int
 handle_bye_message(int connfd)
 {
@@ -736,3 +1925,121 @@ handle_bye_message(int connfd)
 
     return 0;
 }
+
+/**
+ * Upload the key index of a leaf to a super-peer.
+ *
+ * Only the hashes of the keys are sent. The super-peer uses them to decide
+ * which leaves a QUERY is passed to, and the leaf answers it as usual.
+ */
+int
+send_index_message(int connfd)
+{
+    char buf[HLEN + INDEX_MINLEN + INDEX_MAX * INDEX_ENTRYLEN];
+    struct P2P_h *ph_out;
+    struct P2P_index_front *xf;
+    uint32_t *xe;
+
+    ph_out = (struct P2P_h *) buf;
+    init_p2ph(ph_out, MSG_INDEX);
+    ph_out->ttl = 1;
+
+    xe = (uint32_t *) (buf + HLEN + INDEX_MINLEN);
+
+    struct key_value *kv;
+    int count = 0;
+    list_for_each_entry(kv, &g_kv_list.list, list) {
+        if (count >= INDEX_MAX) {
+            p2plog(WARN, "Too many keys, only %d are indexed\n", INDEX_MAX);
+            break;
+        }
+        xe[count++] = htonl(key_hash(kv->key));
+    }
+
+    xf = (struct P2P_index_front *) (buf + HLEN);
+    xf->entry_size = htons(count);
+    xf->sbz = 0;
+
+    return send_p2p_message(connfd, ph_out, 
+                            HLEN + INDEX_MINLEN + count * INDEX_ENTRYLEN);
+}
+
+int
+handle_index_message(int connfd, void *msg, unsigned int len)
+{
+    struct nb_node *nb;
+    struct P2P_index_front *xf;
+    uint32_t *xe;
+    uint32_t hashes[INDEX_MAX];
+
+    if ((nb = g_nb_list_find_by_connfd(connfd)) == NULL) {
+        p2plog(ERROR, "INDEX cannot match a neighbor fd\n");
+        return -1;
+    }
+
+    if (g_node_mode == MODE_LEAF) {
+        p2plog(WARN, "INDEX ignored by a leaf node\n");
+        return -1;
+    }
+
+    if (len < HLEN + INDEX_MINLEN) {
+        p2plog(ERROR, "INDEX length (%d) less than mininum\n", len);
+        return -1;
+    }
+
+    int entry_size;
+    xf = (struct P2P_index_front *) ((char *)msg + HLEN);
+    entry_size = ntohs(xf->entry_size);
+    if (entry_size > INDEX_MAX ||
+        len != HLEN + INDEX_MINLEN + entry_size * INDEX_ENTRYLEN) {
+        p2plog(ERROR, "INDEX invalid length (%d) with entry size = %d\n",
+               len, entry_size);
+        return -1;
+    }
+
+    int i;
+    xe = (uint32_t *) ((char *)msg + HLEN + INDEX_MINLEN);
+    for (i = 0; i < entry_size; i++)
+        hashes[i] = ntohl(xe[i]);
+
+    nb_kidx_set(nb, hashes, entry_size);
+    p2plog(INFO, "Leaf %s indexed %d keys\n",
+           sock_ntop(&nb->ip, nb->lport), entry_size);
+
+    return 0;
+}
+
+/**
+ * A datagram to a neighbour could not be sent, send it over TCP instead.
+ * Unless the socket buffer was just full, stop using datagrams for the
+ * neighbour, e.g. when there is no route for them.
+ */
+void
+handle_datagram_error(int connfd, void *msg, unsigned int len, int err)
+{
+    struct nb_node *nb;
+    struct P2P_h *ph = (struct P2P_h *) msg;
+
+    if ((nb = g_nb_list_find_by_connfd(connfd)) == NULL)
+        return;
+
+    /* A hit that was sent straight to the initiator goes back along the
+     * path of the QUERY, the neighbour is not to blame. A probe is dropped,
+     * its hit went along the path already */
+    if (ph->msg_type == MSG_QHIT && (ph->reserved & QHIT_F_DIRECT)) {
+        if (len == HLEN + QHIT_MINLEN)
+            return;
+        p2plog(DEBUG, "QUERY_HIT for %08X failed (%s), send it back\n",
+               ph->msg_id, strerror(err));
+        ph->reserved &= ~QHIT_F_DIRECT;
+        send_p2p_message(connfd, msg, len);
+        return;
+    }
+
+    p2plog(WARN, "Datagram to %s failed (%s), use TCP\n",
+           sock_ntop(&nb->ip, nb->lport), strerror(err));
+    nb->udp = 0;
+    send_p2p_message(connfd, msg, len);
+    if (err == EAGAIN || err == EWOULDBLOCK || err == ENOBUFS)
+        nb->udp = 1;
+}
@@ -12,8 +12,14 @@
 #define MSG_PONG        0x01
 #define MSG_BYE         0x02
 #define MSG_JOIN        0x03
+#define MSG_INDEX       0x04
 #define MSG_QUERY       0x80
 #define MSG_QHIT        0x81
+#define MSG_CANCEL      0x82
+#define MSG_WALK        0x84
+#define MSG_WALK_CHECK  0x85
+#define MSG_SUBSCRIBE   0x86
+#define MSG_UPDATE      0x88
 
 /* header length */
 #define HLEN            (sizeof(struct P2P_h))
@@ -27,16 +33,46 @@
 /* The length of each entry in Pong body */
 #define PONG_ENTRYLEN   (sizeof(struct P2P_pong_entry))
 
+/* The length of each IPv6 entry in Pong body */
+#define PONG_ENTRY6LEN  (sizeof(struct P2P_pong_entry6))
+
 /* The minimum length of a QUERY_HIT message body */
 #define QHIT_MINLEN     (sizeof(struct P2P_qhit_front))
 
 /* The length of each entry for a QUERY_HIT message */
 #define QHIT_ENTRYLEN   (sizeof(struct P2P_qhit_entry))
 
+/* body length of CANCEL message */
+#define CANCELLEN       (sizeof(struct P2P_cancel))
+
+/* The length of the WALK message body before the search key */
+#define WALK_MINLEN     (sizeof(struct P2P_walk))
+
+/* body length of WALK_CHECK message */
+#define WALK_CHECKLEN   (sizeof(struct P2P_walk_check))
+
+/* body length of heartbeat PING and PONG between nodes that gossip */
+#define GOSSIPLEN       (sizeof(struct P2P_gossip))
+
+/* The length of SUBSCRIBE and UPDATE message body before the key */
+#define SUB_MINLEN      (sizeof(struct P2P_sub))
+
+/* The minimum length of an INDEX message body */
+#define INDEX_MINLEN    (sizeof(struct P2P_index_front))
+
+/* The length of each entry for an INDEX message */
+#define INDEX_ENTRYLEN  (sizeof(uint32_t))
+
+/* max number of key hashes a leaf uploads in one INDEX message */
+#define INDEX_MAX       500
+
 /* Protocol version */
 #define P_VERSION       1
 /* MAX TTL */
-#define MAX_TTL         5
+#define MAX_TTL         7
+/* Default TTL, and the max sent to nodes that do not gossip as they drop
+   messages with more */
+#define DEF_TTL         5
 
 /* max number of entries for a PONG response */
 #define MAX_PEER_AD     5
@@ -45,6 +81,67 @@
 /* Reply code of JOIN accept */
 #define JOIN_ACC        0x0200
 
+/* Flag in the reserved field of PING and PONG: the sender understands
+   IPv6 entries, which follow the IPv4 ones in a PONG body, their number
+   in the sbz field of the PONG front */
+#define PING_F_IPV6     0x01
+
+/* Flag in the reserved field of heartbeat PING and PONG: the sender gossips
+   the network size, a P2P_gossip body follows once the other side is known
+   to gossip too */
+#define PING_F_GOSSIP   0x04
+
+/* Random values whose minima over all nodes estimate the network size */
+#define GOSSIP_K        16
+/* Seconds the minima are gathered before they start over, so nodes that
+   left are forgotten */
+#define GOSSIP_EPOCH_SECONDS    300
+/* Reach of a QUERY in a tree as deep as its TTL, in times of the estimated
+   network size; 2 covers about 85% of a random graph */
+#define TTL_REACH       2
+
+/* Flag in the reserved field of QUERY_HIT: the responding node takes 
+   SUBSCRIBE datagrams on its listening port, see sub.h */
+#define QHIT_F_SUB      0x01
+
+/* Flags in the reserved field of QUERY and WALK: the initiator takes
+   QUERY_HIT datagrams on its listening port from any node, hits go straight
+   to it; or it takes datagrams but has not seen one from a node other than
+   its neighbours lately, hits go back along the path and an empty one goes
+   straight to it to find out */
+#define QUERY_F_PROBE   0x01
+#define QUERY_F_DIRECT  0x02
+/* Seconds hits go straight to the initiator after its last direct hit */
+#define DIRECT_SECONDS  120
+
+/* Flag in the reserved field of QUERY_HIT: sent straight to the initiator
+   rather than back along the path of the QUERY */
+#define QHIT_F_DIRECT   0x02
+
+/* Flag in the reserved field of JOIN request and response: the sender 
+   takes datagrams on its listening port, see udp.h */
+#define JOIN_F_UDP      0x02
+
+/* Walkers sent by a walk query, and the nodes each visits at most */
+#define WALK_WALKERS    16
+#define WALK_HOPS       32
+/* First hop a walker checks back with the initiator at, the next checks
+   are at twice the hops of the previous one */
+#define WALK_CHECK_HOPS 4
+/* Seconds a walker waits for the answer to its check-back */
+#define WALK_CHECK_SECONDS  2
+/* Max walkers waiting for an answer at a node */
+#define WALK_PARKED_MAX 1024
+
+/* Flags in the reserved field of the answer to a WALK_CHECK: the walker
+   goes on, or the query is over */
+#define WALK_F_GO       0x01
+#define WALK_F_STOP     0x02
+
+/* Flag in the reserved field of any message: the original sender is an IPv6
+   node, org_ip only holds a 32-bit digest of its address */
+#define H_F_ORG_IPV6    0x80
+
 /* The Header definition of our Protocol */
 struct P2P_h {
     uint8_t     version;
@@ -79,6 +176,13 @@ struct P2P_pong_entry {
     uint16_t       sbz;
 };
 
+/* The structure of each IPv6 entry in Pong body */
+struct P2P_pong_entry6 {
+    struct in6_addr ip;
+    uint16_t        port;
+    uint16_t        sbz;
+};
+
 /* The first part of the QUERY_HIT message */
 struct P2P_qhit_front {
     uint16_t    entry_size;
@@ -92,6 +196,66 @@ struct P2P_qhit_entry {
     uint32_t    res_val;
 };
 
+/* The body of the CANCEL message, the QUERY it cancels */
+struct P2P_cancel {
+    uint32_t    msg_id;
+};
+
+/* The first part of the WALK message, followed by the search key. The
+ * message ID in the header is the one of the walker */
+struct P2P_walk {
+    uint32_t    query_id;   /* Hits are sent back with it */
+    uint8_t     hops;       /* Nodes visited */
+    uint8_t     max_hops;
+    uint16_t    sbz;
+};
+
+/* The body of the WALK_CHECK message, the message ID in the header is the
+ * one of the walker */
+struct P2P_walk_check {
+    uint32_t    query_id;
+};
+
+/* The body of heartbeat PING and PONG between nodes that gossip */
+struct P2P_gossip {
+    uint16_t    epoch;
+    uint16_t    degree;             /* Neighbours that relay queries */
+    uint32_t    min[GOSSIP_K];      /* Smallest values seen in the epoch */
+};
+
+/* The first part of the SUBSCRIBE and UPDATE messages, followed by the key.
+ * SUBSCRIBE asks for a lease, 0 to end it; UPDATE grants one, 0 if there
+ * is none, with the value of the key, 0 if it is gone. Both carry the ID of
+ * the QUERY the holder hit, which only the two sides know */
+struct P2P_sub {
+    uint16_t    lease;      /* In seconds */
+    uint16_t    sbz;
+    uint32_t    value;
+    uint32_t    nonce;
+};
+
+/* The first part of the INDEX message, followed by the key hashes (uint32_t)
+ * of a leaf node */
+struct P2P_index_front {
+    uint16_t    entry_size;
+    uint16_t    sbz;
+};
+
+/* A QUERY_HIT that has reached the node that sent the QUERY */
+struct query_hit {
+    uint32_t                        msg_id;     /* Of the QUERY */
+    const char                     *key;
+    const struct P2P_h             *ph;         /* Header, origin of the hit */
+    int                             count;
+    const struct P2P_qhit_entry    *entries;    /* In network byte order */
+};
+
+/* Called for each QUERY_HIT reaching this node, NULL if not needed */
+extern void (*g_query_hit_cb)(const struct query_hit *hit);
+
+
+/* The next message ID of a node with the seed, advances its sequence */
+uint32_t msgid_next(uint32_t seed, uint32_t *seq);
 
 int send_join_message(int connfd);
 
@@ -101,16 +265,66 @@ int send_ping_message(int connfd, int ttl);
 
 int handle_ping_message(int connfd, void *msg, unsigned int len);
 
-int handle_pong_message(void *msg, unsigned int len);
+int handle_pong_message(int connfd, void *msg, unsigned int len);
 
-int send_query_message(char *search_key);
+/* Send a QUERY to all neighbours, return its message id, 0 on failure */
+uint32_t send_query_message(const char *search_key);
+
+/* Network size estimated by gossip, 1 if nothing is known */
+int gossip_size();
+
+/* TTL of the QUERY sent by this node, enough to reach the network */
+int query_ttl();
 
 int handle_query_message(int connfd, void *msg, unsigned int len);
 
 int send_query_hit(int connfd, void *msg, uint32_t val);
 
-int handle_query_hit(void *msg, unsigned int len);
+/* connfd is the neighbour the hit came from, 0 for a direct datagram */
+int handle_query_hit(int connfd, void *msg, unsigned int len);
+
+/* Flood a QUERY sent along learnt routes that got no hit, see route.h */
+void widen_query_message(uint32_t msg_id);
+
+/* Flood a CANCEL behind a QUERY sent by this node */
+int send_cancel_message(uint32_t query_id);
+
+int handle_cancel_message(int connfd, void *msg, unsigned int len);
+
+/* Send walkers to search the key, return the message id of the query, 0 on
+   failure */
+uint32_t send_walk_message(const char *search_key, int walkers);
+
+int handle_walk_message(int connfd, void *msg, unsigned int len);
+
+int handle_walk_check(int connfd, void *msg, unsigned int len);
+
+/* Stop the walkers whose check-back got no answer in time */
+void walk_expire();
+
+/* Forget all walkers waiting for an answer */
+void walk_clear();
+
+/* Datagrams between any two nodes, for subscriptions to a key */
+int send_subscribe_message(const struct in6_addr *ip, uint16_t port,
+                           const char *key, int lease, uint32_t nonce);
+
+int handle_subscribe_message(const struct in6_addr *ip, uint16_t port,
+                             void *msg, unsigned int len);
+
+int send_update_message(const struct in6_addr *ip, uint16_t port,
+                        const char *key, uint32_t value, int lease,
+                        uint32_t nonce);
+
+int handle_update_message(const struct in6_addr *ip, uint16_t port,
+                          void *msg, unsigned int len);
 
 int handle_bye_message(int connfd);
 
+int send_index_message(int connfd);
+
+int handle_index_message(int connfd, void *msg, unsigned int len);
+
+void handle_datagram_error(int connfd, void *msg, unsigned int len, int err);
+
 #endif
@@ -0,0 +1,205 @@
+/**
+ * @brief asynchronous queries, see query.h
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "list.h"
+#include "proto.h"
+#include "util.h"
+#include "query.h"
+
+struct pending_query {
+    uint32_t                msg_id;
+    int64_t                 deadline;   /* In ms */
+    int                     flags;
+    query_cb_t              cb;
+    void                   *arg;
+    struct pending_query   *next;       /* Next in the hash chain */
+    struct list_head        list;       /* Ordered by deadline */
+};
+
+static struct pending_query    *pq_hash[QUERY_HASH_SIZE];
+static LIST_HEAD(pq_list);
+static int                      pq_size;
+
+static int64_t
+now_ms()
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static uint32_t
+pq_bucket(uint32_t msg_id)
+{
+    return (msg_id * 2654435761u) & (QUERY_HASH_SIZE - 1);
+}
+
+static struct pending_query *
+pq_find(uint32_t msg_id)
+{
+    struct pending_query *pq;
+
+    for (pq = pq_hash[pq_bucket(msg_id)]; pq != NULL; pq = pq->next) {
+        if (pq->msg_id == msg_id)
+            return pq;
+    }
+
+    return NULL;
+}
+
+/* The QUERY is kept in the message table while hits may come */
+static void
+pq_pin(uint32_t msg_id, int pinned)
+{
+    struct message *msg;
+
+    if ((msg = g_msg_list_find(msg_id, MSG_QUERY)) != NULL)
+        msg->pinned = pinned;
+}
+
+/**
+ * Take the query out before calling back, so the callback may start or
+ * cancel queries.
+ */
+static void
+pq_complete(struct pending_query *pq, int status)
+{
+    struct pending_query **pp;
+
+    pp = &pq_hash[pq_bucket(pq->msg_id)];
+    for ( ; *pp != NULL; pp = &(*pp)->next) {
+        if (*pp == pq) {
+            *pp = pq->next;
+            break;
+        }
+    }
+    list_del(&pq->list);
+    pq_size--;
+    pq_pin(pq->msg_id, 0);
+
+    pq->cb(pq->msg_id, status, NULL, pq->arg);
+    free(pq);
+}
+
+uint32_t
+query_start(const char *key, int timeout_ms, int flags,
+            query_cb_t cb, void *arg)
+{
+    struct pending_query *pq, *prev;
+    struct list_head *pos;
+    uint32_t msg_id, h;
+
+    if (pq_size >= QUERY_PENDING_MAX) {
+        p2plog(WARN, "Too many queries in flight\n");
+        return 0;
+    }
+    if (flags & QUERY_F_WALK)
+        msg_id = send_walk_message(key, WALK_WALKERS);
+    else
+        msg_id = send_query_message(key);
+    if (msg_id == 0)
+        return 0;
+    if (pq_find(msg_id) != NULL) {
+        p2plog(ERROR, "Query %08X is pending already\n", msg_id);
+        return 0;
+    }
+
+    if ((pq = calloc(1, sizeof(struct pending_query))) == NULL) {
+        perror("calloc error");
+        exit(1);
+    }
+    pq->msg_id = msg_id;
+    pq->deadline = now_ms() + (timeout_ms > 0 ? timeout_ms : QUERY_TIMEOUT_MS);
+    pq->flags = flags;
+    pq->cb = cb;
+    pq->arg = arg;
+
+    h = pq_bucket(msg_id);
+    pq->next = pq_hash[h];
+    pq_hash[h] = pq;
+
+    /* Most queries have the same timeout, so the place is near the tail */
+    for (pos = pq_list.prev; pos != &pq_list; pos = pos->prev) {
+        prev = list_entry(pos, struct pending_query, list);
+        if (prev->deadline <= pq->deadline)
+            break;
+    }
+    list_add(&pq->list, pos);
+    pq_size++;
+    pq_pin(msg_id, 1);
+
+    return msg_id;
+}
+
+int
+query_cancel(uint32_t msg_id)
+{
+    struct pending_query *pq;
+
+    if ((pq = pq_find(msg_id)) == NULL)
+        return -1;
+
+    send_cancel_message(msg_id);
+    pq_complete(pq, QUERY_CANCELLED);
+    return 0;
+}
+
+void
+query_hit(const struct query_hit *hit)
+{
+    struct pending_query *pq;
+
+    if ((pq = pq_find(hit->msg_id)) == NULL)
+        return;
+
+    pq->cb(hit->msg_id, QUERY_HIT, hit, pq->arg);
+
+    /* Look up again, the callback may have cancelled it */
+    if ((pq = pq_find(hit->msg_id)) != NULL && (pq->flags & QUERY_F_FIRST)) {
+        send_cancel_message(hit->msg_id);
+        pq_complete(pq, QUERY_DONE);
+    }
+}
+
+void
+query_expire()
+{
+    struct pending_query *pq;
+    int64_t now = now_ms();
+
+    while (!list_empty(&pq_list)) {
+        pq = list_entry(pq_list.next, struct pending_query, list);
+        if (pq->deadline > now)
+            break;
+        pq_complete(pq, QUERY_DONE);
+    }
+}
+
+int
+query_timeout()
+{
+    struct pending_query *pq;
+    int64_t ms;
+
+    if (list_empty(&pq_list))
+        return -1;
+
+    pq = list_entry(pq_list.next, struct pending_query, list);
+    ms = pq->deadline - now_ms();
+    return ms > 0 ? (int)ms : 0;
+}
+
+void
+query_clear()
+{
+    while (!list_empty(&pq_list))
+        pq_complete(list_entry(pq_list.next, struct pending_query, list),
+                    QUERY_CANCELLED);
+}
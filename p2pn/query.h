@@ -0,0 +1,58 @@
+#ifndef QUERY_H
+#define QUERY_H
+
+#include <stdint.h>
+
+#include "proto.h"
+
+/**
+ * Asynchronous queries. Each QUERY sent by query_start() is pending until
+ * its deadline, the first hit if asked for, or query_cancel(); the hits
+ * reaching this node are matched to it by message ID. Any number of queries
+ * may be in flight, up to QUERY_PENDING_MAX.
+ */
+
+/* Max queries in flight */
+#define QUERY_PENDING_MAX   8192
+#define QUERY_HASH_SIZE     4096        /* Power of 2 */
+/* Deadline of a query started with no timeout */
+#define QUERY_TIMEOUT_MS    5000
+
+/* Status passed to the callback of a query */
+#define QUERY_HIT           0           /* A hit, more may follow */
+#define QUERY_DONE          1           /* Deadline, or the first hit */
+#define QUERY_CANCELLED     2
+
+/* Flags of query_start() */
+#define QUERY_F_FIRST       0x01        /* Done at the first hit */
+#define QUERY_F_WALK        0x02        /* Sent by random walkers, not
+                                         * flooded, see proto.h */
+
+/**
+ * Called with QUERY_HIT and the hit for each hit, then once with
+ * QUERY_DONE or QUERY_CANCELLED and no hit. The query is not pending
+ * anymore in the last call.
+ */
+typedef void (*query_cb_t)(uint32_t msg_id, int status,
+                           const struct query_hit *hit, void *arg);
+
+/* Send a QUERY, return its message ID, 0 if it could not be sent */
+uint32_t query_start(const char *key, int timeout_ms, int flags,
+                     query_cb_t cb, void *arg);
+
+/* Cancel a pending query, -1 if there is none with the ID */
+int query_cancel(uint32_t msg_id);
+
+/* Pass a hit to the query it is for, if that is pending */
+void query_hit(const struct query_hit *hit);
+
+/* Complete the queries whose deadline has passed */
+void query_expire();
+
+/* Milliseconds until the next deadline, -1 if no query is pending */
+int query_timeout();
+
+/* Cancel all pending queries */
+void query_clear();
+
+#endif
@@ -0,0 +1,234 @@
+/**
+ * @brief routes learnt from query hits, see route.h
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "list.h"
+#include "proto.h"
+#include "util.h"
+#include "route.h"
+
+/* The neighbours a key was hit through, the latest first */
+struct route {
+    uint32_t            hash;
+    struct in6_addr     ip[ROUTE_NB];
+    uint16_t            port[ROUTE_NB];
+    time_t              ts[ROUTE_NB];   /* Of the last hit */
+    int                 n;
+    struct route       *next;           /* Next in the hash chain */
+    struct list_head    list;           /* The latest hit first */
+};
+
+/* A QUERY sent along routes, flooded at its deadline unless it was hit */
+struct route_pending {
+    uint32_t            msg_id;
+    int64_t             deadline;       /* In ms */
+    struct list_head    list;           /* Ordered by deadline */
+};
+
+static struct route    *route_hash[ROUTE_HASH_SIZE];
+static LIST_HEAD(route_list);
+static int              route_count;
+static LIST_HEAD(pending_list);
+static int              pending_size;
+
+static int64_t
+now_ms()
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static uint32_t
+route_bucket(uint32_t hash)
+{
+    return (hash * 2654435761u) & (ROUTE_HASH_SIZE - 1);
+}
+
+static struct route *
+route_find(uint32_t hash)
+{
+    struct route *r;
+
+    for (r = route_hash[route_bucket(hash)]; r != NULL; r = r->next) {
+        if (r->hash == hash)
+            return r;
+    }
+
+    return NULL;
+}
+
+static void
+route_del(struct route *r)
+{
+    struct route **pp;
+
+    pp = &route_hash[route_bucket(r->hash)];
+    for ( ; *pp != NULL; pp = &(*pp)->next) {
+        if (*pp == r) {
+            *pp = r->next;
+            break;
+        }
+    }
+    list_del(&r->list);
+    free(r);
+    route_count--;
+}
+
+void
+route_learn(uint32_t hash, const struct in6_addr *ip, uint16_t port)
+{
+    struct route *r;
+    uint32_t h;
+    int i;
+
+    if ((r = route_find(hash)) == NULL) {
+        if (route_count >= ROUTE_MAX)
+            route_del(list_entry(route_list.prev, struct route, list));
+        if ((r = calloc(1, sizeof(struct route))) == NULL) {
+            perror("calloc error");
+            exit(1);
+        }
+        r->hash = hash;
+        h = route_bucket(hash);
+        r->next = route_hash[h];
+        route_hash[h] = r;
+        list_add(&r->list, &route_list);
+        route_count++;
+    } else {
+        list_move(&r->list, &route_list);
+    }
+
+    /* Move the neighbour to the front, the oldest falls off the end */
+    for (i = 0; i < r->n; i++) {
+        if (r->port[i] == port && memcmp(&r->ip[i], ip, sizeof(*ip)) == 0)
+            break;
+    }
+    if (i == r->n && r->n < ROUTE_NB)
+        r->n++;
+    if (i == ROUTE_NB)
+        i--;
+    for ( ; i > 0; i--) {
+        r->ip[i] = r->ip[i - 1];
+        r->port[i] = r->port[i - 1];
+        r->ts[i] = r->ts[i - 1];
+    }
+    r->ip[0] = *ip;
+    r->port[0] = port;
+    r->ts[0] = time(NULL);
+}
+
+int
+route_lookup(uint32_t hash, int fromfd, int *fds, int max)
+{
+    struct route *r;
+    struct nb_node *nb;
+    time_t now = time(NULL);
+    int i, n = 0;
+
+    if ((r = route_find(hash)) == NULL)
+        return 0;
+
+    for (i = 0; i < r->n && n < max; i++) {
+        /* The rest are older still */
+        if (now - r->ts[i] > ROUTE_SECONDS) {
+            r->n = i;
+            break;
+        }
+        if ((nb = g_nb_list_find_by_peer(&r->ip[i], r->port[i])) != NULL &&
+            nb->connfd != fromfd && !nb->leaf)
+            fds[n++] = nb->connfd;
+    }
+    if (r->n == 0)
+        route_del(r);
+
+    return n;
+}
+
+void
+route_forget(uint32_t hash)
+{
+    struct route *r;
+
+    if ((r = route_find(hash)) != NULL)
+        route_del(r);
+}
+
+int
+route_wait(uint32_t msg_id)
+{
+    struct route_pending *rp;
+
+    if (pending_size >= ROUTE_PENDING_MAX)
+        return -1;
+
+    if ((rp = calloc(1, sizeof(struct route_pending))) == NULL) {
+        perror("calloc error");
+        exit(1);
+    }
+    rp->msg_id = msg_id;
+    /* All wait the same, so the list stays ordered */
+    rp->deadline = now_ms() + ROUTE_WAIT_MS;
+    list_add_tail(&rp->list, &pending_list);
+    pending_size++;
+
+    return 0;
+}
+
+void
+route_expire()
+{
+    struct route_pending *rp;
+    int64_t now = now_ms();
+
+    while (!list_empty(&pending_list)) {
+        rp = list_entry(pending_list.next, struct route_pending, list);
+        if (rp->deadline > now)
+            break;
+        list_del(&rp->list);
+        pending_size--;
+        widen_query_message(rp->msg_id);
+        free(rp);
+    }
+}
+
+int
+route_timeout()
+{
+    struct route_pending *rp;
+    int64_t ms;
+
+    if (list_empty(&pending_list))
+        return -1;
+
+    rp = list_entry(pending_list.next, struct route_pending, list);
+    ms = rp->deadline - now_ms();
+    return ms > 0 ? (int)ms : 0;
+}
+
+int
+route_size()
+{
+    return route_count;
+}
+
+void
+route_clear()
+{
+    struct route_pending *rp, *rp_tmp;
+
+    while (!list_empty(&route_list))
+        route_del(list_entry(route_list.next, struct route, list));
+    list_for_each_entry_safe(rp, rp_tmp, &pending_list, list) {
+        list_del(&rp->list);
+        free(rp);
+    }
+    pending_size = 0;
+}
@@ -0,0 +1,55 @@
+#ifndef ROUTE_H
+#define ROUTE_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+/**
+ * Routes learnt from query hits. For each key searched lately, a node
+ * remembers the neighbours whose hits came back through them, and sends the
+ * next QUERY for the key to those neighbours only. If no hit comes back
+ * within ROUTE_WAIT_MS, the QUERY is flooded to the other neighbours after
+ * all and the routes of the key are forgotten. Keys are told apart by their
+ * hash only, a clash costs a wait and a flood.
+ */
+
+/* Max keys remembered, the least recently hit is forgotten first */
+#define ROUTE_MAX           4096
+#define ROUTE_HASH_SIZE     1024        /* Power of 2 */
+/* Neighbours remembered per key */
+#define ROUTE_NB            2
+/* Seconds a neighbour is remembered after its last hit */
+#define ROUTE_SECONDS       120
+/* Milliseconds to wait for a hit before a QUERY is flooded */
+#define ROUTE_WAIT_MS       1000
+/* Max QUERY waiting for a hit at a node */
+#define ROUTE_PENDING_MAX   1024
+
+/* A hit for the key came back through the neighbour */
+void route_learn(uint32_t hash, const struct in6_addr *ip, uint16_t port);
+
+/**
+ * Fill fds with the connected neighbours the key was hit through lately,
+ * other than fromfd and leaves, at most max of them. Returns their number.
+ */
+int route_lookup(uint32_t hash, int fromfd, int *fds, int max);
+
+/* Forget the routes of a key, they did not lead to a hit */
+void route_forget(uint32_t hash);
+
+/* Wait for a hit of a QUERY sent along routes, -1 if too many wait */
+int route_wait(uint32_t msg_id);
+
+/* Flood the QUERY that got no hit in time, see widen_query_message() */
+void route_expire();
+
+/* Milliseconds until a QUERY is due to be flooded, -1 if none waits */
+int route_timeout();
+
+/* Number of keys remembered */
+int route_size();
+
+/* Forget all routes and the QUERY waiting */
+void route_clear();
+
+#endif
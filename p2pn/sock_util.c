@@ -189,6 +189,87 @@ ConnectWithin(int sockfd, const SA *addr, socklen_t salen, int time)
 }
 
 
+/**
+ * Start a Connect() without blocking
+ *
+ * @param sockfd      the socket file descriptor
+ * @param addr        the address of the remote side
+ * @param salen       the size of the @c addr
+ * @return 0 if connected immediately, 1 if the connection is in progress and
+ *         -1 on error
+ *
+ * The socket is left in non-blocking mode while the connection is in 
+ * progress. Wait for it to become writable and call ConnectFinish(). This 
+ * allows many connections to be established in parallel.
+ */
+int
+ConnectNonBlock(int sockfd, const SA *addr, socklen_t salen)
+{
+    int flags;
+    if((flags = fcntl(sockfd, F_GETFL, 0)) < 0) {
+        perror("ConnectNonBlock(), fcntl GETFL");
+        return -1;
+    }
+
+    if (fcntl(sockfd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        perror("ConnectNonBlock(), fcntl SETFL O_NON_BLOCK");
+        return -1;
+    }
+
+    if (connect(sockfd, addr, salen) < 0) {
+        if (errno != EINPROGRESS) {
+            perror("ConnectNonBlock(), connect");
+            return -1;
+        }
+        return 1;
+    }
+
+    /* connect() succeeds immediately */
+    if (fcntl(sockfd, F_SETFL, flags) < 0) {
+        perror("ConnectNonBlock(), fnctl FSETFL");
+        return -1;
+    }
+    return 0;
+}
+
+
+/**
+ * Complete a connection started by ConnectNonBlock()
+ *
+ * @param sockfd      the socket file descriptor, which has become writable
+ * @return 0 if connected and -1 on error
+ *
+ * The socket is put back into blocking mode on success.
+ */
+int
+ConnectFinish(int sockfd)
+{
+    int error, flags;
+    socklen_t len;
+
+    error = 0;
+    len = sizeof(error);
+    if (getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &error, &len) < 0) {
+        perror("ConnectFinish(), getsockopt SO_ERROR");
+        return -1;
+    }
+
+    if (error) {
+        errno = error;
+        perror("ConnectFinish()");
+        return -1;
+    }
+
+    if((flags = fcntl(sockfd, F_GETFL, 0)) < 0 ||
+       fcntl(sockfd, F_SETFL, flags & ~O_NONBLOCK) < 0) {
+        perror("ConnectFinish(), fcntl");
+        return -1;
+    }
+
+    return 0;
+}
+
+
 /**
  * Wrapper for @c close()
  */
@@ -250,19 +331,263 @@ GetSockName(int sockfd, SA *addr, socklen_t *addrlen)
 
 
 /**
- * @c inet_ntop() extension that converts port as well into presentation
- * Note that only IPv4 address is supported
+ * Send a message together with a file descriptor over a unix socket
+ *
+ * @param sockfd      the unix socket
+ * @param fd          the descriptor to pass, or -1 to send the message only
+ * @param buf         the message
+ * @param len         the length of the message
+ */
+ssize_t
+SendFd(int sockfd, int fd, const void *buf, size_t len)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    union {
+        struct cmsghdr cm;
+        char control[CMSG_SPACE(sizeof(int))];
+    } ctl;
+    ssize_t n;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = (void *)buf;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if (fd >= 0) {
+        struct cmsghdr *cmsg;
+
+        memset(&ctl, 0, sizeof(ctl));
+        msg.msg_control = ctl.control;
+        msg.msg_controllen = sizeof(ctl.control);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+
+    if ((n = sendmsg(sockfd, &msg, 0)) < 0)
+        perror("SendFd()");
+
+    return n;
+}
+
+
+/**
+ * Receive a message and the file descriptor passed with it, if any
+ *
+ * @param sockfd      the unix socket
+ * @param fd          set to the received descriptor, or -1 if none
+ * @param buf         the buffer for the message
+ * @param len         the size of the buffer
+ * @param flags       flags for @c recvmsg(), e.g. MSG_DONTWAIT
+ */
+ssize_t
+RecvFd(int sockfd, int *fd, void *buf, size_t len, int flags)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    union {
+        struct cmsghdr cm;
+        char control[CMSG_SPACE(sizeof(int))];
+    } ctl;
+    struct cmsghdr *cmsg;
+    ssize_t n;
+
+    *fd = -1;
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.control;
+    msg.msg_controllen = sizeof(ctl.control);
+
+    if ((n = recvmsg(sockfd, &msg, flags)) < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            perror("RecvFd()");
+        return n;
+    }
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg != NULL && cmsg->cmsg_len == CMSG_LEN(sizeof(int)) &&
+        cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+
+    return n;
+}
+
+
+/**
+ * Addresses of peers are kept as IPv6 addresses, IPv4 ones mapped into
+ * ::ffff:0:0/96 as on a dual-stack socket, so one type serves both.
+ */
+
+/**
+ * Map an IPv4 address (network order) into an IPv6 address
+ */
+void
+sock_map_v4(struct in6_addr *addr, uint32_t s_addr)
+{
+    memset(addr, 0, sizeof(struct in6_addr));
+    addr->s6_addr[10] = 0xFF;
+    addr->s6_addr[11] = 0xFF;
+    memcpy(&addr->s6_addr[12], &s_addr, sizeof(uint32_t));
+}
+
+/**
+ * Check if the address is an IPv4 one
+ */
+int
+sock_is_v4(const struct in6_addr *addr)
+{
+    static const unsigned char prefix[12] = 
+        {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xFF};
+
+    return memcmp(addr->s6_addr, prefix, sizeof(prefix)) == 0;
+}
+
+/**
+ * Get the IPv4 address (network order) of an IPv4 address, or a 32-bit
+ * digest of an IPv6 one, e.g. for headers that only carry 32 bits
  */
-#define SOCK_ADDRSTRLEN (16 + 6) /* Format ddd.ddd.ddd.ddd:ddddd */
+uint32_t
+sock_addr32(const struct in6_addr *addr)
+{
+    uint32_t w[4];
+
+    memcpy(w, addr->s6_addr, sizeof(w));
+    if (sock_is_v4(addr))
+        return w[3];
+
+    return w[0] ^ w[1] ^ w[2] ^ w[3];
+}
+
+/**
+ * Get the socket family to reach an address
+ */
+int
+sock_family(const struct in6_addr *addr)
+{
+    return sock_is_v4(addr) ? AF_INET : AF_INET6;
+}
+
+/**
+ * Build a socket address of the family of the address
+ *
+ * @return the length of the socket address
+ */
+socklen_t
+sock_sockaddr(struct sockaddr_storage *ss, const struct in6_addr *addr, 
+              uint16_t port)
+{
+    memset(ss, 0, sizeof(struct sockaddr_storage));
+
+    if (sock_is_v4(addr)) {
+        struct sockaddr_in *sa = (struct sockaddr_in *)ss;
+        sa->sin_family = AF_INET;
+        sa->sin_addr.s_addr = sock_addr32(addr);
+        sa->sin_port = port;
+        return sizeof(struct sockaddr_in);
+    } else {
+        struct sockaddr_in6 *sa = (struct sockaddr_in6 *)ss;
+        sa->sin6_family = AF_INET6;
+        sa->sin6_addr = *addr;
+        sa->sin6_port = port;
+        return sizeof(struct sockaddr_in6);
+    }
+}
+
+/**
+ * Get address and port from a socket address of either family
+ */
+int
+sock_fromaddr(const SA *sa, struct in6_addr *addr, uint16_t *port)
+{
+    if (sa->sa_family == AF_INET) {
+        const struct sockaddr_in *sin = (const struct sockaddr_in *)sa;
+        sock_map_v4(addr, sin->sin_addr.s_addr);
+        *port = sin->sin_port;
+    } else if (sa->sa_family == AF_INET6) {
+        const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)sa;
+        *addr = sin6->sin6_addr;
+        *port = sin6->sin6_port;
+    } else {
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Create a listening socket bound to the address. An IPv6 socket bound to
+ * the unspecified address also accepts IPv4 connections (dual-stack), on a
+ * host without IPv6 it falls back to any IPv4 address.
+ */
+int
+ListenOn(const struct in6_addr *addr, uint16_t port, int backlog)
+{
+    struct sockaddr_storage ss;
+    socklen_t sslen;
+    struct in6_addr v4any;
+    int fd, enabled = 1, disabled = 0;
+
+    if ((fd = socket(sock_family(addr), SOCK_STREAM, 0)) < 0 &&
+        errno == EAFNOSUPPORT && 
+        memcmp(addr, &in6addr_any, sizeof(struct in6_addr)) == 0) {
+        sock_map_v4(&v4any, htonl(INADDR_ANY));
+        addr = &v4any;
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+    }
+    if (fd < 0) {
+        perror("ListenOn(), socket");
+        exit(1);
+    }
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, 
+                   &enabled, sizeof(enabled)) != 0) {
+        perror("ListenOn(), SO_REUSEADDR");
+    }
+    if (sock_family(addr) == AF_INET6 &&
+        setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, 
+                   &disabled, sizeof(disabled)) != 0) {
+        perror("ListenOn(), IPV6_V6ONLY");
+    }
+
+    sslen = sock_sockaddr(&ss, addr, port);
+    Bind(fd, (SA *)&ss, sslen);
+    Listen(fd, backlog);
+
+    return fd;
+}
+
+
+/**
+ * @c inet_ntop() extension that converts port as well into presentation,
+ * IPv6 addresses are put in brackets: [addr]:port
+ */
+#define SOCK_ADDRSTRLEN (INET6_ADDRSTRLEN + 8)  /* Format [addr]:ddddd */
 const char *
-sock_ntop(const struct in_addr *addr, const uint16_t port)
+sock_ntop(const struct in6_addr *addr, const uint16_t port)
 {
     static char str[SOCK_ADDRSTRLEN];
+    uint32_t v4;
 
-    
-    if (inet_ntop(AF_INET, addr, str, SOCK_ADDRSTRLEN) == NULL) {
-        perror("sock_ntop(), inet_ntop");
-        return NULL;
+    if (sock_is_v4(addr)) {
+        v4 = sock_addr32(addr);
+        if (inet_ntop(AF_INET, &v4, str, SOCK_ADDRSTRLEN) == NULL) {
+            perror("sock_ntop(), inet_ntop");
+            return NULL;
+        }
+    } else {
+        str[0] = '[';
+        if (inet_ntop(AF_INET6, addr, str + 1, SOCK_ADDRSTRLEN - 1) == NULL) {
+            perror("sock_ntop(), inet_ntop");
+            return NULL;
+        }
+        strcat(str, "]");
     }
 
     sprintf(str + strlen(str), ":%d", ntohs(port));
@@ -271,36 +596,44 @@ sock_ntop(const struct in_addr *addr, const uint16_t port)
 
 
 /**
- * @c inet_pton() extension that converts a string into address and port
- * Note that only IPv4 address is supported
+ * @c inet_pton() extension that converts a string into address and port,
+ * either ddd.ddd.ddd.ddd:port or [IPv6 address]:port
  */
 int
-sock_pton(const char *str, struct in_addr *addr, uint16_t *port)
+sock_pton(const char *str, struct in6_addr *addr, uint16_t *port)
 {
     int len;
-    char *sp;
-    char tmp[32];
-
-    memset(addr, 0, sizeof(struct sockaddr_in));
-
-    if (str != NULL) {
-        if((sp = strstr(str, ":")) != NULL) {
-            len = sp - str;
-            strncpy(tmp, str, len);
-            tmp[len] = 0;
-            if ((inet_pton(AF_INET, tmp, addr)) != 1) {
-                perror("sock_pton(), inet_pton");
-                return -1;
-            }
-            *port = htons(atoi(sp + 1));
-        } else {
-            perror("sock_pton(), format");
-            return -1;
-        }
+    const char *sp;
+    char tmp[INET6_ADDRSTRLEN];
+    struct in_addr v4;
+
+    memset(addr, 0, sizeof(struct in6_addr));
+
+    if (str == NULL) {
+        fprintf(stderr, "sock_pton(): NULL\n");
+        return -1;
+    }
+
+    if (str[0] == '[') {
+        str++;
+        sp = strstr(str, "]:");
     } else {
-        perror("sock_pton(), NULL");
+        sp = strrchr(str, ':');
+    }
+    if (sp == NULL || (len = sp - str) >= INET6_ADDRSTRLEN) {
+        fprintf(stderr, "sock_pton(): invalid format %s\n", str);
+        return -1;
+    }
+    strncpy(tmp, str, len);
+    tmp[len] = 0;
+
+    if (inet_pton(AF_INET, tmp, &v4) == 1) {
+        sock_map_v4(addr, v4.s_addr);
+    } else if (inet_pton(AF_INET6, tmp, addr) != 1) {
+        fprintf(stderr, "sock_pton(): invalid address %s\n", tmp);
         return -1;
     }
+    *port = htons(atoi(sp[0] == ']' ? sp + 2 : sp + 1));
 
     return 0;
 }
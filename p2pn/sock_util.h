@@ -19,6 +19,10 @@ int Connect(int sockfd, const SA *addr, socklen_t addrlen);
 
 int ConnectWithin(int sockfd, const SA *addr, socklen_t salen, int time);
 
+int ConnectNonBlock(int sockfd, const SA *addr, socklen_t salen);
+
+int ConnectFinish(int sockfd);
+
 int Close(int fd);
 
 ssize_t Read(int fd, void *buf, size_t count);
@@ -27,8 +31,27 @@ ssize_t Write(int fd, const void *buf, size_t count);
 
 int GetSockName(int sockfd, SA *addr, socklen_t *addrlen);
 
-const char *sock_ntop(const struct in_addr *addr, const unsigned short port);
+ssize_t SendFd(int sockfd, int fd, const void *buf, size_t len);
+
+ssize_t RecvFd(int sockfd, int *fd, void *buf, size_t len, int flags);
+
+int ListenOn(const struct in6_addr *addr, uint16_t port, int backlog);
+
+void sock_map_v4(struct in6_addr *addr, uint32_t s_addr);
+
+int sock_is_v4(const struct in6_addr *addr);
+
+uint32_t sock_addr32(const struct in6_addr *addr);
+
+int sock_family(const struct in6_addr *addr);
+
+socklen_t sock_sockaddr(struct sockaddr_storage *ss, 
+                        const struct in6_addr *addr, uint16_t port);
+
+int sock_fromaddr(const SA *sa, struct in6_addr *addr, uint16_t *port);
+
+const char *sock_ntop(const struct in6_addr *addr, const unsigned short port);
 
-int sock_pton(const char *str, struct in_addr *addr, uint16_t *port);
+int sock_pton(const char *str, struct in6_addr *addr, uint16_t *port);
 
 #endif
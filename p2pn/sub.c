@@ -0,0 +1,295 @@
+/**
+ * @brief subscriptions to a key, see sub.h
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "list.h"
+#include "sock_util.h"
+#include "proto.h"
+#include "util.h"
+#include "sub.h"
+
+/* The keys of SUBSCRIBE and of the kvfile are shorter than KEY_MAX, a
+   QUERY may carry one of KEY_MAX characters, which is never subscribed */
+
+/* A node subscribed to one of our keys */
+struct subscriber {
+    struct in6_addr     ip;
+    uint16_t            port;
+    char                key[KEY_MAX];
+    uint32_t            nonce;
+    time_t              expires;
+    struct list_head    list;
+};
+
+/* A holder of a key we subscribed to */
+struct subscription {
+    struct in6_addr     ip;
+    uint16_t            port;
+    char                key[KEY_MAX];
+    uint32_t            value;
+    uint32_t            nonce;
+    int                 answered;   /* Has it granted a lease? */
+    time_t              expires;    /* Of the lease, or the first answer */
+    time_t              renew;
+    struct list_head    list;
+};
+
+static LIST_HEAD(subscribers);
+static int subscribers_size;
+static LIST_HEAD(subscriptions);
+static int subscriptions_size;
+
+static struct subscriber *
+subscriber_find(const struct in6_addr *ip, uint16_t port, const char *key)
+{
+    struct subscriber *s;
+
+    list_for_each_entry(s, &subscribers, list) {
+        if (s->port == port && memcmp(&s->ip, ip, sizeof(*ip)) == 0 &&
+            strcmp(s->key, key) == 0)
+            return s;
+    }
+    return NULL;
+}
+
+static struct subscription *
+subscription_find(const struct in6_addr *ip, uint16_t port, const char *key)
+{
+    struct subscription *s;
+
+    list_for_each_entry(s, &subscriptions, list) {
+        if (s->port == port && memcmp(&s->ip, ip, sizeof(*ip)) == 0 &&
+            strcmp(s->key, key) == 0)
+            return s;
+    }
+    return NULL;
+}
+
+static void
+subscriber_del(struct subscriber *s)
+{
+    list_del(&s->list);
+    free(s);
+    subscribers_size--;
+}
+
+static void
+subscription_del(struct subscription *s)
+{
+    list_del(&s->list);
+    free(s);
+    subscriptions_size--;
+}
+
+/* Is the nonce the ID of a QUERY for the key, sent by the node and hit? */
+static int
+query_hit_here(const struct in6_addr *ip, uint16_t port, const char *key,
+               uint32_t nonce)
+{
+    struct message *query;
+    struct P2P_h *ph;
+    struct in6_addr org_ip;
+    unsigned int klen;
+
+    if ((query = g_msg_list_find(nonce, MSG_QUERY)) == NULL || 
+        query->fromfd == 0)
+        return 0;
+    ph = (struct P2P_h *) query->content;
+    if ((ph->reserved & H_F_ORG_IPV6) || ph->org_port != port)
+        return 0;
+    sock_map_v4(&org_ip, ph->org_ip);
+    if (memcmp(&org_ip, ip, sizeof(org_ip)) != 0)
+        return 0;
+
+    klen = strlen(key) + 1;
+    return query->len == (int)(HLEN + klen) &&
+           memcmp((char *)query->content + HLEN, key, klen) == 0;
+}
+
+int
+sub_add(const struct in6_addr *ip, uint16_t port, const char *key,
+        int lease, uint32_t nonce)
+{
+    struct subscriber *s;
+
+    if (strlen(key) >= KEY_MAX)
+        return -1;
+
+    s = subscriber_find(ip, port, key);
+    if (s != NULL && s->nonce != nonce) {
+        /* The node subscribes anew after a hit of another QUERY */
+        if (lease == 0 || !query_hit_here(ip, port, key, nonce))
+            return -1;
+        s->nonce = nonce;
+    } else if (s == NULL && !query_hit_here(ip, port, key, nonce)) {
+        p2plog(DEBUG, "SUBSCRIBE for \"%s\" from %s matches no QUERY\n",
+               key, sock_ntop(ip, port));
+        return -1;
+    }
+
+    if (lease == 0 || g_kv_list_find(key) == NULL) {
+        if (s != NULL)
+            subscriber_del(s);
+        return 0;
+    }
+
+    if (s == NULL) {
+        if (subscribers_size >= SUB_MAX) {
+            p2plog(WARN, "Too many subscribers, refuse %s\n",
+                   sock_ntop(ip, port));
+            return 0;
+        }
+        if ((s = calloc(1, sizeof(struct subscriber))) == NULL) {
+            perror("calloc error");
+            exit(1);
+        }
+        s->ip = *ip;
+        s->port = port;
+        strcpy(s->key, key);
+        s->nonce = nonce;
+        list_add_tail(&s->list, &subscribers);
+        subscribers_size++;
+        p2plog(INFO, "Subscriber %s for \"%s\"\n", sock_ntop(ip, port), key);
+    }
+
+    if (lease > SUB_LEASE_SECONDS)
+        lease = SUB_LEASE_SECONDS;
+    s->expires = time(NULL) + lease;
+
+    return lease;
+}
+
+void
+sub_notify(const char *key, uint32_t value)
+{
+    struct subscriber *s, *s_tmp;
+    time_t now = time(NULL);
+    int lease;
+
+    list_for_each_entry_safe(s, s_tmp, &subscribers, list) {
+        if (strcmp(s->key, key) != 0)
+            continue;
+        p2plog(INFO, "Push \"%s\" = 0x%08X to %s\n", key, value,
+               sock_ntop(&s->ip, s->port));
+        /* What is left of the lease */
+        lease = s->expires > now ? (int)(s->expires - now) : 1;
+        send_update_message(&s->ip, s->port, key, value, 
+                            value != 0 ? lease : 0, s->nonce);
+        if (value == 0)
+            subscriber_del(s);
+    }
+}
+
+int
+sub_start(const char *key, const struct in6_addr *ip, uint16_t port,
+          uint32_t value, uint32_t nonce)
+{
+    struct subscription *s;
+
+    if (strlen(key) >= KEY_MAX)
+        return -1;
+    if (subscription_find(ip, port, key) != NULL)
+        return 0;
+    if (subscriptions_size >= SUB_HOLDERS_MAX)
+        return -1;
+
+    if ((s = calloc(1, sizeof(struct subscription))) == NULL) {
+        perror("calloc error");
+        exit(1);
+    }
+    s->ip = *ip;
+    s->port = port;
+    strcpy(s->key, key);
+    s->value = value;
+    s->nonce = nonce;
+    s->expires = time(NULL) + SUB_RETRY_SECONDS;
+    s->renew = s->expires;
+    list_add_tail(&s->list, &subscriptions);
+    subscriptions_size++;
+
+    send_subscribe_message(ip, port, key, SUB_LEASE_SECONDS, nonce);
+    return 0;
+}
+
+void
+sub_update(const struct in6_addr *ip, uint16_t port, const char *key,
+           uint32_t value, int lease, uint32_t nonce)
+{
+    struct subscription *s;
+    time_t now = time(NULL);
+
+    if ((s = subscription_find(ip, port, key)) == NULL || s->nonce != nonce) {
+        p2plog(DEBUG, "UPDATE of \"%s\" from %s not subscribed\n", key,
+               sock_ntop(ip, port));
+        return;
+    }
+
+    if (value != s->value) {
+        p2plog(INFO, "Update: \"%s\" = 0x%08X at %s\n", key, value,
+               sock_ntop(ip, port));
+        s->value = value;
+    }
+
+    if (lease == 0 || value == 0) {
+        p2plog(INFO, "Subscription for \"%s\" at %s ended\n", key,
+               sock_ntop(ip, port));
+        subscription_del(s);
+        return;
+    }
+
+    s->answered = 1;
+    s->expires = now + lease;
+    s->renew = now + lease / 2;
+}
+
+int
+sub_maintain(const char *key)
+{
+    struct subscriber *sr, *sr_tmp;
+    struct subscription *s, *s_tmp;
+    time_t now = time(NULL);
+    int active = 0;
+
+    list_for_each_entry_safe(sr, sr_tmp, &subscribers, list) {
+        if (now >= sr->expires) {
+            p2plog(INFO, "Subscriber %s for \"%s\" expired\n",
+                   sock_ntop(&sr->ip, sr->port), sr->key);
+            subscriber_del(sr);
+        }
+    }
+
+    list_for_each_entry_safe(s, s_tmp, &subscriptions, list) {
+        if (now >= s->expires) {
+            p2plog(WARN, "No answer from %s for \"%s\", unsubscribed\n",
+                   sock_ntop(&s->ip, s->port), s->key);
+            subscription_del(s);
+            continue;
+        }
+        if (now >= s->renew) {
+            send_subscribe_message(&s->ip, s->port, s->key,
+                                   SUB_LEASE_SECONDS, s->nonce);
+            s->renew = now + SUB_RETRY_SECONDS;
+        }
+        if (key != NULL && s->answered && strcmp(s->key, key) == 0)
+            active++;
+    }
+
+    return active;
+}
+
+void
+sub_clear()
+{
+    struct subscriber *sr, *sr_tmp;
+    struct subscription *s, *s_tmp;
+
+    list_for_each_entry_safe(sr, sr_tmp, &subscribers, list)
+        subscriber_del(sr);
+    list_for_each_entry_safe(s, s_tmp, &subscriptions, list)
+        subscription_del(s);
+}
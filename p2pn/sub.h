@@ -0,0 +1,56 @@
+#ifndef SUB_H
+#define SUB_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+/**
+ * Subscriptions to a key. A node searching a key subscribes to the nodes
+ * that hit it, and they push the value when it changes, instead of the key
+ * being flooded every few seconds. Both sides talk directly over the
+ * datagram side channel. A subscription is a lease the subscriber renews
+ * at half its time; the holder drops one that is not renewed, and the
+ * subscriber drops a holder that stops answering. Both sides tell each
+ * other's datagrams by the ID of the QUERY the holder hit, the nonce, and
+ * the holder only takes a new subscriber whose QUERY it hit.
+ */
+
+/* Lease asked for, and the max granted */
+#define SUB_LEASE_SECONDS   60
+/* Seconds to wait for the answer to a SUBSCRIBE before trying again */
+#define SUB_RETRY_SECONDS   5
+/* Seconds between searches for new holders while subscribed */
+#define SUB_SEARCH_SECONDS  300
+/* Max subscribers a node keeps, and holders it subscribes to */
+#define SUB_MAX             1024
+#define SUB_HOLDERS_MAX     8
+
+/**
+ * Holder: take a SUBSCRIBE, return the lease granted, 0 if none, -1 if it
+ * is not to be answered
+ */
+int sub_add(const struct in6_addr *ip, uint16_t port, const char *key,
+            int lease, uint32_t nonce);
+
+/* Holder: push the new value of a key to its subscribers, 0 if it is gone */
+void sub_notify(const char *key, uint32_t value);
+
+/* Subscriber: subscribe to a node that hit the key with the QUERY nonce,
+   with the value hit, -1 if too many are or the key is too long */
+int sub_start(const char *key, const struct in6_addr *ip, uint16_t port,
+              uint32_t value, uint32_t nonce);
+
+/* Subscriber: take an UPDATE from a holder */
+void sub_update(const struct in6_addr *ip, uint16_t port, const char *key,
+                uint32_t value, int lease, uint32_t nonce);
+
+/**
+ * Renew and expire leases on both sides. Returns the number of holders of
+ * the key that answered and whose lease is running, 0 if key is NULL.
+ */
+int sub_maintain(const char *key);
+
+/* Forget all subscribers and subscriptions */
+void sub_clear();
+
+#endif
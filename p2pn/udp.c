@@ -0,0 +1,191 @@
+#define _GNU_SOURCE                 /* recvmmsg(), sendmmsg() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "sock_util.h"
+#include "udp.h"
+
+/**
+ * Datagrams queued during a loop iteration are sent together by udp_flush().
+ * Buffers are words so that the messages in them are aligned.
+ */
+static struct {
+    int                     fd;
+    udp_fallback_t          fallback;
+
+    /* Outgoing */
+    struct mmsghdr          out[UDP_BATCH];
+    struct iovec            out_iov[UDP_BATCH];
+    struct sockaddr_storage out_addr[UDP_BATCH];
+    uint32_t                out_buf[UDP_BATCH][UDP_MAX / 4];
+    int                     out_connfd[UDP_BATCH];
+    int                     out_n;
+
+    /* Incoming */
+    struct mmsghdr          in[UDP_BATCH];
+    struct iovec            in_iov[UDP_BATCH];
+    struct sockaddr_storage in_addr[UDP_BATCH];
+    uint32_t                in_buf[UDP_BATCH][UDP_MAX / 4];
+} udp = { .fd = -1 };
+
+
+/**
+ * Bind the datagram socket to the listening address, dual-stack on the
+ * IPv6 unspecified address as the listening socket.
+ */
+int
+udp_open(const struct in6_addr *addr, uint16_t port, udp_fallback_t fallback)
+{
+    struct sockaddr_storage ss;
+    socklen_t sslen;
+    struct in6_addr v4any;
+    int fd, disabled = 0;
+
+    if ((fd = socket(sock_family(addr), SOCK_DGRAM, 0)) < 0 &&
+        errno == EAFNOSUPPORT &&
+        memcmp(addr, &in6addr_any, sizeof(struct in6_addr)) == 0) {
+        sock_map_v4(&v4any, htonl(INADDR_ANY));
+        addr = &v4any;
+        fd = socket(AF_INET, SOCK_DGRAM, 0);
+    }
+    if (fd < 0) {
+        perror("udp_open(), socket");
+        return -1;
+    }
+    if (sock_family(addr) == AF_INET6 &&
+        setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY,
+                   &disabled, sizeof(disabled)) != 0) {
+        perror("udp_open(), IPV6_V6ONLY");
+    }
+
+    sslen = sock_sockaddr(&ss, addr, port);
+    if (bind(fd, (SA *)&ss, sslen) != 0 ||
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK) != 0) {
+        perror("udp_open(), bind");
+        close(fd);
+        return -1;
+    }
+
+    udp.fd = fd;
+    udp.fallback = fallback;
+    return fd;
+}
+
+void
+udp_close()
+{
+    if (udp.fd >= 0)
+        close(udp.fd);
+    udp.fd = -1;
+    udp.out_n = 0;
+}
+
+/**
+ * Queue a datagram, the batch is sent right away when it is full.
+ *
+ * @return 0 if queued, -1 if there is no socket or the message is too long
+ */
+int
+udp_send(const struct in6_addr *addr, uint16_t port,
+         const void *msg, unsigned int len, int connfd)
+{
+    int i;
+
+    if (udp.fd < 0 || len > UDP_MAX)
+        return -1;
+
+    if (udp.out_n == UDP_BATCH)
+        udp_flush();
+
+    i = udp.out_n++;
+    memcpy(udp.out_buf[i], msg, len);
+    udp.out_iov[i].iov_base = udp.out_buf[i];
+    udp.out_iov[i].iov_len = len;
+    memset(&udp.out[i], 0, sizeof(struct mmsghdr));
+    udp.out[i].msg_hdr.msg_iov = &udp.out_iov[i];
+    udp.out[i].msg_hdr.msg_iovlen = 1;
+    udp.out[i].msg_hdr.msg_name = &udp.out_addr[i];
+    udp.out[i].msg_hdr.msg_namelen = sock_sockaddr(&udp.out_addr[i],
+                                                   addr, port);
+    udp.out_connfd[i] = connfd;
+
+    return 0;
+}
+
+/**
+ * Send the queued datagrams. A datagram the kernel refuses is handed to the
+ * fallback, and the rest of the batch is tried again.
+ */
+void
+udp_flush()
+{
+    int i = 0, n;
+
+    while (i < udp.out_n) {
+        n = sendmmsg(udp.fd, &udp.out[i], udp.out_n - i, 0);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (udp.fallback != NULL)
+                udp.fallback(udp.out_connfd[i], udp.out_buf[i],
+                             udp.out_iov[i].iov_len, errno);
+            n = 1;
+        }
+        i += n;
+    }
+    udp.out_n = 0;
+}
+
+/**
+ * Receive datagrams until the socket is empty or UDP_BUDGET datagrams have
+ * been handled. Truncated ones and those from unknown families are dropped.
+ */
+int
+udp_recv(udp_input_t input)
+{
+    struct in6_addr ip;
+    uint16_t port;
+    int i, n, total = 0;
+
+    while (total < UDP_BUDGET) {
+        for (i = 0; i < UDP_BATCH; i++) {
+            udp.in_iov[i].iov_base = udp.in_buf[i];
+            udp.in_iov[i].iov_len = UDP_MAX;
+            memset(&udp.in[i], 0, sizeof(struct mmsghdr));
+            udp.in[i].msg_hdr.msg_iov = &udp.in_iov[i];
+            udp.in[i].msg_hdr.msg_iovlen = 1;
+            udp.in[i].msg_hdr.msg_name = &udp.in_addr[i];
+            udp.in[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+        }
+
+        n = recvmmsg(udp.fd, udp.in, UDP_BATCH, MSG_DONTWAIT, NULL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("udp_recv(), recvmmsg");
+            break;
+        }
+
+        for (i = 0; i < n; i++) {
+            if ((udp.in[i].msg_hdr.msg_flags & MSG_TRUNC) ||
+                sock_fromaddr((SA *)&udp.in_addr[i], &ip, &port) != 0)
+                continue;
+            input(&ip, port, udp.in_buf[i], udp.in[i].msg_len);
+        }
+        total += n;
+
+        if (n < UDP_BATCH)
+            break;
+    }
+
+    return total;
+}
@@ -0,0 +1,46 @@
+#ifndef UDP_H
+#define UDP_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+/**
+ * Datagram side channel on the listening address, used for heartbeats and
+ * small QUERY and QHIT so they are not queued behind bulk TCP traffic.
+ * There is only one socket per process. Datagrams are sent and received in
+ * batches with sendmmsg() and recvmmsg().
+ */
+
+/* Largest message sent as one datagram */
+#define UDP_MAX         512
+/* Datagrams per system call */
+#define UDP_BATCH       32
+/* Max datagrams received before serving others */
+#define UDP_BUDGET      256
+
+/* Called for a queued datagram that could not be sent, with the errno */
+typedef void (*udp_fallback_t)(int connfd, void *msg, unsigned int len,
+                               int err);
+
+/* Called for each datagram received */
+typedef void (*udp_input_t)(struct in6_addr *ip, uint16_t port,
+                            void *msg, unsigned int len);
+
+/* Bind the socket, return its fd, or -1 on failure */
+int udp_open(const struct in6_addr *addr, uint16_t port,
+             udp_fallback_t fallback);
+
+/* Close the socket, queued datagrams are dropped */
+void udp_close();
+
+/* Queue a datagram to be sent by udp_flush(), -1 if it is not possible */
+int udp_send(const struct in6_addr *addr, uint16_t port,
+             const void *msg, unsigned int len, int connfd);
+
+/* Send all queued datagrams */
+void udp_flush();
+
+/* Receive pending datagrams, return the number of them */
+int udp_recv(udp_input_t input);
+
+#endif
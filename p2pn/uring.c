@@ -0,0 +1,438 @@
+#define _GNU_SOURCE                 /* syscall() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/time_types.h>
+#include <linux/io_uring.h>
+
+#include "uring.h"
+
+/**
+ * The ring is used from the main loop only, so the only concurrency is with
+ * the kernel: head and tail shared with it are accessed with acquire/release
+ * semantics, everything else is private.
+ */
+#define load_acquire(p)     __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+/* Group ID of provided receive buffers */
+#define URING_BGID          0
+
+static struct {
+    int                     fd;
+
+    /* Submission queue */
+    unsigned int           *sq_head;
+    unsigned int           *sq_tail;
+    unsigned int           *sq_mask;
+    unsigned int           *sq_array;
+    unsigned int            sq_entries;
+    struct io_uring_sqe    *sqes;
+    unsigned int            sqe_tail;   /* Prepared but not yet submitted */
+
+    /* Completion queue */
+    unsigned int           *cq_head;
+    unsigned int           *cq_tail;
+    unsigned int           *cq_mask;
+    struct io_uring_cqe    *cqes;
+
+    /* Provided receive buffers */
+    struct io_uring_buf_ring *br;
+    unsigned char          *bufs;
+    unsigned int            nbufs;
+    unsigned int            bufsize;
+    uint16_t                br_tail;
+
+    void                   *sq_ptr, *cq_ptr;
+    size_t                  sq_size, sqes_size, br_size;
+} ring = { .fd = -1 };
+
+
+/**
+ * Give buffer bid to the kernel, visible after the tail is published.
+ */
+static void
+buf_add(unsigned int bid)
+{
+    struct io_uring_buf *b;
+
+    b = &ring.br->bufs[ring.br_tail & (ring.nbufs - 1)];
+    b->addr = (uint64_t)(uintptr_t)(ring.bufs + (size_t)bid * ring.bufsize);
+    b->len = ring.bufsize;
+    b->bid = bid;
+    ring.br_tail++;
+}
+
+/**
+ * Register a ring of provided buffers, the kernel picks one of them for
+ * each completion of a receive, so idle connections hold no buffer.
+ */
+static int
+buf_ring_init(unsigned int nbufs, unsigned int bufsize)
+{
+    struct io_uring_buf_reg reg;
+    unsigned int i;
+
+    ring.nbufs = nbufs;
+    ring.bufsize = bufsize;
+    ring.br_size = nbufs * sizeof(struct io_uring_buf);
+    ring.br = mmap(NULL, ring.br_size, PROT_READ | PROT_WRITE,
+                   MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (ring.br == MAP_FAILED) {
+        perror("uring_init(), mmap buffer ring");
+        ring.br = NULL;
+        return -1;
+    }
+
+    if ((ring.bufs = malloc((size_t)nbufs * bufsize)) == NULL) {
+        perror("uring_init(), malloc buffers");
+        return -1;
+    }
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)ring.br;
+    reg.ring_entries = nbufs;
+    reg.bgid = URING_BGID;
+    if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PBUF_RING,
+                &reg, 1) < 0) {
+        perror("uring_init(), register buffer ring");
+        return -1;
+    }
+
+    for (i = 0; i < nbufs; i++)
+        buf_add(i);
+    store_release(&ring.br->tail, ring.br_tail);
+
+    return 0;
+}
+
+/**
+ * Set up the ring and the provided buffers.
+ *
+ * @return 0 on success, -1 if io_uring (or a feature needed) is unavailable
+ */
+int
+uring_init(unsigned int entries, unsigned int nbufs, unsigned int bufsize)
+{
+    struct io_uring_params p;
+    unsigned char *sq, *cq;
+
+    memset(&p, 0, sizeof(p));
+    if ((ring.fd = syscall(__NR_io_uring_setup, entries, &p)) < 0) {
+        perror("uring_init(), io_uring_setup");
+        return -1;
+    }
+
+    /* Multishot requests and EXT_ARG timeouts need a recent kernel */
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+        !(p.features & IORING_FEAT_EXT_ARG)) {
+        fprintf(stderr, "uring_init(): kernel features missing\n");
+        uring_exit();
+        return -1;
+    }
+
+    /* Both rings are in one mapping, see IORING_FEAT_SINGLE_MMAP */
+    ring.sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    if (p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe) > 
+        ring.sq_size)
+        ring.sq_size = p.cq_off.cqes + 
+                       p.cq_entries * sizeof(struct io_uring_cqe);
+
+    ring.sq_ptr = mmap(NULL, ring.sq_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    if (ring.sq_ptr == MAP_FAILED) {
+        perror("uring_init(), mmap rings");
+        ring.sq_ptr = NULL;
+        uring_exit();
+        return -1;
+    }
+    ring.cq_ptr = ring.sq_ptr;
+
+    ring.sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring.sqes = mmap(NULL, ring.sqes_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+    if (ring.sqes == MAP_FAILED) {
+        perror("uring_init(), mmap sqes");
+        ring.sqes = NULL;
+        uring_exit();
+        return -1;
+    }
+
+    sq = ring.sq_ptr;
+    ring.sq_head = (unsigned int *)(sq + p.sq_off.head);
+    ring.sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+    ring.sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+    ring.sq_array = (unsigned int *)(sq + p.sq_off.array);
+    ring.sq_entries = p.sq_entries;
+    ring.sqe_tail = *ring.sq_tail;
+
+    cq = ring.cq_ptr;
+    ring.cq_head = (unsigned int *)(cq + p.cq_off.head);
+    ring.cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+    ring.cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    if (buf_ring_init(nbufs, bufsize) != 0) {
+        uring_exit();
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Release the ring. Requests still in flight are cancelled by the kernel.
+ */
+void
+uring_exit()
+{
+    if (ring.br)
+        munmap(ring.br, ring.br_size);
+    free(ring.bufs);
+    if (ring.sqes)
+        munmap(ring.sqes, ring.sqes_size);
+    if (ring.sq_ptr)
+        munmap(ring.sq_ptr, ring.sq_size);
+    if (ring.fd >= 0)
+        close(ring.fd);
+
+    memset(&ring, 0, sizeof(ring));
+    ring.fd = -1;
+}
+
+/**
+ * Submit prepared requests to the kernel, optionally waiting for completions.
+ */
+static int
+enter(unsigned int wait_nr, int timeout_ms)
+{
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned int to_submit, flags = 0;
+    int n;
+
+    to_submit = ring.sqe_tail - *ring.sq_tail;
+    store_release(ring.sq_tail, ring.sqe_tail);
+
+    memset(&arg, 0, sizeof(arg));
+    if (wait_nr > 0) {
+        flags |= IORING_ENTER_GETEVENTS;
+        if (timeout_ms >= 0) {
+            ts.tv_sec = timeout_ms / 1000;
+            ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+            arg.ts = (uint64_t)(uintptr_t)&ts;
+        }
+    }
+    flags |= IORING_ENTER_EXT_ARG;
+
+    n = syscall(__NR_io_uring_enter, ring.fd, to_submit, wait_nr, flags,
+                &arg, sizeof(arg));
+    if (n < 0 && errno != ETIME && errno != EINTR) {
+        perror("uring_wait(), io_uring_enter");
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Get a free submission entry, submit pending ones first if the queue is
+ * full.
+ */
+static struct io_uring_sqe *
+get_sqe()
+{
+    struct io_uring_sqe *sqe;
+    unsigned int idx;
+
+    if (ring.sqe_tail - load_acquire(ring.sq_head) >= ring.sq_entries) {
+        if (enter(0, 0) != 0 ||
+            ring.sqe_tail - load_acquire(ring.sq_head) >= ring.sq_entries) {
+            fprintf(stderr, "get_sqe(): submission queue full\n");
+            return NULL;
+        }
+    }
+
+    idx = ring.sqe_tail & *ring.sq_mask;
+    sqe = &ring.sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    ring.sq_array[idx] = idx;
+    ring.sqe_tail++;
+
+    return sqe;
+}
+
+/**
+ * Multishot accept, one completion per connection with the new socket fd.
+ */
+int
+uring_accept(int fd, uint64_t ud)
+{
+    struct io_uring_sqe *sqe;
+
+    if ((sqe = get_sqe()) == NULL)
+        return -1;
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = ud;
+
+    return 0;
+}
+
+/**
+ * Multishot receive, one completion with a provided buffer per chunk of
+ * bytes received. Stops when buffers run out (-ENOBUFS), on end of file and
+ * on error.
+ */
+int
+uring_recv(int fd, uint64_t ud)
+{
+    struct io_uring_sqe *sqe;
+
+    if ((sqe = get_sqe()) == NULL)
+        return -1;
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->user_data = ud;
+
+    return 0;
+}
+
+/**
+ * Send bytes without raising SIGPIPE.
+ */
+int
+uring_send(int fd, const void *buf, unsigned int len, uint64_t ud)
+{
+    struct io_uring_sqe *sqe;
+
+    if ((sqe = get_sqe()) == NULL)
+        return -1;
+
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = len;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = ud;
+
+    return 0;
+}
+
+/**
+ * Poll for events on fd.
+ */
+int
+uring_poll(int fd, unsigned int events, int multi, uint64_t ud)
+{
+    struct io_uring_sqe *sqe;
+
+    if ((sqe = get_sqe()) == NULL)
+        return -1;
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+    sqe->len = multi ? IORING_POLL_ADD_MULTI : 0;
+    sqe->user_data = ud;
+
+    return 0;
+}
+
+/**
+ * Cancel the request identified by its user data. The cancelled request
+ * completes with -ECANCELED, the cancel request itself completes with ud.
+ */
+int
+uring_cancel(uint64_t target, uint64_t ud)
+{
+    struct io_uring_sqe *sqe;
+
+    if ((sqe = get_sqe()) == NULL)
+        return -1;
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = target;
+    sqe->user_data = ud;
+
+    return 0;
+}
+
+/**
+ * Submit all prepared requests and wait for at least one completion, or
+ * timeout_ms milliseconds. Both happen in one system call.
+ */
+int
+uring_wait(int timeout_ms)
+{
+    /* Do not sleep if there are completions not yet consumed */
+    if (*ring.cq_head != load_acquire(ring.cq_tail))
+        return enter(0, 0);
+
+    return enter(1, timeout_ms);
+}
+
+/**
+ * Get next completion.
+ *
+ * @return 1 if a completion is returned, 0 if the queue is empty
+ */
+int
+uring_next(uint64_t *ud, int *res, unsigned int *flags)
+{
+    struct io_uring_cqe *cqe;
+    unsigned int head;
+
+    head = *ring.cq_head;
+    if (head == load_acquire(ring.cq_tail))
+        return 0;
+
+    cqe = &ring.cqes[head & *ring.cq_mask];
+    *ud = cqe->user_data;
+    *res = cqe->res;
+    *flags = cqe->flags;
+    store_release(ring.cq_head, head + 1);
+
+    return 1;
+}
+
+/**
+ * Get the provided buffer of a completion.
+ */
+void *
+uring_buf(unsigned int flags)
+{
+    if (!(flags & IORING_CQE_F_BUFFER))
+        return NULL;
+
+    return ring.bufs +
+           (size_t)(flags >> IORING_CQE_BUFFER_SHIFT) * ring.bufsize;
+}
+
+/**
+ * Give the buffer of a completion back to the kernel once its bytes have
+ * been consumed.
+ */
+void
+uring_buf_recycle(unsigned int flags)
+{
+    if (!(flags & IORING_CQE_F_BUFFER))
+        return;
+
+    buf_add(flags >> IORING_CQE_BUFFER_SHIFT);
+    store_release(&ring.br->tail, ring.br_tail);
+}
@@ -0,0 +1,50 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stdint.h>
+
+/**
+ * Thin wrappers of io_uring system calls, used by the io_uring backend of
+ * the node loop (build with URING=1). There is only one ring per process.
+ */
+
+/* Entries of the submission queue */
+#define URING_ENTRIES   256
+/* Number and size of provided receive buffers, number must be power of 2 */
+#define URING_NBUFS     256
+#define URING_BUFSIZE   2048
+
+/* Set up the ring and the provided buffers, return -1 if not supported */
+int uring_init(unsigned int entries, unsigned int nbufs, unsigned int bufsize);
+
+/* Release the ring */
+void uring_exit();
+
+/* Multishot accept on a listening socket */
+int uring_accept(int fd, uint64_t ud);
+
+/* Multishot receive into provided buffers */
+int uring_recv(int fd, uint64_t ud);
+
+/* Send bytes, the buffer must stay valid until completion */
+int uring_send(int fd, const void *buf, unsigned int len, uint64_t ud);
+
+/* Poll for events, multishot if multi is nonzero */
+int uring_poll(int fd, unsigned int events, int multi, uint64_t ud);
+
+/* Cancel the request with user data target */
+int uring_cancel(uint64_t target, uint64_t ud);
+
+/* Submit requests, and wait at most timeout_ms for a completion */
+int uring_wait(int timeout_ms);
+
+/* Get next completion, return 0 if there is none */
+int uring_next(uint64_t *ud, int *res, unsigned int *flags);
+
+/* Get the provided buffer of a completion, NULL if it has no buffer */
+void * uring_buf(unsigned int flags);
+
+/* Give the buffer of a completion back to the kernel */
+void uring_buf_recycle(unsigned int flags);
+
+#endif
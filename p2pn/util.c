@@ -7,6 +7,7 @@
 
 #include "list.h"
 #include "proto.h"
+#include "sock_util.h"
 #include "util.h"
 
 extern enum LOGLEVEL        g_loglv;        /* Logging level */
@@ -17,10 +18,16 @@ extern struct message       g_msg_list;     /* List of messages */
 
 extern struct nb_node       g_nb_list;      /* List of neighbor nodes */
 extern int                  g_nb_list_size; /* Size of neighbor node list */
+extern unsigned int         g_nb_list_gen;  /* Changed with the neighbour set */
 
 extern struct wt_node       g_wt_list;      /* List of waiting nodes */
 extern int                  g_wt_list_size; /* Size of waiting node list */
 
+extern struct sockaddr_in6  g_lstn_addr;    /* Listening address */
+
+extern struct hc_entry      g_hc_list;      /* List of host cache entries */
+extern int                  g_hc_list_size; /* Size of host cache list */
+
 
 /* wrapper of the malloc() */
 static void *
@@ -36,6 +43,20 @@ Malloc(size_t size)
     return res;
 }
 
+/* wrapper of the realloc() */
+static void *
+Realloc(void *ptr, size_t size)
+{
+    void *res;
+
+    if ((res = realloc(ptr, size)) == NULL) {
+        perror("realloc error");
+        exit(1);
+    }
+
+    return res;
+}
+
 /******************************************************************************/
 /* Logging */
 void
@@ -60,24 +81,20 @@ p2plog_env()
     struct nb_node *nb;
     struct wt_node *wt;
 
-    char buf[XS_LEN];
-
     p2plog(DEBUG, "::::Waiting List::::[%d]\n", g_wt_list_size);
     list_for_each_entry(wt, &g_wt_list.list, list) {
-        p2plog(DEBUG, "%10d | %16s:%5d | nq = %5d | urgent = %5d\n",
+        p2plog(DEBUG, "%10d | %22s | nq = %5d | urgent = %5d\n",
            wt->connfd,
-           inet_ntop(AF_INET, &wt->ip, buf, sizeof(buf)),
-           ntohs(wt->lport),
+           sock_ntop(&wt->ip, wt->lport),
            wt->status,
            wt->urgent);
     }
 
     p2plog(DEBUG, "::::Neighbor List::::[%d]\n", g_nb_list_size);
     list_for_each_entry(nb, &g_nb_list.list, list) {
-        p2plog(DEBUG, "%10d | %16s:%5d\n",
+        p2plog(DEBUG, "%10d | %22s\n",
            nb->connfd,
-           inet_ntop(AF_INET, &nb->ip, buf, sizeof(buf)),
-           ntohs(nb->lport));
+           sock_ntop(&nb->ip, nb->lport));
     }
     p2plog(DEBUG, "\n\n");
 }
@@ -87,7 +104,7 @@ p2plog_env()
 /* key/value pairs */
 
 int
-g_kv_list_load_from_file(char *filename)
+g_kv_list_load_from_file(const char *filename)
 {
     FILE *fp;
 
@@ -107,8 +124,13 @@ g_kv_list_load_from_file(char *filename)
             return -1;
         }
 
-        key = strtok(buf, " ");
-        value = strtok(NULL, " ");
+        /* Blank lines and keys without a value are skipped */
+        if ((key = strtok(buf, " \t\r\n")) == NULL)
+            continue;
+        if ((value = strtok(NULL, " \t\r\n")) == NULL) {
+            p2plog(ERROR, "No value for key %s in file: %s\n", key, filename);
+            continue;
+        }
 
         keylen = strlen(key);
         if (keylen > KEY_MAX - 1) {
@@ -130,6 +152,59 @@ g_kv_list_load_from_file(char *filename)
     return 0;
 }
 
+static struct key_value *
+kv_find(struct key_value *head, const char *key)
+{
+    struct key_value *kv;
+
+    list_for_each_entry(kv, &head->list, list) {
+        if (strcmp(kv->key, key) == 0)
+            return kv;
+    }
+    return NULL;
+}
+
+struct key_value *
+g_kv_list_find(const char *key)
+{
+    return kv_find(&g_kv_list, key);
+}
+
+int
+g_kv_list_reload(const char *filename,
+                 void (*changed)(const char *key, uint32_t value))
+{
+    struct key_value old, *kv, *kv_old, *kv_tmp;
+
+    INIT_LIST_HEAD(&old.list);
+    list_splice_init(&g_kv_list.list, &old.list);
+
+    /* An empty file is most likely being written, not emptied on purpose */
+    if (g_kv_list_load_from_file(filename) != 0 || 
+        (list_empty(&g_kv_list.list) && !list_empty(&old.list))) {
+        list_for_each_entry_safe(kv, kv_tmp, &g_kv_list.list, list) {
+            list_del(&kv->list);
+            free(kv);
+        }
+        list_splice_init(&old.list, &g_kv_list.list);
+        return -1;
+    }
+
+    list_for_each_entry(kv, &g_kv_list.list, list) {
+        kv_old = kv_find(&old, kv->key);
+        if (kv_old == NULL || kv_old->value != kv->value)
+            changed(kv->key, kv->value);
+    }
+    list_for_each_entry_safe(kv_old, kv_tmp, &old.list, list) {
+        if (g_kv_list_find(kv_old->key) == NULL)
+            changed(kv_old->key, 0);
+        list_del(&kv_old->list);
+        free(kv_old);
+    }
+
+    return 0;
+}
+
 /* search value by key obtained from QUERY message */
 uint32_t
 g_kv_list_search(void *msg, unsigned int len)
@@ -166,16 +241,71 @@ g_kv_list_search(void *msg, unsigned int len)
 struct peer_cache *
 pc_new(int connfd)
 {
+    static unsigned int serial;
     struct peer_cache *pc;
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+    struct in6_addr ip;
+    uint16_t port;
 
     pc = (struct peer_cache *)Malloc(sizeof(struct peer_cache));
     memset(pc, 0, sizeof(struct peer_cache));
 
     pc->connfd = connfd;
+    pc->serial = ++serial;
+    if (pc->serial == 0)
+        pc->serial = ++serial;
+
+    /* Messages we originate carry the local address of the connection,
+     * resolve it once here instead of for every message */
+    pc->hdr.version = P_VERSION;
+    if (GetSockName(connfd, (SA *)&addr, &addrlen) != 0 ||
+        sock_fromaddr((SA *)&addr, &ip, &port) != 0)
+        ip = g_lstn_addr.sin6_addr;
+    pc->hdr.org_ip = sock_addr32(&ip);
+    pc->hdr.org_port = g_lstn_addr.sin6_port;
+    if (!sock_is_v4(&ip))
+        pc->hdr.reserved = H_F_ORG_IPV6;
     
     return pc;
 }
 
+/* Get the receive buffer of a peer cache, allocate it if necessary.
+ * Connections that never send anything cost no buffer memory. */
+unsigned char *
+pc_recvbuf(struct peer_cache *pc)
+{
+    if (pc->recvbuf == NULL)
+        pc->recvbuf = (unsigned char *)Malloc(BUF_MAX);
+
+    return pc->recvbuf;
+}
+
+/* Queue bytes to send to a peer, return -1 if the queue is full. The queue
+ * grows on demand, so a slow peer costs memory only up to SENDBUF_MAX. */
+int
+pc_enqueue(struct peer_cache *pc, const void *buf, unsigned int len)
+{
+    unsigned int cap;
+
+    if (pc->sp + len > pc->sendcap) {
+        cap = pc->sendcap > 0 ? pc->sendcap : BUF_MAX;
+        while (cap < pc->sp + len)
+            cap *= 2;
+        if (cap > SENDBUF_MAX)
+            return -1;
+
+        pc->sendbuf = (unsigned char *)Realloc(pc->sendbuf, cap);
+        pc->sendcap = cap;
+    }
+
+    memcpy(pc->sendbuf + pc->sp, buf, len);
+    pc->sp += len;
+    pc->sq++;
+
+    return 0;
+}
+
 /* Add a new peer cache to global peer cache list */
 void
 g_pc_list_add(struct peer_cache *pc)
@@ -189,6 +319,8 @@ g_pc_list_del(struct peer_cache *pc)
 {
     if (pc) {
         list_del(&pc->list);
+        free(pc->recvbuf);
+        free(pc->sendbuf);
         free(pc);        
     }
 }
@@ -215,6 +347,149 @@ g_pc_list_remove_by_connfd(int connfd)
     g_pc_list_del(pc);
 }
 
+/******************************************************************************/
+/* Token bucket */
+
+/* Initialize a full token bucket */
+void
+tb_init(struct token_bucket *tb, double rate, double burst)
+{
+    tb->tokens = burst;
+    tb->rate = rate;
+    tb->burst = burst;
+    gettimeofday(&tb->tv, NULL);
+}
+
+/* Take a token from the bucket, return 0 if it is empty */
+int
+tb_take(struct token_bucket *tb)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    tb->tokens += ((now.tv_sec - tb->tv.tv_sec) + 
+                   (now.tv_usec - tb->tv.tv_usec) / 1e6) * tb->rate;
+    if (tb->tokens > tb->burst)
+        tb->tokens = tb->burst;
+    tb->tv = now;
+
+    if (tb->tokens < 1)
+        return 0;
+
+    tb->tokens -= 1;
+    return 1;
+}
+
+
+/******************************************************************************/
+/* Admission control */
+
+/* The token bucket of a source address */
+struct adm_entry {
+    struct in6_addr     ip;             /* The /64 prefix for IPv6 */
+    struct token_bucket tb;
+    struct adm_entry   *next;           /* Next in the hash chain */
+    struct list_head    list;           /* The latest connection first */
+};
+
+static struct adm_entry *adm_hash[ADM_HASH_SIZE];
+static LIST_HEAD(adm_list);
+static int              adm_count;
+
+static uint32_t
+adm_bucket(const struct in6_addr *ipaddr)
+{
+    uint32_t w, h = 0;
+    int i;
+
+    for (i = 0; i < 16; i += 4) {
+        memcpy(&w, &ipaddr->s6_addr[i], 4);
+        h = (h ^ w) * 2654435761u;
+    }
+
+    return (h >> 16) & (ADM_HASH_SIZE - 1);
+}
+
+/* Unlink an entry from its hash chain */
+static void
+adm_unhash(struct adm_entry *ae)
+{
+    struct adm_entry **pp;
+
+    pp = &adm_hash[adm_bucket(&ae->ip)];
+    for ( ; *pp != NULL; pp = &(*pp)->next) {
+        if (*pp == ae) {
+            *pp = ae->next;
+            break;
+        }
+    }
+}
+
+/* Check if a new connection from the source address can be accepted.
+ *
+ * Each address has its own token bucket, so a busy host never takes the
+ * connections of another. When the table is full, the address that
+ * connected least recently gives its entry to the new one. It comes back
+ * with a full bucket, but only after ADM_MAX other addresses connected,
+ * which is no way around the limit for a host that has as many. An IPv6
+ * host usually owns a whole /64, so IPv6 addresses share the bucket of
+ * their /64 prefix.
+ */
+int
+adm_admit(struct in6_addr *ipaddr)
+{
+    struct adm_entry *ae;
+    struct in6_addr key = *ipaddr;
+    uint32_t h;
+
+    if (!sock_is_v4(&key))
+        memset(&key.s6_addr[8], 0, 8);
+
+    h = adm_bucket(&key);
+    for (ae = adm_hash[h]; ae != NULL; ae = ae->next) {
+        if (memcmp(&ae->ip, &key, sizeof(key)) == 0)
+            break;
+    }
+
+    if (ae != NULL) {
+        list_move(&ae->list, &adm_list);
+    } else {
+        if (adm_count >= ADM_MAX) {
+            ae = list_entry(adm_list.prev, struct adm_entry, list);
+            adm_unhash(ae);
+            list_del(&ae->list);
+        } else {
+            if ((ae = calloc(1, sizeof(struct adm_entry))) == NULL) {
+                perror("calloc error");
+                exit(1);
+            }
+            adm_count++;
+        }
+        ae->ip = key;
+        tb_init(&ae->tb, ADM_RATE, ADM_BURST);
+        ae->next = adm_hash[h];
+        adm_hash[h] = ae;
+        list_add(&ae->list, &adm_list);
+    }
+
+    return tb_take(&ae->tb);
+}
+
+/* Forget all source addresses */
+void
+adm_clear()
+{
+    struct adm_entry *ae, *ae_tmp;
+
+    list_for_each_entry_safe(ae, ae_tmp, &adm_list, list) {
+        list_del(&ae->list);
+        free(ae);
+    }
+    memset(adm_hash, 0, sizeof(adm_hash));
+    adm_count = 0;
+}
+
+
 /******************************************************************************/
 /* Messages */
 
@@ -251,56 +526,143 @@ msg_free(struct message *msg)
 {
     if (msg) {
         free(msg->content);
+        free(msg->tofd);
         free(msg);        
     }
 }
 
+void
+msg_sent_to(struct message *msg, int connfd)
+{
+    int *tofd;
+
+    /* Most QUERY go to a few neighbours, grow by as many */
+    if (msg->ntofd % 8 == 0) {
+        tofd = realloc(msg->tofd, (msg->ntofd + 8) * sizeof(int));
+        if (tofd == NULL) {
+            perror("realloc error");
+            exit(1);
+        }
+        msg->tofd = tofd;
+    }
+    msg->tofd[msg->ntofd++] = connfd;
+}
+
+int
+msg_was_sent_to(struct message *msg, int connfd)
+{
+    int i;
+
+    for (i = 0; i < msg->ntofd; i++) {
+        if (msg->tofd[i] == connfd)
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * The global message list is indexed by message id, it holds every message
+ * seen in the last 10 seconds and is looked up for each message received.
+ */
+static struct message  *msg_hash[MSG_HASH_SIZE];
+
+static uint32_t
+msg_bucket(uint32_t msgid)
+{
+    return (msgid * 2654435761u) & (MSG_HASH_SIZE - 1);
+}
+
+static void
+msg_unhash(struct message *msg)
+{
+    struct message **pp;
+
+    pp = &msg_hash[msg_bucket(get_msgid(msg))];
+    for ( ; *pp != NULL; pp = &(*pp)->next) {
+        if (*pp == msg) {
+            *pp = msg->next;
+            return;
+        }
+    }
+}
+
 /* Add a message to global message list */
 void
 g_msg_list_add(struct message *msg)
 {
-    if (msg) list_add(&msg->list, &g_msg_list.list);
+    uint32_t h;
+
+    if (msg) {
+        list_add(&msg->list, &g_msg_list.list);
+        h = msg_bucket(get_msgid(msg));
+        msg->next = msg_hash[h];
+        msg_hash[h] = msg;
+    }
 }
 
 /* Garbage Collect (gc) global message list.
  * Messages received for more than 10 seconds will be freed.
+ *
+ * New messages are added at the head, so the walk starts from the oldest
+ * and stops at the first one to keep.
  */
 void
 g_msg_list_gc()
 {
-    struct message *msg, *msgtmp;
+    struct message *msg;
+    struct list_head *pos;
     struct timeval tv;
 
     gettimeofday(&tv, NULL);
-    list_for_each_entry_safe(msg, msgtmp, &g_msg_list.list, list) {
-        if (tv.tv_sec - msg->tv.tv_sec > 10) {
-            p2plog(DEBUG, "free msg %08X in the msg list\n", get_msgid(msg));
-            list_del(&msg->list);
-            msg_free(msg);
-        }
+    pos = g_msg_list.list.prev;
+    while (pos != &g_msg_list.list) {
+        msg = list_entry(pos, struct message, list);
+        pos = pos->prev;
+        if (tv.tv_sec - msg->tv.tv_sec <= 10)
+            break;
+        if (msg->pinned)
+            continue;
+        p2plog(DEBUG, "free msg %08X in the msg list\n", get_msgid(msg));
+        msg_unhash(msg);
+        list_del(&msg->list);
+        msg_free(msg);
     }
 }
 
-/* Find a message by its message id in global message list */
+/* Find a message of the type by its message id in global message list */
 struct message *
-g_msg_list_find_by_id(uint32_t msgid)
+g_msg_list_find(uint32_t msgid, uint8_t type)
 {
     struct message *msg;
 
-    list_for_each_entry(msg, &g_msg_list.list, list) {
-        if (get_msgid(msg) == msgid)
+    for (msg = msg_hash[msg_bucket(msgid)]; msg != NULL; msg = msg->next) {
+        if (get_msgid(msg) == msgid && 
+            ((struct P2P_h *)msg->content)->msg_type == type)
             return msg;
     }
     return NULL;
 }
 
+/* Free all messages in global message list */
+void
+g_msg_list_clear()
+{
+    struct message *msg, *msgtmp;
+
+    list_for_each_entry_safe(msg, msgtmp, &g_msg_list.list, list) {
+        list_del(&msg->list);
+        msg_free(msg);
+    }
+    memset(msg_hash, 0, sizeof(msg_hash));
+}
+
 
 /******************************************************************************/
 /* Waiting nodes */
 
 /* Create a new waiting node */
 struct wt_node *
-wt_new(int connfd, struct in_addr *ipaddr, uint16_t lport)
+wt_new(int connfd, struct in6_addr *ipaddr, uint16_t lport)
 {
     struct wt_node * wt;
 
@@ -353,7 +715,7 @@ g_wt_list_find_by_connfd(int connfd)
 
 /* Search a waiting node by peer's IP address and port in global waiting list */
 struct wt_node *
-g_wt_list_find_by_peer(struct in_addr *ipaddr, uint16_t lport)
+g_wt_list_find_by_peer(struct in6_addr *ipaddr, uint16_t lport)
 {
     struct wt_node *wt;
     struct wt_node tgt;
@@ -368,13 +730,245 @@ g_wt_list_find_by_peer(struct in_addr *ipaddr, uint16_t lport)
     return NULL;
 }
 
+/* Count the incoming connections that have not sent JOIN yet */
+int
+g_wt_list_count_incoming()
+{
+    struct wt_node *wt;
+    int count = 0;
+
+    list_for_each_entry(wt, &g_wt_list.list, list) {
+        if (wt_connected(wt) && wt->status == 0) count++;
+    }
+
+    return count;
+}
+
+
+/******************************************************************************/
+/* Candidate peers */
+
+static struct cand     *cand_hash[CAND_HASH_SIZE];
+static struct cand     *cand_heap[CAND_MAX];    /* Max-heap by score */
+static int              cand_heap_size;
+static int              cand_size;
+
+/* Fibonacci hashing of the address and port */
+static uint32_t
+cand_bucket(struct in6_addr *ipaddr, uint16_t lport)
+{
+    return ((ntohl(sock_addr32(ipaddr)) ^ ((uint32_t)lport << 16)) * 
+            2654435761u) & (CAND_HASH_SIZE - 1);
+}
+
+static struct cand *
+cand_find(struct in6_addr *ipaddr, uint16_t lport)
+{
+    struct cand *c;
+
+    c = cand_hash[cand_bucket(ipaddr, lport)];
+    for ( ; c != NULL; c = c->next) {
+        if (memcmp(&c->ip, ipaddr, sizeof(c->ip)) == 0 && c->lport == lport)
+            return c;
+    }
+
+    return NULL;
+}
+
+/* Fresher candidates score higher, as do those that joined us before and
+ * those with short RTT, while failed attempts count against. Since the
+ * freshness is an absolute time, scores need no update as time passes. */
+static void
+cand_rescore(struct cand *c)
+{
+    c->score = (long)c->seen + 60L * c->joins - 60L * (c->tries - c->joins);
+    if (c->rtt > 0)
+        c->score -= c->rtt / 10;
+}
+
+static void
+cand_heap_swap(int i, int j)
+{
+    struct cand *c = cand_heap[i];
+
+    cand_heap[i] = cand_heap[j];
+    cand_heap[j] = c;
+    cand_heap[i]->heap_idx = i;
+    cand_heap[j]->heap_idx = j;
+}
+
+/* Restore the heap order around position i */
+static void
+cand_heap_fix(int i)
+{
+    int child;
+
+    while (i > 0 && cand_heap[(i - 1) / 2]->score < cand_heap[i]->score) {
+        cand_heap_swap(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+
+    while ((child = 2 * i + 1) < cand_heap_size) {
+        if (child + 1 < cand_heap_size && 
+            cand_heap[child + 1]->score > cand_heap[child]->score)
+            child++;
+        if (cand_heap[child]->score <= cand_heap[i]->score)
+            break;
+        cand_heap_swap(i, child);
+        i = child;
+    }
+}
+
+static void
+cand_heap_push(struct cand *c)
+{
+    c->heap_idx = cand_heap_size;
+    cand_heap[cand_heap_size++] = c;
+    cand_heap_fix(c->heap_idx);
+}
+
+static void
+cand_heap_remove(struct cand *c)
+{
+    int i = c->heap_idx;
+
+    if (i < 0)
+        return;
+    c->heap_idx = -1;
+    if (i != --cand_heap_size) {
+        cand_heap[i] = cand_heap[cand_heap_size];
+        cand_heap[i]->heap_idx = i;
+        cand_heap_fix(i);
+    }
+}
+
+/* Add or refresh a candidate advertised at time now, return -1 if it is 
+ * dropped because the set is full.
+ *
+ * A candidate taken for connection is back in the heap once advertised 
+ * again, the caller makes sure it is neither waiting nor a neighbour. */
+int
+cand_seen(struct in6_addr *ipaddr, uint16_t lport, time_t now)
+{
+    static time_t expired;
+    struct cand *c;
+    uint32_t h;
+
+    if ((c = cand_find(ipaddr, lport)) == NULL) {
+        if (cand_size >= CAND_MAX && now != expired) {
+            /* At most once per second, as it walks the whole set */
+            cand_expire(now);
+            expired = now;
+        }
+        if (cand_size >= CAND_MAX)
+            return -1;
+
+        c = (struct cand *)Malloc(sizeof(struct cand));
+        memset(c, 0, sizeof(struct cand));
+        c->ip = *ipaddr;
+        c->lport = lport;
+        c->rtt = -1;
+        c->heap_idx = -1;
+        h = cand_bucket(ipaddr, lport);
+        c->next = cand_hash[h];
+        cand_hash[h] = c;
+        cand_size++;
+    }
+
+    c->seen = now;
+    cand_rescore(c);
+    if (c->heap_idx < 0)
+        cand_heap_push(c);
+    else
+        cand_heap_fix(c->heap_idx);
+
+    return 0;
+}
+
+/* Take the candidate with the best score to connect to, NULL if none. It
+ * stays known, with its history, but out of the heap. */
+struct cand *
+cand_take()
+{
+    struct cand *c;
+
+    if (cand_heap_size == 0)
+        return NULL;
+
+    c = cand_heap[0];
+    cand_heap_remove(c);
+    c->tries++;
+    cand_rescore(c);
+
+    return c;
+}
+
+/* Record that a candidate became a neighbour */
+void
+cand_joined(struct in6_addr *ipaddr, uint16_t lport)
+{
+    struct cand *c;
+
+    if ((c = cand_find(ipaddr, lport)) == NULL || c->joins >= c->tries)
+        return;
+
+    c->joins++;
+    cand_rescore(c);
+    if (c->heap_idx >= 0)
+        cand_heap_fix(c->heap_idx);
+}
+
+/* Record the RTT measured to a candidate while it is a neighbour */
+void
+cand_rtt(struct in6_addr *ipaddr, uint16_t lport, int rtt)
+{
+    struct cand *c;
+
+    if ((c = cand_find(ipaddr, lport)) == NULL)
+        return;
+
+    c->rtt = rtt;
+    cand_rescore(c);
+    if (c->heap_idx >= 0)
+        cand_heap_fix(c->heap_idx);
+}
+
+/* Forget candidates not advertised for CAND_EXPIRE_SECONDS */
+void
+cand_expire(time_t now)
+{
+    struct cand **pp, *c;
+    int i;
+
+    for (i = 0; i < CAND_HASH_SIZE; i++) {
+        pp = &cand_hash[i];
+        while ((c = *pp) != NULL) {
+            if (now - c->seen > CAND_EXPIRE_SECONDS) {
+                *pp = c->next;
+                cand_heap_remove(c);
+                cand_size--;
+                free(c);
+            } else {
+                pp = &c->next;
+            }
+        }
+    }
+}
+
+/* Number of candidates known */
+int
+cand_count()
+{
+    return cand_size;
+}
+
 
 /******************************************************************************/
 /* Neighbour nodes */
 
 /* Create a new neighbour node */
 struct nb_node *
-nb_new(int connfd, struct in_addr *ipaddr, uint16_t lport)
+nb_new(int connfd, struct in6_addr *ipaddr, uint16_t lport)
 {
     struct nb_node * nb;
 
@@ -385,6 +979,9 @@ nb_new(int connfd, struct in_addr *ipaddr, uint16_t lport)
     nb->ip = *ipaddr;
     nb->lport = lport;
     nb->ts = time(NULL);
+    nb->rtt = -1;
+    tb_init(&nb->qtb, NB_QUERY_RATE, NB_QUERY_BURST);
+    INIT_LIST_HEAD(&nb->qq.list);
 
     return nb;
 }
@@ -396,6 +993,7 @@ g_nb_list_add(struct nb_node *nb)
     if (nb) {
         list_add(&nb->list, &g_nb_list.list);
         g_nb_list_size++;
+        g_nb_list_gen++;
     }
 }
 
@@ -404,8 +1002,15 @@ void
 g_nb_list_del(struct nb_node *nb)
 {
     if (nb) {
+        struct message *msg, *msgtmp;
+        list_for_each_entry_safe(msg, msgtmp, &nb->qq.list, list) {
+            list_del(&msg->list);
+            msg_free(msg);
+        }
         list_del(&nb->list);
         g_nb_list_size--;
+        g_nb_list_gen++;
+        free(nb->kidx);
         free(nb);
     }
 }
@@ -425,7 +1030,7 @@ g_nb_list_find_by_connfd(int connfd)
 
 /* Search a neighbour by peer's IP address and port in global neighbour list */
 struct nb_node *
-g_nb_list_find_by_peer(struct in_addr *ipaddr, uint16_t lport)
+g_nb_list_find_by_peer(struct in6_addr *ipaddr, uint16_t lport)
 {
     struct nb_node *nb;
     struct nb_node tgt;
@@ -439,3 +1044,178 @@ g_nb_list_find_by_peer(struct in_addr *ipaddr, uint16_t lport)
 
     return NULL;
 }
+
+
+/******************************************************************************/
+/* Host cache */
+
+/* Check if host cache entry e1 should be tried before e2 */
+static int
+hc_before(struct hc_entry *e1, struct hc_entry *e2)
+{
+    if (e1->last_seen != e2->last_seen)
+        return e1->last_seen > e2->last_seen;
+
+    /* Unknown RTT goes last */
+    if (e1->rtt < 0 || e2->rtt < 0)
+        return e2->rtt < 0 && e1->rtt >= 0;
+
+    return e1->rtt < e2->rtt;
+}
+
+/* Insert or refresh a peer in global host cache list.
+ * The list is kept sorted, most recently seen and fastest peers first.
+ */
+void
+g_hc_list_update(struct in6_addr *ipaddr, uint16_t lport,
+                 time_t last_seen, int rtt)
+{
+    struct hc_entry *hc, *hc_tmp;
+    struct hc_entry tgt;
+
+    tgt.ip = *ipaddr;
+    tgt.lport = lport;
+
+    list_for_each_entry_safe(hc, hc_tmp, &g_hc_list.list, list) {
+        if (node_eq(hc, &tgt)) {
+            /* Keep the old RTT if we have no new measurement */
+            if (rtt < 0) rtt = hc->rtt;
+            list_del(&hc->list);
+            g_hc_list_size--;
+            free(hc);
+        }
+    }
+
+    hc = (struct hc_entry *)Malloc(sizeof(struct hc_entry));
+    memset(hc, 0, sizeof(struct hc_entry));
+    hc->ip = *ipaddr;
+    hc->lport = lport;
+    hc->last_seen = last_seen;
+    hc->rtt = rtt;
+
+    list_for_each_entry(hc_tmp, &g_hc_list.list, list) {
+        if (hc_before(hc, hc_tmp)) break;
+    }
+    /* Insert before hc_tmp, or at the tail if we reached the head */
+    list_add_tail(&hc->list, &hc_tmp->list);
+    g_hc_list_size++;
+
+    /* Drop the worst entries beyond the limit */
+    while (g_hc_list_size > HC_MAX) {
+        hc = list_entry(g_hc_list.list.prev, struct hc_entry, list);
+        list_del(&hc->list);
+        g_hc_list_size--;
+        free(hc);
+    }
+}
+
+/* Load global host cache list from file
+ * Format of each line: <ip:port> <last_seen:unix time> <rtt:ms>
+ */
+int
+g_hc_list_load_from_file(const char *filename)
+{
+    FILE *fp;
+
+    if((fp = fopen(filename, "r")) == NULL) {
+        p2plog(WARN, "No host cache in file: %s\n", filename);
+        return -1;
+    }
+
+    char buf[M_LEN], peer[S_LEN];
+    long last_seen;
+    int rtt;
+    struct in6_addr ip;
+    uint16_t port;
+    time_t now = time(NULL);
+
+    while (fgets(buf, M_LEN, fp)) {
+        if (sscanf(buf, "%63s %ld %d", peer, &last_seen, &rtt) != 3 ||
+            sock_pton(peer, &ip, &port) < 0) {
+            p2plog(WARN, "Invalid host cache line in file: %s\n", filename);
+            continue;
+        }
+
+        if (now - last_seen > HC_EXPIRE_SECONDS) 
+            continue;
+
+        g_hc_list_update(&ip, port, last_seen, rtt);
+    }
+
+    fclose(fp);
+    p2plog(INFO, "Load %d peers from host cache\n", g_hc_list_size);
+    return 0;
+}
+
+/* Save global host cache list to file
+ * The file is replaced atomically so that a crash never leaves it truncated.
+ */
+int
+g_hc_list_save_to_file(const char *filename)
+{
+    FILE *fp;
+    char tmpname[L_LEN];
+
+    if (snprintf(tmpname, L_LEN, "%s.tmp", filename) >= L_LEN) {
+        p2plog(ERROR, "Host cache file name too long: %s\n", filename);
+        return -1;
+    }
+
+    if((fp = fopen(tmpname, "w")) == NULL) {
+        p2plog(ERROR, "Failed to open file: %s\n", tmpname);
+        return -1;
+    }
+
+    struct hc_entry *hc;
+    list_for_each_entry(hc, &g_hc_list.list, list) {
+        fprintf(fp, "%s %ld %d\n", sock_ntop(&hc->ip, hc->lport), 
+                (long)hc->last_seen, hc->rtt);
+    }
+
+    if (fclose(fp) != 0 || rename(tmpname, filename) != 0) {
+        p2plog(ERROR, "Failed to save host cache: %s\n", filename);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Compare two key hashes, used for sorting and searching the key index */
+static int
+kidx_cmp(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* Replace the key index of a leaf neighbour */
+void
+nb_kidx_set(struct nb_node *nb, uint32_t *hashes, int n)
+{
+    free(nb->kidx);
+    nb->kidx = NULL;
+    nb->kidx_len = 0;
+
+    if (n > 0) {
+        nb->kidx = (uint32_t *)Malloc(n * sizeof(uint32_t));
+        memcpy(nb->kidx, hashes, n * sizeof(uint32_t));
+        qsort(nb->kidx, n, sizeof(uint32_t), kidx_cmp);
+        nb->kidx_len = n;
+    }
+    if (!nb->leaf)
+        g_nb_list_gen++;    /* Leaves are not advertised in PONG */
+    nb->leaf = 1;
+}
+
+/* Check if the key index of a leaf neighbour contains the key hash */
+int
+nb_kidx_has(struct nb_node *nb, uint32_t hash)
+{
+    if (nb->kidx_len == 0)
+        return 0;
+
+    return bsearch(&hash, nb->kidx, nb->kidx_len, sizeof(uint32_t), 
+                   kidx_cmp) != NULL;
+}
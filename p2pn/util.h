@@ -34,6 +34,15 @@ void p2plog_all(enum LOGLEVEL lv, const char *file, const int line,
 void p2plog_env();
 
 
+/******************************************************************************/
+/* Role of the node in the overlay */
+enum NODEMODE {
+    MODE_PEER,          /* Plain peer, every node is equal */
+    MODE_SUPER,         /* Super-peer, serves queries on behalf of leaves */
+    MODE_LEAF           /* Leaf, attaches to few super-peers, never relays */
+};
+
+
 /******************************************************************************/
 /* The structure of key/value pairs */
 struct key_value {
@@ -42,7 +51,16 @@ struct key_value {
     struct list_head list;
 };
 
-int g_kv_list_load_from_file(char *filename);
+int g_kv_list_load_from_file(const char *filename);
+
+/* Load the file again, changed() is called for each key whose value is new
+   or changed, and with 0 for each key that is gone. The pairs are kept if
+   the file cannot be read, or has no pairs left */
+int g_kv_list_reload(const char *filename,
+                     void (*changed)(const char *key, uint32_t value));
+
+/* Find the pair of a key, NULL if there is none */
+struct key_value * g_kv_list_find(const char *key);
 
 /* search value by key obtained from QUERY message */
 uint32_t g_kv_list_search(void *msg, unsigned int len);
@@ -52,14 +70,34 @@ uint32_t g_kv_list_search(void *msg, unsigned int len);
 /* The structure of peer cache */
 struct peer_cache {
     int                 connfd;
-    unsigned char       recvbuf[BUF_MAX];
+    unsigned int        serial;     /* Unique ID, connfd might be reused */
+    unsigned char      *recvbuf;    /* BUF_MAX bytes, allocated on first use */
     unsigned int        bp;
+    unsigned char      *sendbuf;    /* Bytes queued to send */
+    unsigned int        sp;
+    unsigned int        sendcap;
+    unsigned int        sq;         /* Messages queued, not all written */
+    int                 sending;    /* A send is in flight */
+    struct P2P_h        hdr;        /* Header template, origin of messages */
     struct list_head    list;
 };
 
+/* Max number of bytes queued to send to a peer */
+#define SENDBUF_MAX    (64 * 1024)
+
+/* Defaults of the backlog and of the bytes read from a peer at once */
+#define LISTEN_QUEUE         5
+#define RECV_BUDGET      65536
+
 /* Create a new peer cache for a new socket descriptor */
 struct peer_cache * pc_new(int connfd);
 
+/* Get the receive buffer of a peer cache, allocate it if necessary */
+unsigned char * pc_recvbuf(struct peer_cache *pc);
+
+/* Queue bytes to send to a peer, return -1 if the queue is full */
+int pc_enqueue(struct peer_cache *pc, const void *buf, unsigned int len);
+
 /* Add a new peer cache to global peer cache list */
 void g_pc_list_add(struct peer_cache *pc);
 
@@ -72,6 +110,39 @@ struct peer_cache * g_pc_list_find_by_connfd(int connfd);
 /* Delete a peer cache found by socket descriptor from global peer cache list */
 void g_pc_list_remove_by_connfd(int connfd);
 
+/******************************************************************************/
+/* Token bucket for rate limiting */
+struct token_bucket {
+    double              tokens;
+    double              rate;       /* Tokens added per second */
+    double              burst;      /* Max number of tokens */
+    struct timeval      tv;         /* Last refill */
+};
+
+/* Initialize a full token bucket */
+void tb_init(struct token_bucket *tb, double rate, double burst);
+
+/* Take a token from the bucket, return 0 if it is empty */
+int tb_take(struct token_bucket *tb);
+
+
+/******************************************************************************/
+/* Admission control of incoming connections */
+
+/* Source addresses with a token bucket, the least recent is forgotten */
+#define ADM_MAX            1024
+#define ADM_HASH_SIZE      512          /* Power of 2 */
+/* Connections accepted from one address per second, and in a burst */
+#define ADM_RATE           0.5
+#define ADM_BURST          4
+
+/* Check if a new connection from the source address can be accepted */
+int adm_admit(struct in6_addr *ipaddr);
+
+/* Forget all source addresses */
+void adm_clear();
+
+
 /******************************************************************************/
 /* The structure of stored messages */
 struct message {
@@ -80,15 +151,36 @@ struct message {
     int fromfd;                         /* zero:     from itself. 
                                          * Non-zero: from others. */
     struct timeval tv;
+    int pinned;                         /* Not collected while set, e.g.
+                                         * a query waiting for hits */
+    int cancelled;                      /* QUERY cancelled by its sender,
+                                         * its hits are dropped */
+    int walk;                           /* QUERY searched by walkers */
+    int routed;                         /* QUERY sent along learnt routes,
+                                         * no hit has come back yet */
+    int *tofd;                          /* QUERY: neighbours it was sent to,
+                                         * a CANCEL follows it there */
+    int ntofd;
+    int nextfd;                         /* Walks: where a walker went last,
+                                         * or its check-back came from */
+    struct message *next;               /* Next in the hash chain */
     struct list_head list;
 };
 
+#define MSG_HASH_SIZE       4096        /* Power of 2 */
+
 /* Create a new message */
 struct message * msg_new(void *content, unsigned int len, int fromfd);
 
 /* Free the memory of a message */
 void msg_free(struct message *msg);
 
+/* Remember that a QUERY was sent to the neighbour */
+void msg_sent_to(struct message *msg, int connfd);
+
+/* Was the QUERY sent to the neighbour? */
+int msg_was_sent_to(struct message *msg, int connfd);
+
 /* Add a message to global message list */
 void g_msg_list_add(struct message *msg);
 
@@ -97,8 +189,15 @@ void g_msg_list_add(struct message *msg);
  */
 void g_msg_list_gc();
 
-/* Find a message by its message id in global message list*/
-struct message * g_msg_list_find_by_id(uint32_t msgid);
+/**
+ * Find a message of the type by its message id in global message list. IDs
+ * are only unique per type: a probe, a QUERY and a CANCEL are all kept, and
+ * a message with the ID of one must not be taken for another.
+ */
+struct message * g_msg_list_find(uint32_t msgid, uint8_t type);
+
+/* Free all messages in global message list */
+void g_msg_list_clear();
 
 
 /******************************************************************************/
@@ -108,14 +207,15 @@ struct message * g_msg_list_find_by_id(uint32_t msgid);
  */
 struct wt_node {
     int                 connfd;
-    struct in_addr      ip;
+    struct in6_addr     ip;
     uint16_t            lport;
     int                 urgent;     /* Is it an urgent one? eg. for bootstrap */
     int                 status;     /* 0: new peer that connected to us, 
                                           but no JOIN Request yet.
                                        1: peer discovered, JOIN Request sent.
                                        2: we are waiting for JOIN 
-                                          Request/Accept. */
+                                          Request/Accept.
+                                       3: connection in progress. */
     time_t              ts;         /* Timestamp */
     struct list_head    list;
 };
@@ -135,8 +235,11 @@ struct wt_node {
 /* Check if the JOIN message has been sent to the waiting node */
 #define wt_requested(wt)      ((wt)->status > 0)
 
+/* Check if the connection to the waiting node is still in progress */
+#define wt_connecting(wt)     ((wt)->status == 3)
+
 /* Create a new waiting node */
-struct wt_node * wt_new(int connfd, struct in_addr *ipaddr, uint16_t lport);
+struct wt_node * wt_new(int connfd, struct in6_addr *ipaddr, uint16_t lport);
 
 /* Add a new waiting node to global waiting list */
 void g_wt_list_add(struct wt_node *wt);
@@ -148,26 +251,93 @@ void g_wt_list_del(struct wt_node *wt);
 struct wt_node * g_wt_list_find_by_connfd(int connfd);
 
 /* Search a waiting node by peer's IP address and port in global waiting list */
-struct wt_node * g_wt_list_find_by_peer(struct in_addr *ipaddr, uint16_t lport);
+struct wt_node * g_wt_list_find_by_peer(struct in6_addr *ipaddr, uint16_t lport);
+
+/* Count the incoming connections that have not sent JOIN yet */
+int g_wt_list_count_incoming();
+
+
+/******************************************************************************/
+/* Candidate peers learnt from PONG, to be connected when more neighbours are
+ * needed. They are kept in a hash table by address and a heap by score. */
+#define CAND_MAX            1024
+#define CAND_HASH_SIZE      2048        /* Power of 2 */
+#define CAND_EXPIRE_SECONDS 300         /* Forget if not advertised since */
+
+struct cand {
+    struct in6_addr     ip;
+    uint16_t            lport;
+    time_t              seen;       /* Last advertised in a PONG */
+    int                 tries;      /* Connection attempts */
+    int                 joins;      /* Attempts that made a neighbour */
+    int                 rtt;        /* Round trip time in ms, -1 if unknown */
+    long                score;
+    int                 heap_idx;   /* Position in the heap, -1 if taken */
+    struct cand        *next;       /* Next in the hash chain */
+};
+
+/* Add or refresh a candidate advertised at time now, return -1 if it is 
+ * dropped because the set is full */
+int cand_seen(struct in6_addr *ipaddr, uint16_t lport, time_t now);
+
+/* Take the candidate with the best score to connect to, NULL if none */
+struct cand * cand_take();
+
+/* Record that a candidate became a neighbour */
+void cand_joined(struct in6_addr *ipaddr, uint16_t lport);
+
+/* Record the RTT measured to a candidate while it is a neighbour */
+void cand_rtt(struct in6_addr *ipaddr, uint16_t lport, int rtt);
+
+/* Forget candidates not advertised for CAND_EXPIRE_SECONDS */
+void cand_expire(time_t now);
+
+/* Number of candidates known */
+int cand_count();
 
 
 /******************************************************************************/
+/* Inbound QUERY messages accepted from one neighbour per second, in a burst,
+ * and queued for processing */
+#define NB_QUERY_RATE       20
+#define NB_QUERY_BURST      40
+#define NB_QUERY_QLEN       64
+
 /* The structure of neighbour nodes */
 struct nb_node {
     int                 connfd;
-    struct in_addr      ip;
+    struct in6_addr     ip;
     uint16_t            lport;
     time_t              ts;
+    struct timeval      hb_tv;      /* When the pending heartbeat was sent */
+    int                 rtt;        /* Heartbeat round trip time in ms,
+                                       -1 if not measured yet */
+    time_t              probed;     /* When the last probe was sent */
+    int                 leaf;       /* Is it a leaf that uploaded its index? */
+    uint32_t           *kidx;       /* Sorted key hashes of the leaf */
+    int                 kidx_len;   /* Number of key hashes in kidx */
+    struct token_bucket qtb;        /* Rate limit of inbound QUERY */
+    struct message      qq;         /* Queue of QUERY to be processed */
+    int                 qq_len;     /* Number of messages in the queue */
+    int                 deficit;    /* Deficit counter in bytes for DRR */
+    unsigned long       q_throttled;/* Number of QUERY dropped by limits */
+    int                 udp;        /* Does it take datagrams? */
+    time_t              udp_ts;     /* When the last datagram was received */
+    int                 udp_miss;   /* Heartbeats unanswered over UDP */
+    int                 gossip;     /* Does it gossip the network size? */
+    int                 degree;     /* Its relaying neighbours as gossiped,
+                                       0 if not known */
+    time_t              gossiped;   /* When it was last sent our minima */
     struct list_head    list;
 };
 
 /* Compare if the two node are equal */
 #define node_eq(n1, n2) \
-    (memcmp(&(n1)->ip, &(n2)->ip, sizeof(struct in_addr)) == 0 && \
+    (memcmp(&(n1)->ip, &(n2)->ip, sizeof(struct in6_addr)) == 0 && \
      memcmp(&(n1)->lport, &(n2)->lport, sizeof(uint16_t)) == 0)
 
 /* Create a new neighbour node */
-struct nb_node * nb_new(int connfd, struct in_addr *ipaddr, uint16_t lport);
+struct nb_node * nb_new(int connfd, struct in6_addr *ipaddr, uint16_t lport);
 
 /* Add a new neighbor to global neighbor list */
 void g_nb_list_add(struct nb_node *nb);
@@ -179,6 +349,42 @@ void g_nb_list_del(struct nb_node *nb);
 struct nb_node * g_nb_list_find_by_connfd(int connfd);
 
 /* Search a neighbour by peer's IP address and port in global neighbour list */
-struct nb_node * g_nb_list_find_by_peer(struct in_addr *ipaddr, uint16_t lport);
+struct nb_node * g_nb_list_find_by_peer(struct in6_addr *ipaddr, uint16_t lport);
+
+/* Replace the key index of a leaf neighbour */
+void nb_kidx_set(struct nb_node *nb, uint32_t *hashes, int n);
+
+/* Check if the key index of a leaf neighbour contains the key hash */
+int nb_kidx_has(struct nb_node *nb, uint32_t hash);
+
+
+/******************************************************************************/
+/* Max number of peers kept in host cache */
+#define HC_MAX              32
+/* Peers not seen for this long are dropped from host cache */
+#define HC_EXPIRE_SECONDS   (24 * 3600)
+
+/* The structure of host cache entries
+ * Known-good peers which are saved to a file and reconnected after restart.
+ */
+struct hc_entry {
+    struct in6_addr     ip;
+    uint16_t            lport;
+    time_t              last_seen;  /* Last time the peer was a neighbour */
+    int                 rtt;        /* Round trip time in ms, -1 if unknown */
+    struct list_head    list;
+};
+
+/* Insert or refresh a peer in global host cache list.
+ * The list is kept sorted, most recently seen and fastest peers first.
+ */
+void g_hc_list_update(struct in6_addr *ipaddr, uint16_t lport,
+                      time_t last_seen, int rtt);
+
+/* Load global host cache list from file */
+int g_hc_list_load_from_file(const char *filename);
+
+/* Save global host cache list to file */
+int g_hc_list_save_to_file(const char *filename);
 
 #endif